@@ -0,0 +1,6 @@
+# Build the fuzz env with clang and link libFuzzer's main
+Import("env")
+
+sanitizers = ["-fsanitize=fuzzer,address,undefined", "-fno-sanitize-recover=undefined", "-g", "-O1"]
+env.Replace(CC="clang", CXX="clang++", LINK="clang++")
+env.Append(CCFLAGS=sanitizers, LINKFLAGS=sanitizers)
@@ -0,0 +1,114 @@
+// libFuzzer target for the serial command router. Each input goes through
+// parseCommand(), the same lib/SessionCore code handleSerialCommand()
+// dispatches on, and is also tried as a typed session name, as irModeLoop()
+// does at its prompt. A parsed command must stay inside the line and keep
+// what it promises to the firmware; the slowest line is reported at exit.
+
+#include <SessionCommand.h>
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_FILE_COUNT 3             // Files listed, so "send 4" is out of range
+
+static const char *fileList[FUZZ_FILE_COUNT] = {"/log1.bin", "/log2.bin", "/log3.bin"};
+static uint64_t worstLatencyUs = 0;
+static size_t worstLatencySize = 0;
+
+static void require(bool condition, const char *what) {
+  if (!condition) {
+    fprintf(stderr, "Invariant broken: %s\n", what);
+    abort();
+  }
+}
+
+static void reportWorstLatency() {
+  fprintf(stderr, "Slowest line: %llu us for %zu bytes\n", (unsigned long long)worstLatencyUs, worstLatencySize);
+}
+
+static void sessionName(const char *text, size_t length) {
+  char path[MAX_PATH_LENGTH + 1];
+  if (!buildSessionFileName(text, length, path, sizeof(path))) return;
+  size_t pathLength = strlen(path);
+  require(pathLength <= MAX_PATH_LENGTH, "session path fits SPIFFS");
+  require(path[0] == '/' && path[1] != '.', "session path is not an internal file");
+  require(strcmp(path + pathLength - strlen(SESSION_EXTENSION), SESSION_EXTENSION) == 0, "session path extension");
+}
+
+// The fileList[] lookup the firmware does with a valid file number
+static void fileArgument(const Command &command) {
+  require(command.number >= 1 && command.number <= FUZZ_FILE_COUNT, "file number in range");
+  require(fileList[command.number - 1] != nullptr, "file listed");
+}
+
+static void checkCommand(const Command &command, const char *text, size_t length) {
+  if (command.text) {
+    require(command.text >= text && command.text + command.textLength <= text + length, "argument inside the line");
+  }
+  if (!command.valid) return;
+  switch (command.id) {
+    case CMD_DELETE:
+    case CMD_SEND:
+    case CMD_RENAME:
+    case CMD_QUERY:
+      fileArgument(command);
+      break;
+    case CMD_STARTKEY:
+    case CMD_MARKERKEY:
+    case CMD_SELECTKEY:
+      require(command.number >= 0 && command.number <= KEY_NONE, "key code fits uint16_t");
+      break;
+    case CMD_TC_SET: {
+      require(command.frame < (uint32_t)command.rate.fps * 86400, "timecode within a day");
+      char formatted[16];
+      formatTimecode(command.frame, command.rate, formatted, sizeof(formatted));
+      // Parsing what was formatted gives the same frame back
+      uint32_t again = 0;
+      require(parseTimecode(formatted, strlen(formatted), command.rate, again) && again == command.frame,
+              "timecode round trip");
+      break;
+    }
+    default:
+      break;
+  }
+  if (command.id == CMD_QUERY) {
+    require(command.filter.fromUs <= command.filter.toUs, "query range ordered");
+    require(command.filter.key >= -1 && command.filter.key < keyMapSize && command.filter.type <= REC_GAP,
+            "query filter in range");
+  }
+  if (command.id == CMD_META_SET || command.id == CMD_LIST_FILTER) {
+    const SessionMeta &meta = command.meta;
+    require(memchr(meta.operatorName, '\0', sizeof(meta.operatorName)) && memchr(meta.scene, '\0', sizeof(meta.scene)) &&
+                memchr(meta.take, '\0', sizeof(meta.take)) && memchr(meta.remote, '\0', sizeof(meta.remote)),
+            "metadata strings terminated");
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static bool registered = false;
+  if (!registered) {
+    atexit(reportWorstLatency);
+    registered = true;
+  }
+  // Copy so a read past the end lands in ASan's redzone, not in libFuzzer's buffer
+  char *text = (char *)malloc(size ? size : 1);
+  memcpy(text, data, size);
+  CommandContext context = {FUZZ_FILE_COUNT, {25, false, false}, {}};
+  Command command;
+  auto start = std::chrono::steady_clock::now();
+  const char *line = text;
+  size_t lineLength = size;
+  trimSpan(line, lineLength);
+  sessionName(line, lineLength);
+  parseCommand(text, size, context, command);
+  uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+  checkCommand(command, text, size);
+  free(text);
+  if (us > worstLatencyUs) {
+    worstLatencyUs = us;
+    worstLatencySize = size;
+  }
+  return 0;
+}
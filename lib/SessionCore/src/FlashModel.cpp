@@ -0,0 +1,155 @@
+#include "FlashModel.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// "FSCAL fill=41.2 open_create_us=... stall_avg_us=..."; words without '='
+// are skipped, and pages, stalls and erase_us may be missing from older lines
+bool parseFsCal(const char *line, size_t length, FlashCosts &costs) {
+  static const struct {
+    const char *key;
+    size_t offset;
+    bool required;
+  } fields[] = {
+    {"open_create_us", offsetof(FlashCosts, openCreateUs), true},
+    {"open_append_us", offsetof(FlashCosts, openAppendUs), true},
+    {"record_append_us", offsetof(FlashCosts, recordAppendUs), true},
+    {"page_write_us", offsetof(FlashCosts, pageWriteUs), true},
+    {"close_us", offsetof(FlashCosts, closeUs), true},
+    {"remove_us", offsetof(FlashCosts, removeUs), true},
+    {"erase_us", offsetof(FlashCosts, eraseUs), false},
+    {"pages", offsetof(FlashCosts, pages), false},
+    {"stalls", offsetof(FlashCosts, stalls), false},
+    {"stall_avg_us", offsetof(FlashCosts, stallAvgUs), true},
+  };
+  const int fieldCount = sizeof(fields) / sizeof(fields[0]);
+  uint32_t seen = 0;
+  bool fillSeen = false;
+  const char *word;
+  size_t wordLength;
+  memset(&costs, 0, sizeof(costs));
+  trimSpan(line, length);
+  while (nextWord(line, length, word, wordLength)) {
+    const char *equals = (const char *)memchr(word, '=', wordLength);
+    if (!equals) continue;
+    size_t keyLength = equals - word;
+    size_t valueLength = wordLength - keyLength - 1;
+    char value[16];
+    if (valueLength == 0 || valueLength >= sizeof(value)) return false;
+    memcpy(value, equals + 1, valueLength);
+    value[valueLength] = '\0';
+    char *end = nullptr;
+    if (spanEquals(word, keyLength, "fill")) {
+      costs.fillPct = strtof(value, &end);
+      if (*end != '\0' || costs.fillPct < 0 || costs.fillPct > 100) return false;
+      fillSeen = true;
+      continue;
+    }
+    for (int i = 0; i < fieldCount; i++) {
+      if (!spanEquals(word, keyLength, fields[i].key)) continue;
+      if (value[0] < '0' || value[0] > '9') return false;
+      unsigned long number = strtoul(value, &end, 10);
+      if (*end != '\0' || number > UINT32_MAX) return false;
+      *(uint32_t *)((uint8_t *)&costs + fields[i].offset) = (uint32_t)number;
+      seen |= 1UL << i;
+    }
+  }
+  for (int i = 0; i < fieldCount; i++) {
+    if (fields[i].required && !(seen & (1UL << i))) return false;
+  }
+  if (costs.pages == 0) costs.stalls = 0;
+  if (costs.stalls > costs.pages) return false;
+  if (costs.eraseUs == 0) costs.eraseUs = costs.stallAvgUs;
+  return fillSeen;
+}
+
+void flashModelInit(FlashModel &model, const FlashCosts &costs, uint32_t capacityBytes, uint32_t usedBytes) {
+  memset(&model, 0, sizeof(model));
+  model.costs = costs;
+  model.capacityBytes = capacityBytes;
+  model.usedBytes = usedBytes < capacityBytes ? usedBytes : capacityBytes;
+}
+
+// Cleaning cost of a log-structured store: to free a block, GC first moves
+// the live data in it, about fill / (1 - fill) of a block per block freed
+static float cleaningCost(float fill) {
+  if (fill < 0.01f) fill = 0.01f;
+  if (fill > FLASH_FILL_MAX) fill = FLASH_FILL_MAX;
+  return fill / (1 - fill);
+}
+
+// GC stalls per page written at the current fill, scaled from the rate
+// measured at the calibration fill
+float flashStallRate(const FlashModel &model) {
+  const FlashCosts &costs = model.costs;
+  if (costs.pages == 0 || costs.stalls == 0 || model.capacityBytes == 0) return 0;
+  float measured = (float)costs.stalls / costs.pages;
+  float fill = (float)model.usedBytes / model.capacityBytes;
+  float rate = measured * cleaningCost(fill) / cleaningCost(costs.fillPct / 100);
+  return rate < 1 ? rate : 1;
+}
+
+static uint32_t flashSpend(FlashModel &model, uint32_t us) {
+  model.elapsedUs += us;
+  return us;
+}
+
+// One SPIFFS page write, paying for a GC stall whenever a whole one is owed
+static uint32_t flashProgram(FlashModel &model) {
+  uint32_t us = model.costs.pageWriteUs;
+  model.programs++;
+  model.stallDebt += flashStallRate(model);
+  if (model.stallDebt >= 1) {
+    model.stallDebt -= 1;
+    model.stalls++;
+    us += model.costs.stallAvgUs;
+  }
+  return us;
+}
+
+uint32_t flashOpen(FlashModel &model, bool create) {
+  model.opens++;
+  model.pageFill = 0;
+  return flashSpend(model, create ? model.costs.openCreateUs : model.costs.openAppendUs);
+}
+
+// Data sits in the file's cache until a page fills
+uint32_t flashAppend(FlashModel &model, uint32_t bytes) {
+  uint32_t us = model.costs.recordAppendUs;
+  uint32_t room = model.capacityBytes - model.usedBytes;
+  model.usedBytes += bytes < room ? bytes : room;
+  model.pageFill += bytes;
+  while (model.pageFill >= FLASH_PAGE_SIZE) {
+    model.pageFill -= FLASH_PAGE_SIZE;
+    us += flashProgram(model);
+  }
+  return flashSpend(model, us);
+}
+
+// A partial page is written now and again each time it grows
+uint32_t flashFlush(FlashModel &model) {
+  if (model.pageFill == 0) return 0;
+  return flashSpend(model, flashProgram(model));
+}
+
+uint32_t flashClose(FlashModel &model) {
+  uint32_t us = flashFlush(model);
+  model.pageFill = 0;
+  return us + flashSpend(model, model.costs.closeUs);
+}
+
+uint32_t flashRemove(FlashModel &model, uint32_t bytes) {
+  model.usedBytes -= bytes < model.usedBytes ? bytes : model.usedBytes;
+  return flashSpend(model, model.costs.removeUs);
+}
+
+uint32_t flashProgramRaw(FlashModel &model, uint32_t bytes) {
+  uint32_t pages = (bytes + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+  model.programs += pages;
+  return flashSpend(model, (uint32_t)((uint64_t)model.costs.pageWriteUs * bytes / FLASH_PAGE_SIZE));
+}
+
+uint32_t flashEraseRaw(FlashModel &model) {
+  model.erases++;
+  return flashSpend(model, model.costs.eraseUs);
+}
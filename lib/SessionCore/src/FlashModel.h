@@ -0,0 +1,54 @@
+#pragma once
+// Host stand-in for what flash writes cost on the device. Costs come from
+// the FSCAL line 'bench fs' prints; a write policy replayed against the
+// model adds up the time it would spend in SPIFFS, including the GC stalls
+// that grow as the filesystem fills, or on the raw ring log partition.
+
+#include "SessionFormat.h"
+
+#define FLASH_PAGE_SIZE 256
+#define FLASH_SECTOR_SIZE 4096
+#define FLASH_FILL_MAX 0.98f          // Past this the cleaning cost model diverges
+
+// Average cost of each operation, in microseconds
+struct FlashCosts {
+  float fillPct;                     // Filesystem fill when measured
+  uint32_t openCreateUs;
+  uint32_t openAppendUs;
+  uint32_t recordAppendUs;           // Small write into the open file's cache
+  uint32_t pageWriteUs;              // One page written and flushed
+  uint32_t closeUs;
+  uint32_t removeUs;
+  uint32_t eraseUs;                  // Raw sector erase; the stall average when not measured
+  uint32_t pages;                    // Page writes measured
+  uint32_t stalls;                   // Of those, the ones that ran into a GC
+  uint32_t stallAvgUs;
+};
+
+struct FlashModel {
+  FlashCosts costs;
+  uint32_t capacityBytes;
+  uint32_t usedBytes;
+  uint32_t pageFill;                 // Bytes in the open file's unwritten page
+  float stallDebt;                   // Fraction of a GC stall owed so far
+  uint64_t elapsedUs;
+  uint32_t opens;
+  uint32_t programs;
+  uint32_t stalls;
+  uint32_t erases;
+};
+
+bool parseFsCal(const char *line, size_t length, FlashCosts &costs);
+void flashModelInit(FlashModel &model, const FlashCosts &costs, uint32_t capacityBytes, uint32_t usedBytes);
+float flashStallRate(const FlashModel &model);
+
+// SPIFFS file operations; each returns its cost and adds it to elapsedUs
+uint32_t flashOpen(FlashModel &model, bool create);
+uint32_t flashAppend(FlashModel &model, uint32_t bytes);
+uint32_t flashFlush(FlashModel &model);
+uint32_t flashClose(FlashModel &model);
+uint32_t flashRemove(FlashModel &model, uint32_t bytes);
+
+// Raw partition writes, as the ring log does them: no filesystem, no GC
+uint32_t flashProgramRaw(FlashModel &model, uint32_t bytes);
+uint32_t flashEraseRaw(FlashModel &model);
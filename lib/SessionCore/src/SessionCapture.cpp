@@ -0,0 +1,69 @@
+#include "SessionCapture.h"
+
+// Frames closer than PRESS_DEBOUNCE_US to the last accepted one are
+// dropped, which is what the old blocking delay after each press did
+bool debounceAccept(usec_t &lastAcceptedUs, usec_t timeUs) {
+  if ((timeUs - lastAcceptedUs) < PRESS_DEBOUNCE_US) return false;
+  lastAcceptedUs = timeUs;
+  return true;
+}
+
+// The first repeat frame of a held key logs one hold; later ones are dropped
+PressKind classifyPress(bool isRepeat, bool &holdLogged) {
+  if (!isRepeat) {
+    holdLogged = false;
+    return PRESS_TAP;
+  }
+  if (holdLogged) return PRESS_SUPPRESS;
+  holdLogged = true;
+  return PRESS_HOLD;
+}
+
+// If a clip is inserted less than 1 second after the last clip, it goes on
+// the next track; otherwise back on track 1
+int stackTrack(usec_t clipTime, usec_t lastClipTime, int track) {
+  if ((clipTime - lastClipTime) < TRACK_STACK_WINDOW_US) {
+    return track < MAX_TRACK_INDEX ? track + 1 : track;
+  }
+  return 1;
+}
+
+int keyIndexForCode(uint16_t code) {
+  for (int i = 0; i < keyMapSize; i++) {
+    if (keyMap[i].code == code) return i;
+  }
+  return -1;
+}
+
+// Accept a button name or a raw command number; -1 if neither
+int keyCodeForName(const char *name, size_t length) {
+  for (int i = 0; i < keyMapSize; i++) {
+    if (spanEquals(name, length, keyMap[i].name)) return keyMap[i].code;
+  }
+  int code = 0;
+  return parseNumber(name, length, 0, 0xFFFE, code) ? code : -1;
+}
+
+void pressStateInit(PressState &state, usec_t start) {
+  state = {start, 0, 0, 1, -1, false};
+}
+
+// What a decoded frame logs. keyIndex is -1 for an unmapped code, which
+// logs nothing, as does a repeat after the first
+PressKind capturePress(PressState &state, uint16_t code, bool isRepeat, int &keyIndex) {
+  keyIndex = keyIndexForCode(code);
+  if (keyIndex < 0) return PRESS_SUPPRESS;
+  return classifyPress(isRepeat, state.hold);
+}
+
+// The record of a logged press, placed on its track
+EventRecord pressRecord(PressState &state, int keyIndex, PressKind kind, usec_t timeUs) {
+  usec_t clipTime = timeUs - state.start;
+  state.track = stackTrack(clipTime, state.lastClip, state.track);
+  state.lastClip = clipTime;
+  state.lastKey = keyIndex;
+  state.lastButton = timeUs;
+  EventRecord record = {clipTime, REC_PRESS, (uint8_t)keyIndex, (uint8_t)state.track,
+                        (uint8_t)(kind == PRESS_HOLD ? REC_FLAG_HOLD : 0), 0};
+  return record;
+}
@@ -0,0 +1,33 @@
+#pragma once
+// Per-press decisions of the capture path: debounce, hold detection and
+// track stacking. The firmware keeps a PressState per session slot; the host
+// bench drives the same functions.
+
+#include "SessionFormat.h"
+
+#define PRESS_DEBOUNCE_US 500000ULL   // Minimum spacing between accepted IR frames
+#define TRACK_STACK_WINDOW_US 1000000ULL  // Clips closer than this stack on the next track
+#define MAX_TRACK_INDEX 98            // videoTracks[] index stays within Premiere's 99 tracks
+#define KEY_NONE 0xFFFF               // Unassigned IR command
+
+// What a decoded frame of a mapped key turns into
+enum PressKind : uint8_t { PRESS_SUPPRESS, PRESS_TAP, PRESS_HOLD };
+
+// What a session remembers between presses
+struct PressState {
+  usec_t start;                      // Segment start; clip times are relative to it
+  usec_t lastClip;                   // Clip time of the last logged press
+  usec_t lastButton;                 // Device time of the last logged press
+  int track;                         // Track index of the last logged press
+  int lastKey;                       // keyMap index of the last logged press; -1 = none
+  bool hold;                         // A hold was logged for the current repeat run
+};
+
+bool debounceAccept(usec_t &lastAcceptedUs, usec_t timeUs);
+PressKind classifyPress(bool isRepeat, bool &holdLogged);
+int stackTrack(usec_t clipTime, usec_t lastClipTime, int track);
+int keyIndexForCode(uint16_t code);
+int keyCodeForName(const char *name, size_t length);
+void pressStateInit(PressState &state, usec_t start);
+PressKind capturePress(PressState &state, uint16_t code, bool isRepeat, int &keyIndex);
+EventRecord pressRecord(PressState &state, int keyIndex, PressKind kind, usec_t timeUs);
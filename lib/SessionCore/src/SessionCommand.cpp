@@ -0,0 +1,204 @@
+#include "SessionCommand.h"
+
+#include "TraceGenerator.h"
+
+#include <string.h>
+
+bool commandIsShared(CommandId id) {
+  return id >= CMD_SESSIONS && id <= CMD_META_SET;
+}
+
+// A button name, a command number or "off" (KEY_NONE)
+static bool parseKeyArgument(const char *text, size_t length, int &code) {
+  code = spanEquals(text, length, "off") ? KEY_NONE : keyCodeForName(text, length);
+  return code >= 0;
+}
+
+// "off" (0) or a number in range
+static bool parseNumberOrOff(const char *text, size_t length, int minValue, int maxValue, int &value) {
+  if (spanEquals(text, length, "off")) {
+    value = 0;
+    return true;
+  }
+  return parseNumber(text, length, minValue, maxValue, value);
+}
+
+// One of two words; enable is set for the first
+static bool parseChoice(const char *text, size_t length, const char *on, const char *off, bool &enable) {
+  enable = spanEquals(text, length, on);
+  return enable || spanEquals(text, length, off);
+}
+
+// "<num> <rest>", the file number checked against the listing
+static bool parseFileAndRest(const char *&text, size_t &length, int fileCount, int &fileIndex) {
+  const char *fileText;
+  size_t fileLength;
+  if (!nextWord(text, length, fileText, fileLength) || length == 0) return false;
+  return parseNumber(fileText, fileLength, 1, fileCount, fileIndex);
+}
+
+static void parseSharedCommand(const char *verb, size_t verbLength, const char *text, size_t length,
+                               const CommandContext &context, Command &command) {
+  bool bare = length == 0;
+  if (spanEquals(verb, verbLength, "sessions")) {
+    if (bare) command.id = CMD_SESSIONS;
+  } else if (spanEquals(verb, verbLength, "time")) {
+    command.id = bare ? CMD_TIME : CMD_TIME_SET;
+    if (!bare) command.valid = parseEpochMs(text, length, command.epochMs);
+  } else if (spanEquals(verb, verbLength, "ping")) {
+    if (bare) return;
+    command.id = CMD_PING;
+    command.valid = parseEpochMs(text, length, command.epochMs);
+  } else if (spanEquals(verb, verbLength, "tc")) {
+    if (bare) {
+      command.id = CMD_TC;
+    } else if (spanEquals(text, length, "off")) {
+      command.id = CMD_TC_OFF;
+    } else {
+      command.id = CMD_TC_SET;
+      command.rate = context.rate;
+      command.valid = parseTimecodeCommand(text, length, command.rate, command.frame);
+    }
+  } else if (spanEquals(verb, verbLength, "meta")) {
+    if (bare) {
+      command.id = CMD_META;
+    } else if (spanEquals(text, length, "clear")) {
+      command.id = CMD_META_CLEAR;
+    } else {
+      command.id = CMD_META_SET;
+      command.meta = context.meta;
+      command.fields = parseMetaFields(text, length, command.meta);
+      command.valid = command.fields > 0 && !(command.fields & META_DEVICE);
+    }
+  }
+}
+
+static void parseBenchCommand(const char *text, size_t length, Command &command) {
+  const char *mode;
+  size_t modeLength;
+  command.id = CMD_BENCH;
+  command.number = 200;
+  const char *rest = text;
+  size_t restLength = length;
+  if (!nextWord(rest, restLength, mode, modeLength)) return;
+  if (spanEquals(mode, modeLength, "fs")) {
+    command.id = CMD_BENCH_FS;
+    command.number = 64;
+    if (restLength > 0) command.valid = parseNumber(rest, restLength, 1, 512, command.number);
+  } else if (spanEquals(mode, modeLength, "trace")) {
+    command.id = CMD_BENCH_TRACE;
+    command.seed = 1;
+    command.events = 1000;
+    command.valid = parseTraceArguments(rest, restLength, command.seed, command.events);
+  } else {
+    command.valid = parseNumber(text, length, 1, 10000, command.number);
+  }
+}
+
+// The line's first word picks the command; what follows is parsed and
+// range-checked here, so the caller only acts on the result
+void parseCommand(const char *text, size_t length, const CommandContext &context, Command &command) {
+  memset(&command, 0, sizeof(command));
+  command.id = CMD_UNKNOWN;
+  command.valid = true;
+  const char *verb;
+  size_t verbLength;
+  trimSpan(text, length);
+  if (!nextWord(text, length, verb, verbLength)) return;
+  bool bare = length == 0;
+  const char *word;
+  size_t wordLength;
+  CommandId keyCommand = spanEquals(verb, verbLength, "startkey")    ? CMD_STARTKEY
+                         : spanEquals(verb, verbLength, "markerkey") ? CMD_MARKERKEY
+                         : spanEquals(verb, verbLength, "selectkey") ? CMD_SELECTKEY
+                                                                     : CMD_UNKNOWN;
+
+  if (keyCommand != CMD_UNKNOWN) {
+    if (bare) return;
+    command.id = keyCommand;
+    command.valid = parseKeyArgument(text, length, command.number);
+  } else if (spanEquals(verb, verbLength, "menu")) {
+    if (bare) command.id = CMD_MENU;
+  } else if (spanEquals(verb, verbLength, "setbase")) {
+    if (bare) return;
+    command.id = CMD_SETBASE;
+    command.text = text;
+    command.textLength = length;
+    // Leave room for a session number and the extension
+    command.valid = isValidName(text, length) && length + 8 <= MAX_PATH_LENGTH;
+  } else if (spanEquals(verb, verbLength, "idlesplit")) {
+    if (bare) return;
+    command.id = CMD_IDLESPLIT;
+    command.valid = parseNumberOrOff(text, length, 10, 36000, command.number);
+  } else if (spanEquals(verb, verbLength, "route")) {
+    if (parseChoice(text, length, "remote", "off", command.enable)) command.id = CMD_ROUTE;
+  } else if (spanEquals(verb, verbLength, "store")) {
+    if (parseChoice(text, length, "ring", "spiffs", command.enable)) command.id = CMD_STORE;
+  } else if (spanEquals(verb, verbLength, "autostart")) {
+    if (parseChoice(text, length, "on", "off", command.enable)) command.id = CMD_AUTOSTART;
+  } else if (spanEquals(verb, verbLength, "ring")) {
+    if (bare) command.id = CMD_RING;
+  } else if (spanEquals(verb, verbLength, "df")) {
+    if (bare) {
+      command.id = CMD_DF;
+    } else if (nextWord(text, length, word, wordLength) && spanEquals(word, wordLength, "warn") && length > 0) {
+      command.id = CMD_DF_WARN;
+      command.valid = parseNumberOrOff(text, length, 1, 50, command.number);
+    }
+  } else if (spanEquals(verb, verbLength, "scrub")) {
+    if (bare) command.id = CMD_SCRUB;
+    if (spanEquals(text, length, "status")) command.id = CMD_SCRUB_STATUS;
+  } else if (spanEquals(verb, verbLength, "markers")) {
+    if (bare) command.id = CMD_MARKERS;
+    if (spanEquals(text, length, "rebuild")) command.id = CMD_MARKERS_REBUILD;
+  } else if (spanEquals(verb, verbLength, "align")) {
+    command.id = CMD_ALIGN;
+    command.number = 1;
+    if (!bare) command.valid = parseNumber(text, length, 1, 999999, command.number);
+  } else if (spanEquals(verb, verbLength, "rename")) {
+    if (bare) return;
+    command.id = CMD_RENAME;
+    command.valid = parseFileAndRest(text, length, context.fileCount, command.number);
+    command.text = text;
+    command.textLength = length;
+  } else if (spanEquals(verb, verbLength, "save")) {
+    if (bare) command.id = CMD_SAVE;
+  } else if (spanEquals(verb, verbLength, "delete")) {
+    command.id = bare ? CMD_DELETE_ALL : CMD_DELETE;
+    if (!bare) command.valid = parseNumber(text, length, 1, context.fileCount, command.number);
+  } else if (spanEquals(verb, verbLength, "stats")) {
+    if (bare) command.id = CMD_STATS;
+    if (spanEquals(text, length, "json")) command.id = CMD_STATS_JSON;
+    if (spanEquals(text, length, "reset")) command.id = CMD_STATS_RESET;
+    if (spanEquals(text, length, "heap")) command.id = CMD_STATS_HEAP;
+    if (spanEquals(text, length, "boot")) command.id = CMD_STATS_BOOT;
+  } else if (spanEquals(verb, verbLength, "trace")) {
+    if (spanEquals(text, length, "dump")) command.id = CMD_TRACE_DUMP;
+    if (spanEquals(text, length, "clear")) command.id = CMD_TRACE_CLEAR;
+  } else if (spanEquals(verb, verbLength, "selftest")) {
+    command.id = CMD_SELFTEST;
+    command.seed = 1;
+    command.events = 5000;
+    command.valid = parseTraceArguments(text, length, command.seed, command.events);
+  } else if (spanEquals(verb, verbLength, "bench")) {
+    parseBenchCommand(text, length, command);
+  } else if (spanEquals(verb, verbLength, "list")) {
+    command.id = bare ? CMD_LIST : CMD_LIST_FILTER;
+    if (!bare) {
+      command.fields = parseMetaFields(text, length, command.meta);
+      command.valid = command.fields > 0;
+    }
+  } else if (spanEquals(verb, verbLength, "query")) {
+    if (bare) return;
+    command.id = CMD_QUERY;
+    // number stays 0 when the file number is what was wrong
+    command.valid = parseFileAndRest(text, length, context.fileCount, command.number) &&
+                    parseQuery(text, length, command.op, command.filter);
+  } else if (spanEquals(verb, verbLength, "send")) {
+    if (bare) return;
+    command.id = spanEquals(text, length, "all") ? CMD_SEND_ALL : CMD_SEND;
+    if (command.id == CMD_SEND) command.valid = parseNumber(text, length, 1, context.fileCount, command.number);
+  } else {
+    parseSharedCommand(verb, verbLength, text, length, context, command);
+  }
+}
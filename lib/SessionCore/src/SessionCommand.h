@@ -0,0 +1,52 @@
+#pragma once
+// Serial command lines turned into a Command the firmware dispatches on.
+// All argument parsing happens here, so the fuzz target drives the same
+// router the device runs.
+
+#include "SessionCapture.h"
+#include "SessionQuery.h"
+#include "SessionTime.h"
+
+enum CommandId : uint8_t {
+  CMD_UNKNOWN,
+  CMD_MENU,
+  // Accepted from every prompt, during a session too
+  CMD_SESSIONS, CMD_TIME, CMD_TIME_SET, CMD_PING, CMD_TC, CMD_TC_OFF, CMD_TC_SET,
+  CMD_META, CMD_META_CLEAR, CMD_META_SET,
+  // File management only
+  CMD_SETBASE, CMD_STARTKEY, CMD_MARKERKEY, CMD_SELECTKEY, CMD_IDLESPLIT, CMD_ROUTE, CMD_STORE, CMD_RING,
+  CMD_DF, CMD_DF_WARN, CMD_SCRUB, CMD_SCRUB_STATUS, CMD_MARKERS, CMD_MARKERS_REBUILD, CMD_ALIGN,
+  CMD_AUTOSTART, CMD_RENAME, CMD_SAVE, CMD_DELETE_ALL, CMD_DELETE, CMD_STATS, CMD_STATS_JSON,
+  CMD_STATS_RESET, CMD_STATS_HEAP, CMD_STATS_BOOT, CMD_TRACE_DUMP, CMD_TRACE_CLEAR, CMD_SELFTEST,
+  CMD_BENCH, CMD_BENCH_FS, CMD_BENCH_TRACE, CMD_LIST, CMD_LIST_FILTER, CMD_QUERY, CMD_SEND, CMD_SEND_ALL,
+};
+
+// Device state the arguments are checked against
+struct CommandContext {
+  int fileCount;                     // File numbers run 1..fileCount, from the last listing
+  TimecodeRate rate;                 // Kept by a 'tc' line that names none
+  SessionMeta meta;                  // 'meta key=value' edits a copy of this
+};
+
+// A parsed line. When valid is false the arguments were wrong and the
+// command's usage is due; only the fields of its id are set.
+struct Command {
+  CommandId id;
+  bool valid;
+  int number;                        // File number, key code, seconds, percent, marker, KB or iterations
+  bool enable;                       // route remote, store ring, autostart on
+  const char *text;                  // New base or name, a span of the line
+  size_t textLength;
+  int64_t epochMs;
+  uint32_t seed;
+  int events;
+  TimecodeRate rate;
+  uint32_t frame;
+  SessionMeta meta;
+  int fields;                        // MetaField bits set in meta
+  QueryOp op;
+  QueryFilter filter;
+};
+
+bool commandIsShared(CommandId id);
+void parseCommand(const char *text, size_t length, const CommandContext &context, Command &command);
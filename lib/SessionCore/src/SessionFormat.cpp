@@ -0,0 +1,190 @@
+#include "SessionFormat.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+const char *const recordTypeNames[] = {"", "press", "sync", "drift", "tc", "marker", "gap"};
+
+const KeyMapping keyMap[] = {
+  {25, "ok"}, {24, "right"}, {22, "down"}, {23, "left"}, {21, "up"},
+  {71, "home"}, {16, "settings"}, {72, "back"}, {50, "tv"},
+};
+const int keyMapSize = sizeof(keyMap) / sizeof(keyMap[0]);
+
+// =========== Record Codec ===========
+
+SessionHeader makeSessionHeader() {
+  SessionHeader header = {SESSION_MAGIC, SESSION_VERSION, SESSION_HEADER_SIZE, sizeof(EventRecord), 0};
+  return header;
+}
+
+bool sessionHeaderValid(const SessionHeader &header) {
+  return header.magic == SESSION_MAGIC && header.headerSize >= sizeof(header) && header.recordSize > 0;
+}
+
+// Tolerates record sizes from other format versions: longer records are
+// cut, shorter ones leave the missing fields zero
+void decodeRecord(const uint8_t *buffer, size_t recordSize, EventRecord &record) {
+  size_t copySize = recordSize < sizeof(record) ? recordSize : sizeof(record);
+  memset(&record, 0, sizeof(record));
+  memcpy(&record, buffer, copySize);
+}
+
+// FNV-1a; enough to reject RTC memory left over from a power cycle
+uint32_t checksum32(const void *data, size_t length, uint32_t hash) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * 16777619UL;
+  }
+  return hash;
+}
+
+// =========== Text Parsers ===========
+
+void trimSpan(const char *&text, size_t &length) {
+  while (length > 0 && isspace((unsigned char)text[0])) {
+    text++;
+    length--;
+  }
+  while (length > 0 && isspace((unsigned char)text[length - 1])) {
+    length--;
+  }
+}
+
+bool spanEquals(const char *text, size_t length, const char *literal) {
+  return strlen(literal) == length && memcmp(text, literal, length) == 0;
+}
+
+bool nextWord(const char *&text, size_t &length, const char *&word, size_t &wordLength) {
+  if (length == 0) return false;
+  const char *space = (const char *)memchr(text, ' ', length);
+  word = text;
+  wordLength = space ? (size_t)(space - text) : length;
+  text += space ? wordLength + 1 : length;
+  length -= space ? wordLength + 1 : length;
+  trimSpan(text, length);
+  return true;
+}
+
+// Strict decimal parse: no sign, hex or trailing characters
+bool parseNumber(const char *text, size_t length, int minValue, int maxValue, int &value) {
+  if (length == 0 || length > 9) return false;
+  long result = 0;
+  for (size_t i = 0; i < length; i++) {
+    char c = text[i];
+    if (c < '0' || c > '9') return false;
+    result = result * 10 + (c - '0');
+  }
+  if (result < minValue || result > maxValue) return false;
+  value = (int)result;
+  return true;
+}
+
+// Strict decimal parse of a Unix time in milliseconds
+bool parseEpochMs(const char *text, size_t length, int64_t &epochMs) {
+  if (length == 0 || length > 15) return false;
+  int64_t result = 0;
+  for (size_t i = 0; i < length; i++) {
+    char c = text[i];
+    if (c < '0' || c > '9') return false;
+    result = result * 10 + (c - '0');
+  }
+  if (result == 0) return false;
+  epochMs = result;
+  return true;
+}
+
+// Names may start with '/' and otherwise use [A-Za-z0-9_.-]
+bool isValidName(const char *name, size_t length) {
+  if (length == 0 || length > MAX_PATH_LENGTH) return false;
+  for (size_t i = 0; i < length; i++) {
+    char c = name[i];
+    bool ok = isalnum((unsigned char)c) || c == '_' || c == '-' || c == '.' || (c == '/' && i == 0);
+    if (!ok) return false;
+  }
+  // "/.<name>" is reserved for internal files: spares, manifest, marker index
+  size_t first = name[0] == '/' ? 1 : 0;
+  if (length > first && name[first] == '.') return false;
+  return !spanEquals(name, length, "/");
+}
+
+// Turn a typed session name into "/<name>.bin"; path needs MAX_PATH_LENGTH + 1 bytes
+bool buildSessionFileName(const char *input, size_t length, char *path, size_t size) {
+  char name[MAX_PATH_LENGTH + 2];
+  if (length > MAX_PATH_LENGTH) return false;
+  size_t nameLength = 0;
+  if (length > 0 && input[0] != '/') name[nameLength++] = '/';
+  memcpy(name + nameLength, input, length);
+  nameLength += length;
+  if (!isValidName(name, nameLength) || nameLength + 4 > MAX_PATH_LENGTH) return false;
+  if (size < nameLength + sizeof(SESSION_EXTENSION)) return false;
+  memcpy(path, name, nameLength);
+  memcpy(path + nameLength, SESSION_EXTENSION, sizeof(SESSION_EXTENSION));
+  return true;
+}
+
+// Parse "key=value ..." into meta; returns the MetaField bits set, or -1
+int parseMetaFields(const char *text, size_t length, SessionMeta &meta) {
+  int fields = 0;
+  const char *pair;
+  size_t pairLength;
+  trimSpan(text, length);
+  while (nextWord(text, length, pair, pairLength)) {
+    const char *equals = (const char *)memchr(pair, '=', pairLength);
+    if (!equals || equals == pair) return -1;
+    size_t keyLength = equals - pair;
+    const char *value = equals + 1;
+    size_t valueLength = pairLength - keyLength - 1;
+    for (size_t i = 0; i < valueLength; i++) {
+      char c = value[i];
+      if (!isalnum((unsigned char)c) && c != '_' && c != '-' && c != '.') return -1;
+    }
+    char *target = nullptr;
+    size_t size = 0;
+    if (spanEquals(pair, keyLength, "operator")) {
+      target = meta.operatorName;
+      size = sizeof(meta.operatorName);
+      fields |= META_OPERATOR;
+    } else if (spanEquals(pair, keyLength, "scene")) {
+      target = meta.scene;
+      size = sizeof(meta.scene);
+      fields |= META_SCENE;
+    } else if (spanEquals(pair, keyLength, "take")) {
+      target = meta.take;
+      size = sizeof(meta.take);
+      fields |= META_TAKE;
+    } else if (spanEquals(pair, keyLength, "remote")) {
+      target = meta.remote;
+      size = sizeof(meta.remote);
+      fields |= META_REMOTE;
+    } else if (spanEquals(pair, keyLength, "device")) {
+      uint32_t id = 0;
+      if (valueLength == 0 || valueLength > 8) return -1;
+      for (size_t i = 0; i < valueLength; i++) {
+        char c = (char)tolower((unsigned char)value[i]);
+        if (!isxdigit((unsigned char)c)) return -1;
+        id = id * 16 + (c <= '9' ? c - '0' : c - 'a' + 10);
+      }
+      meta.deviceId = id;
+      fields |= META_DEVICE;
+      continue;
+    } else {
+      return -1;
+    }
+    if (valueLength >= size) return -1;
+    memset(target, 0, size);
+    memcpy(target, value, valueLength);
+  }
+  return fields;
+}
+
+bool metaMatches(const SessionMeta &meta, const SessionMeta &filter, int fields) {
+  if ((fields & META_OPERATOR) && strncasecmp(meta.operatorName, filter.operatorName, sizeof(meta.operatorName)) != 0)
+    return false;
+  if ((fields & META_SCENE) && strncasecmp(meta.scene, filter.scene, sizeof(meta.scene)) != 0) return false;
+  if ((fields & META_TAKE) && strncasecmp(meta.take, filter.take, sizeof(meta.take)) != 0) return false;
+  if ((fields & META_REMOTE) && strncasecmp(meta.remote, filter.remote, sizeof(meta.remote)) != 0) return false;
+  if ((fields & META_DEVICE) && meta.deviceId != filter.deviceId) return false;
+  return true;
+}
@@ -0,0 +1,108 @@
+#pragma once
+// Session file format and the strict text parsers behind the serial
+// commands. Plain C++ with no Arduino types, so the native tests and the
+// fuzz target build it on the host.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// All capture, storage and export times are 64-bit microseconds from
+// esp_timer, which does not wrap
+typedef uint64_t usec_t;
+
+#define MAX_PATH_LENGTH 31            // SPIFFS object name limit, without NUL
+
+// =========== Session File Format ===========
+// A session file is a SessionHeader, a SessionMeta (version 2 on) and then
+// fixed-size EventRecords. Files are rendered to ExtendScript insertClip()
+// lines when sent; files without the header (older text logs) are sent as-is.
+#define SESSION_MAGIC 0x474C5249UL    // "IRLG"
+#define SESSION_VERSION 2
+#define SESSION_EXTENSION ".bin"
+
+struct SessionHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t headerSize;               // Offset of the first record
+  uint16_t recordSize;
+  uint16_t reserved;
+};
+
+// Who and what a session recorded; NUL-padded strings
+struct SessionMeta {
+  char operatorName[16];
+  char scene[8];
+  char take[8];
+  char remote[8];
+  uint32_t deviceId;
+  uint32_t ringSession;              // Ring log session holding the records; 0 = they follow in this file
+};
+static_assert(sizeof(SessionMeta) == 48, "SessionMeta layout is stored on flash");
+#define SESSION_HEADER_SIZE (sizeof(SessionHeader) + sizeof(SessionMeta))
+
+enum MetaField : uint8_t {
+  META_OPERATOR = 1 << 0,
+  META_SCENE = 1 << 1,
+  META_TAKE = 1 << 2,
+  META_REMOTE = 1 << 3,
+  META_DEVICE = 1 << 4,
+};
+
+// REC_SYNC: timeUs is the session time at which wall-clock time was exactly
+// `value` Unix seconds, as reported by the host's 'time' command
+// REC_DRIFT: value is the device clock error in parts per billion (int32),
+// positive when the device runs slow
+// REC_TIMECODE: timecode frame `value` began at session time timeUs; key holds
+// the nominal frame rate
+// REC_MARKER: slate/sync marker; value is its 1-based number in the session
+// REC_GAP: capture resumed after a reset; value bounds the unobserved time in ms
+enum RecordType : uint8_t {
+  REC_PRESS = 1, REC_SYNC = 2, REC_DRIFT = 3, REC_TIMECODE = 4, REC_MARKER = 5, REC_GAP = 6
+};
+#define REC_FLAG_HOLD 0x01
+#define REC_FLAG_DROP 0x02    // REC_TIMECODE: drop-frame labels
+#define REC_FLAG_NTSC 0x04    // REC_TIMECODE: rate is fps * 1000/1001
+
+struct EventRecord {
+  usec_t timeUs;                     // Since session start
+  uint8_t type;                      // RecordType
+  uint8_t key;                       // keyMap index for REC_PRESS
+  uint8_t track;
+  uint8_t flags;
+  uint32_t value;                    // Type-specific payload
+};
+static_assert(sizeof(EventRecord) == 16, "EventRecord layout is stored on flash");
+
+extern const char *const recordTypeNames[];
+
+// =========== IR Key Map ===========
+// Remote command code -> clip base name. Press records store the index, so
+// the order is part of the file format.
+struct KeyMapping {
+  uint16_t code;
+  const char *name;
+};
+
+extern const KeyMapping keyMap[];
+extern const int keyMapSize;
+
+// =========== Record Codec ===========
+SessionHeader makeSessionHeader();
+bool sessionHeaderValid(const SessionHeader &header);
+void decodeRecord(const uint8_t *buffer, size_t recordSize, EventRecord &record);
+uint32_t checksum32(const void *data, size_t length, uint32_t hash = 2166136261UL);
+
+// =========== Text Parsers ===========
+// Each takes a pointer and a length so callers can hand in part of a line
+bool parseNumber(const char *text, size_t length, int minValue, int maxValue, int &value);
+bool parseEpochMs(const char *text, size_t length, int64_t &epochMs);
+bool isValidName(const char *name, size_t length);
+bool buildSessionFileName(const char *input, size_t length, char *path, size_t size);
+int parseMetaFields(const char *text, size_t length, SessionMeta &meta);
+bool metaMatches(const SessionMeta &meta, const SessionMeta &filter, int fields);
+
+// Split off the first space-separated word, trimming both parts as
+// String::trim() does; returns false once nothing is left
+bool nextWord(const char *&text, size_t &length, const char *&word, size_t &wordLength);
+void trimSpan(const char *&text, size_t &length);
+bool spanEquals(const char *text, size_t length, const char *literal);
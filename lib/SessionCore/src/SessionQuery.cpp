@@ -0,0 +1,112 @@
+#include "SessionQuery.h"
+
+#include <string.h>
+
+// Seconds, m:ss or h:mm:ss, with an optional fraction
+bool parseQueryTime(const char *text, size_t length, usec_t &timeUs) {
+  if (length == 0) return false;
+  double seconds = 0;
+  size_t start = 0;
+  while (true) {
+    const char *colon = (const char *)memchr(text + start, ':', length - start);
+    size_t end = colon ? (size_t)(colon - text) : length;
+    if (end == start) return false;
+    double part = 0;
+    double scale = 0;                // 0 until a '.' is seen
+    for (size_t i = start; i < end; i++) {
+      char c = text[i];
+      if (c == '.' && !colon && scale == 0) {
+        scale = 1;
+      } else if (c >= '0' && c <= '9') {
+        part = part * 10 + (c - '0');
+        if (scale != 0) scale *= 10;
+      } else {
+        return false;
+      }
+    }
+    seconds = seconds * 60 + (scale != 0 ? part / scale : part);
+    if (!colon) break;
+    start = end + 1;
+  }
+  // Beyond this the microsecond count no longer fits a usec_t
+  if (seconds >= 1.8e13) return false;
+  timeUs = (usec_t)(seconds * 1e6 + 0.5);
+  return true;
+}
+
+// "<count|list|first|last> [key=<name>[_hold]] [type=<t>] [from=<time>] [to=<time>]"
+bool parseQuery(const char *text, size_t length, QueryOp &op, QueryFilter &filter) {
+  filter = {-1, false, 0, 0, (usec_t)-1};
+  const char *verb, *pair;
+  size_t verbLength, pairLength;
+  trimSpan(text, length);
+  if (!nextWord(text, length, verb, verbLength)) return false;
+  if (spanEquals(verb, verbLength, "count")) {
+    op = QUERY_COUNT;
+  } else if (spanEquals(verb, verbLength, "list")) {
+    op = QUERY_LIST;
+  } else if (spanEquals(verb, verbLength, "first")) {
+    op = QUERY_FIRST;
+  } else if (spanEquals(verb, verbLength, "last")) {
+    op = QUERY_LAST;
+  } else {
+    return false;
+  }
+  while (nextWord(text, length, pair, pairLength)) {
+    const char *equals = (const char *)memchr(pair, '=', pairLength);
+    if (!equals || equals == pair) return false;
+    size_t keyLength = equals - pair;
+    const char *value = equals + 1;
+    size_t valueLength = pairLength - keyLength - 1;
+    if (spanEquals(pair, keyLength, "key")) {
+      filter.hold = valueLength >= 5 && memcmp(value + valueLength - 5, "_hold", 5) == 0;
+      if (filter.hold) valueLength -= 5;
+      filter.key = -1;
+      for (int i = 0; i < keyMapSize; i++) {
+        if (spanEquals(value, valueLength, keyMap[i].name)) filter.key = i;
+      }
+      if (filter.key < 0) return false;
+      filter.type = REC_PRESS;
+    } else if (spanEquals(pair, keyLength, "type")) {
+      filter.type = 0;
+      for (uint8_t t = REC_PRESS; t <= REC_GAP; t++) {
+        if (spanEquals(value, valueLength, recordTypeNames[t])) filter.type = t;
+      }
+      if (filter.type == 0) return false;
+    } else if (spanEquals(pair, keyLength, "from")) {
+      if (!parseQueryTime(value, valueLength, filter.fromUs)) return false;
+    } else if (spanEquals(pair, keyLength, "to")) {
+      if (!parseQueryTime(value, valueLength, filter.toUs)) return false;
+    } else {
+      return false;
+    }
+  }
+  return filter.fromUs <= filter.toUs;
+}
+
+bool queryMatches(const EventRecord &record, const QueryFilter &filter) {
+  if (record.timeUs < filter.fromUs || record.timeUs > filter.toUs) return false;
+  if (filter.type != 0 && record.type != filter.type) return false;
+  if (filter.key >= 0 && (record.key != filter.key || ((record.flags & REC_FLAG_HOLD) != 0) != filter.hold)) {
+    return false;
+  }
+  return true;
+}
+
+// Blocks [startBlock, endBlock) can hold records in the filter's time range;
+// endBlock == blocks means the range runs on past the indexed blocks
+void queryBlockRange(const usec_t *blockStart, uint32_t blocks, const QueryFilter &filter, uint32_t &startBlock,
+                     uint32_t &endBlock) {
+  startBlock = 0;
+  while (startBlock + 1 < blocks && blockStart[startBlock + 1] + QUERY_SLACK_US < filter.fromUs) {
+    startBlock++;
+  }
+  endBlock = blocks;
+  for (uint32_t b = startBlock + 1; b < blocks; b++) {
+    // Subtract rather than add: an open-ended toUs is the largest usec_t
+    if (blockStart[b] > QUERY_SLACK_US && blockStart[b] - QUERY_SLACK_US > filter.toUs) {
+      endBlock = b;
+      break;
+    }
+  }
+}
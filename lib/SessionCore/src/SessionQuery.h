@@ -0,0 +1,24 @@
+#pragma once
+// Event query filters and the sparse block index that narrows a time range
+
+#include "SessionFormat.h"
+
+// Records are nearly in time order, so the start time of every
+// QUERY_BLOCK_RECORDS-th record is enough to find the blocks a time range needs.
+#define QUERY_BLOCK_RECORDS 64        // 1 KB of 16-byte records
+#define QUERY_INDEX_MAX 256           // Blocks indexed; later ones are scanned
+#define QUERY_SLACK_US 1000000ULL     // Sync records sit up to 1 s before the press they follow
+enum QueryOp : uint8_t { QUERY_COUNT, QUERY_LIST, QUERY_FIRST, QUERY_LAST };
+struct QueryFilter {
+  int key;                           // keyMap index, or -1 for any
+  bool hold;
+  uint8_t type;                      // RecordType, or 0 for any
+  usec_t fromUs;
+  usec_t toUs;
+};
+
+bool parseQueryTime(const char *text, size_t length, usec_t &timeUs);
+bool parseQuery(const char *text, size_t length, QueryOp &op, QueryFilter &filter);
+bool queryMatches(const EventRecord &record, const QueryFilter &filter);
+void queryBlockRange(const usec_t *blockStart, uint32_t blocks, const QueryFilter &filter, uint32_t &startBlock,
+                     uint32_t &endBlock);
@@ -0,0 +1,189 @@
+#include "SessionTime.h"
+
+#include <stdio.h>
+
+// =========== Wall Clock ===========
+
+// A sync record lands on a whole wall-clock second so `value` stays 32-bit
+EventRecord makeSyncRecordAt(usec_t sessionUs, int64_t epochUs) {
+  usec_t fraction = (usec_t)(epochUs % 1000000);
+  uint32_t seconds = (uint32_t)(epochUs / 1000000);
+  if (sessionUs >= fraction) {
+    sessionUs -= fraction;
+  } else {
+    sessionUs += 1000000 - fraction;
+    seconds++;
+  }
+  EventRecord record = {sessionUs, REC_SYNC, 0, 0, 0, seconds};
+  return record;
+}
+
+// The anchor as seen from a session starting at device time startUs: the
+// first frame boundary at or after session start when the anchor was set
+// before it
+bool makeTimecodeRecordAt(const TimecodeAnchor &anchor, usec_t startUs, EventRecord &record) {
+  if (!anchor.set) return false;
+  const TimecodeRate &rate = anchor.rate;
+  int64_t lead = (int64_t)startUs - anchor.timeUs;
+  uint64_t frames = timecodeFramesIn(lead, rate);
+  if (timecodeFrameUs(frames, rate) < lead) frames++;
+  int64_t timeUs = anchor.timeUs + timecodeFrameUs(frames, rate) - (int64_t)startUs;
+  uint8_t flags = (rate.dropFrame ? REC_FLAG_DROP : 0) | (rate.ntsc ? REC_FLAG_NTSC : 0);
+  record = {(usec_t)timeUs, REC_TIMECODE, rate.fps, 0, flags, (uint32_t)(anchor.frame + frames)};
+  return true;
+}
+
+// Points arrive in time order. Once full, the last slot tracks the newest
+// sync so the model still spans the whole session.
+void addSyncPoint(SessionTiming &timing, int64_t timeUs, int64_t epochUs) {
+  if (timing.pointCount < SYNC_POINTS_MAX) {
+    timing.pointCount++;
+  }
+  timing.points[timing.pointCount - 1] = {timeUs, epochUs};
+}
+
+// Fold one stored record into the mapping; other record types are ignored
+void addTimingRecord(SessionTiming &timing, const EventRecord &record) {
+  if (record.type == REC_SYNC) {
+    addSyncPoint(timing, (int64_t)record.timeUs, (int64_t)record.value * 1000000);
+    timing.synced = true;
+  } else if (record.type == REC_DRIFT) {
+    timing.driftPpb = (int32_t)record.value;
+  } else if (record.type == REC_TIMECODE && record.key > 0) {
+    timing.timecode = {true, {record.key, (record.flags & REC_FLAG_NTSC) != 0, (record.flags & REC_FLAG_DROP) != 0},
+                       record.value, (int64_t)record.timeUs};
+  }
+}
+
+// Call once every record has been added
+void finishTiming(SessionTiming &timing) {
+  if (timing.synced) {
+    timing.epochAtZeroUs = sessionWallUs(timing, 0);
+  }
+}
+
+// Unix time of a session time. Corrections are computed on the difference
+// from nominal rate so the products stay well inside 64 bits.
+int64_t sessionWallUs(const SessionTiming &timing, int64_t timeUs) {
+  if (timing.pointCount == 0) {
+    return timing.epochAtZeroUs + timeUs + timeUs * timing.driftPpb / 1000000000LL;
+  }
+  const SyncPoint *a = &timing.points[0];
+  if (timing.pointCount == 1) {
+    int64_t dt = timeUs - a->timeUs;
+    return a->epochUs + dt + dt * timing.driftPpb / 1000000000LL;
+  }
+  // Pick the segment containing timeUs, or the nearest end segment
+  int segment = 0;
+  while (segment < timing.pointCount - 2 && timeUs >= timing.points[segment + 1].timeUs) {
+    segment++;
+  }
+  a = &timing.points[segment];
+  const SyncPoint *b = &timing.points[segment + 1];
+  int64_t span = b->timeUs - a->timeUs;
+  int64_t dt = timeUs - a->timeUs;
+  if (span <= 0) return a->epochUs + dt;
+  return a->epochUs + dt + dt * ((b->epochUs - a->epochUs) - span) / span;
+}
+
+// Session time as the wall clock measured it
+usec_t correctedClipTime(const SessionTiming &timing, usec_t timeUs) {
+  if (!timing.synced) return timeUs;
+  int64_t corrected = sessionWallUs(timing, (int64_t)timeUs) - timing.epochAtZeroUs;
+  return corrected < 0 ? 0 : (usec_t)corrected;
+}
+
+// =========== Timecode ===========
+
+int64_t timecodeFrameUs(uint64_t frame, const TimecodeRate &rate) {
+  return (int64_t)(frame * 1000000ULL * (rate.ntsc ? 1001 : 1000) / (rate.fps * 1000ULL));
+}
+
+// Whole frames elapsed in a duration
+uint64_t timecodeFramesIn(int64_t us, const TimecodeRate &rate) {
+  if (us <= 0) return 0;
+  return (uint64_t)us * rate.fps * 1000ULL / (1000000ULL * (rate.ntsc ? 1001 : 1000));
+}
+
+bool parseTimecodeRate(const char *text, size_t length, TimecodeRate &rate) {
+  static const struct {
+    const char *name;
+    uint8_t fps;
+    bool ntsc;
+  } rates[] = {{"23.976", 24, true}, {"24", 24, false}, {"25", 25, false}, {"29.97", 30, true},
+               {"30", 30, false},    {"50", 50, false}, {"59.94", 60, true}, {"60", 60, false}};
+  for (const auto &entry : rates) {
+    if (spanEquals(text, length, entry.name)) {
+      rate = {entry.fps, entry.ntsc, false};
+      return true;
+    }
+  }
+  return false;
+}
+
+// "HH:MM:SS:FF" (or ';' before the frames) to frames since midnight.
+// Drop-frame skips labels 0 and 1 (0-3 at 59.94) at each minute not divisible by ten.
+bool parseTimecode(const char *text, size_t length, const TimecodeRate &rate, uint32_t &frame) {
+  if (length != 11 || text[2] != ':' || text[5] != ':' || (text[8] != ':' && text[8] != ';')) {
+    return false;
+  }
+  int hours = 0, minutes = 0, seconds = 0, frames = 0;
+  if (!parseNumber(text, 2, 0, 23, hours) || !parseNumber(text + 3, 2, 0, 59, minutes) ||
+      !parseNumber(text + 6, 2, 0, 59, seconds) || !parseNumber(text + 9, 2, 0, rate.fps - 1, frames)) {
+    return false;
+  }
+  uint32_t total = ((uint32_t)hours * 3600 + minutes * 60 + seconds) * rate.fps + frames;
+  if (rate.dropFrame) {
+    int drop = rate.fps / 15;
+    if (seconds == 0 && frames < drop && minutes % 10 != 0) return false;
+    uint32_t totalMinutes = hours * 60 + minutes;
+    total -= drop * (totalMinutes - totalMinutes / 10);
+  }
+  frame = total;
+  return true;
+}
+
+// "HH:MM:SS:FF [fps] [df]" as typed after 'tc'. rate comes in as the rate
+// to keep when none is given; drop-frame is only valid at 29.97 and 59.94.
+bool parseTimecodeCommand(const char *text, size_t length, TimecodeRate &rate, uint32_t &frame) {
+  const char *timecodeText, *rateText;
+  size_t timecodeLength, rateLength;
+  trimSpan(text, length);
+  if (!nextWord(text, length, timecodeText, timecodeLength)) return false;
+  // A ';' separator is the drop-frame convention; default to 29.97 DF for it
+  bool semicolon = timecodeLength == 11 && timecodeText[8] == ';';
+  if (semicolon) rate = {30, true, true};
+  if (nextWord(text, length, rateText, rateLength)) {
+    // What is left after the rate is the drop-frame flag
+    if (!parseTimecodeRate(rateText, rateLength, rate)) return false;
+    if (length > 0 && !spanEquals(text, length, "df")) return false;
+    rate.dropFrame = length > 0 || semicolon;
+  } else if (!semicolon) {
+    rate.dropFrame = false;
+  }
+  if (rate.dropFrame && !(rate.ntsc && (rate.fps == 30 || rate.fps == 60))) return false;
+  return parseTimecode(timecodeText, timecodeLength, rate, frame);
+}
+
+// "HH:MM:SS:FF", with ';' before the frames for drop-frame; text needs 12 bytes
+void formatTimecode(uint64_t frame, const TimecodeRate &rate, char *text, size_t size) {
+  char separator = ':';
+  if (rate.dropFrame) {
+    uint32_t drop = rate.fps / 15;
+    uint32_t perTenMinutes = rate.fps * 600 - drop * 9;
+    uint32_t perMinute = rate.fps * 60 - drop;
+    frame %= perTenMinutes * 144;
+    uint64_t tens = frame / perTenMinutes;
+    uint32_t rest = frame % perTenMinutes;
+    frame += drop * 9 * tens;
+    if (rest > drop) {
+      frame += drop * ((rest - drop) / perMinute);
+    }
+    separator = ';';
+  } else {
+    frame %= (uint64_t)rate.fps * 86400;
+  }
+  uint32_t seconds = frame / rate.fps;
+  snprintf(text, size, "%02u:%02u:%02u%c%02u", (unsigned)(seconds / 3600), (unsigned)(seconds / 60 % 60),
+           (unsigned)(seconds % 60), separator, (unsigned)(frame % rate.fps));
+}
@@ -0,0 +1,48 @@
+#pragma once
+// Wall-clock and timecode mapping of session time
+
+#include "SessionFormat.h"
+
+// Wall-clock mapping of a session, recovered from its sync records.
+// Between sync points the mapping is piecewise linear; outside them, or
+// with a single point, the stored drift rate is applied.
+#define SYNC_POINTS_MAX 16
+struct SyncPoint {
+  int64_t timeUs;                    // Session time
+  int64_t epochUs;                   // Unix time at that session time
+};
+// SMPTE frame rate: 29.97 DF is {30, true, true}
+struct TimecodeRate {
+  uint8_t fps;                       // Nominal frames per second
+  bool ntsc;
+  bool dropFrame;
+};
+struct TimecodeAnchor {
+  bool set;
+  TimecodeRate rate;
+  uint32_t frame;                    // Frames since 00:00:00:00
+  int64_t timeUs;                    // When that frame began
+};
+struct SessionTiming {
+  bool synced;
+  int64_t epochAtZeroUs;             // Unix time of session offset 0
+  int32_t driftPpb;
+  uint8_t pointCount;
+  SyncPoint points[SYNC_POINTS_MAX];
+  TimecodeAnchor timecode;           // timeUs is session time
+};
+
+EventRecord makeSyncRecordAt(usec_t sessionUs, int64_t epochUs);
+bool makeTimecodeRecordAt(const TimecodeAnchor &anchor, usec_t startUs, EventRecord &record);
+void addSyncPoint(SessionTiming &timing, int64_t timeUs, int64_t epochUs);
+void addTimingRecord(SessionTiming &timing, const EventRecord &record);
+void finishTiming(SessionTiming &timing);
+int64_t sessionWallUs(const SessionTiming &timing, int64_t timeUs);
+usec_t correctedClipTime(const SessionTiming &timing, usec_t timeUs);
+
+int64_t timecodeFrameUs(uint64_t frame, const TimecodeRate &rate);
+uint64_t timecodeFramesIn(int64_t us, const TimecodeRate &rate);
+bool parseTimecodeRate(const char *text, size_t length, TimecodeRate &rate);
+bool parseTimecode(const char *text, size_t length, const TimecodeRate &rate, uint32_t &frame);
+bool parseTimecodeCommand(const char *text, size_t length, TimecodeRate &rate, uint32_t &frame);
+void formatTimecode(uint64_t frame, const TimecodeRate &rate, char *text, size_t size);
@@ -0,0 +1,86 @@
+#include "TraceGenerator.h"
+
+#include "SessionQuery.h"
+
+uint32_t traceRandom(TraceGenerator &gen) {
+  // xorshift32
+  gen.rng ^= gen.rng << 13;
+  gen.rng ^= gen.rng >> 17;
+  gen.rng ^= gen.rng << 5;
+  return gen.rng;
+}
+
+uint32_t traceRange(TraceGenerator &gen, uint32_t low, uint32_t high) {
+  return low + traceRandom(gen) % (high - low + 1);
+}
+
+void traceGenInit(TraceGenerator &gen, uint32_t seed) {
+  gen.rng = seed ? seed : 1;
+  gen.holdCommand = 0;
+  gen.holdRepeats = 0;
+  gen.burstLeft = 0;
+  // Start within ten minutes of where a 32-bit millis() would wrap
+  gen.timeUs = 4294967296000ULL - (usec_t)traceRange(gen, 0, 600000) * 1000;
+}
+
+TracePress traceGenNext(TraceGenerator &gen) {
+  TracePress event;
+  event.repeat = false;
+  if (gen.holdRepeats > 0) {
+    // NEC-style repeat frames every ~108 ms while a button is held
+    gen.holdRepeats--;
+    gen.timeUs += 108000;
+    event.command = gen.holdCommand;
+    event.repeat = true;
+    event.timeUs = gen.timeUs;
+    return event;
+  }
+  uint32_t roll = traceRange(gen, 0, 99);
+  if (gen.burstLeft > 0) {
+    gen.burstLeft--;
+    gen.timeUs += (usec_t)traceRange(gen, 150, 900) * 1000;
+  } else if (roll < 5) {
+    gen.timeUs += (usec_t)traceRange(gen, 60000, 3600000) * 1000;   // Long idle
+  } else {
+    gen.timeUs += (usec_t)traceRange(gen, 1000, 20000) * 1000;
+    if (roll < 20) gen.burstLeft = traceRange(gen, 3, 40);
+  }
+  uint32_t kind = traceRange(gen, 0, 99);
+  if (kind < 8) {
+    event.command = traceRange(gen, 0, 255);          // Possibly unmapped
+  } else {
+    event.command = keyMap[traceRange(gen, 0, keyMapSize - 1)].code;
+    if (kind < 18) {
+      gen.holdCommand = event.command;
+      gen.holdRepeats = traceRange(gen, 3, 20);
+    }
+  }
+  event.timeUs = gen.timeUs;
+  return event;
+}
+
+// Next record of a synthetic session: presses in time order, with a sync
+// record now and then written up to 1 s before the press it follows
+EventRecord traceQueryRecord(TraceGenerator &gen, usec_t &timeUs) {
+  timeUs += (usec_t)traceRange(gen, 150, 20000) * 1000;
+  if (traceRange(gen, 0, 19) == 0) {
+    usec_t back = traceRange(gen, 0, QUERY_SLACK_US - 1);
+    EventRecord record = {timeUs > back ? timeUs - back : 0, REC_SYNC, 0, 0, 0, 0};
+    return record;
+  }
+  EventRecord record = {timeUs, REC_PRESS, (uint8_t)traceRange(gen, 0, keyMapSize - 1), 1, 0, 0};
+  return record;
+}
+
+// Optional "[seed] [events]" for the trace generator commands
+bool parseTraceArguments(const char *text, size_t length, uint32_t &seed, int &events) {
+  const char *seedText;
+  size_t seedLength;
+  trimSpan(text, length);
+  if (!nextWord(text, length, seedText, seedLength)) return true;
+  int seedValue = 0;
+  if (!parseNumber(seedText, seedLength, 0, 999999999, seedValue)) return false;
+  seed = (uint32_t)seedValue;
+  if (length == 0) return true;
+  return parseNumber(text, length, 1, 100000, events);
+}
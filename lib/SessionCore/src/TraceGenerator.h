@@ -0,0 +1,28 @@
+#pragma once
+// Randomized press traces with bursts, holds, long idles, unknown codes and
+// a start just before the old 32-bit millis() wrap. The firmware's
+// 'selftest' and 'bench trace' and the native tests replay the same traces.
+
+#include "SessionFormat.h"
+
+struct TraceGenerator {
+  uint32_t rng;
+  usec_t timeUs;
+  uint16_t holdCommand;
+  int holdRepeats;                   // Repeat frames left in the current hold
+  int burstLeft;                     // Presses left in the current burst
+};
+
+// One decoded IR frame of a trace
+struct TracePress {
+  uint16_t command;
+  bool repeat;                       // NEC repeat frame of a held button
+  usec_t timeUs;
+};
+
+uint32_t traceRandom(TraceGenerator &gen);
+uint32_t traceRange(TraceGenerator &gen, uint32_t low, uint32_t high);
+void traceGenInit(TraceGenerator &gen, uint32_t seed);
+TracePress traceGenNext(TraceGenerator &gen);
+EventRecord traceQueryRecord(TraceGenerator &gen, usec_t &timeUs);
+bool parseTraceArguments(const char *text, size_t length, uint32_t &seed, int &events);
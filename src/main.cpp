@@ -3,289 +3,3371 @@
 #include <SPIFFS.h>
 #include <Preferences.h>
 #include <BleKeyboard.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <esp_attr.h>
+#include <esp_partition.h>
+#include <atomic>
+#include <time.h>
+#include <SessionFormat.h>
+#include <SessionTime.h>
+#include <SessionQuery.h>
+#include <SessionCapture.h>
+#include <TraceGenerator.h>
+#include <SessionCommand.h>
 
 // =========== IR Receiver Pin ===========
 #define IR_RECEIVE_PIN 15
 
+// =========== Serial Input Limits ===========
+#define SERIAL_LINE_MAX 96            // Longest accepted command line
+#define SERIAL_LINE_TIMEOUT_MS 1000   // Give up on a line after this long
+
+// =========== Time Base ===========
+// All capture, storage and export times are 64-bit microseconds (usec_t)
+// from esp_timer, which does not wrap. A virtual clock replaces it for self-tests.
+
+bool virtualClockEnabled = false;
+usec_t virtualClockUs = 0;
+
+// =========== Capture Buffering ===========
+#define PRESS_QUEUE_SIZE 32           // Decoded IR frames awaiting processing
+#define PENDING_RECORDS_MAX 64        // Records held in RAM until storage is mounted
+
+// =========== Session File Format ===========
+// Records, headers, timing and query types are in lib/SessionCore, which
+// the native tests build on the host
+
+// =========== Wall Clock ===========
+#define DRIFT_MIN_BASELINE_US 600000000LL  // 1 ms of serial jitter over 10 min is under 2 ppm
+
+bool wallClockSynced = false;
+int64_t wallOffsetUs = 0;            // Unix us minus device us at the latest sync
+int64_t lastSyncDeviceUs = 0;
+int64_t firstSyncDeviceUs = 0;       // Baseline for the drift estimate
+int64_t firstSyncEpochUs = 0;
+uint32_t wallSyncCount = 0;
+bool driftKnown = false;
+int32_t driftPpb = 0;
+
+// =========== Timecode ===========
+#define PREMIERE_TICKS_PER_SECOND "254016000000"
+
+// Camera timecode free-runs, so one anchor serves every later session
+TimecodeAnchor timecodeAnchor = {false, {25, false, false}, 0, 0};  // timeUs is device time
+
 // =========== Global Variables (IR & File) ===========
-unsigned long timestampStart = 0;     // Session start time in ms
-String lastButton = "";
-unsigned long lastButtonTimestamp = 0;
-bool holdLogged = false;
-String currentFileName = "";
 bool sessionActive = false;
 bool awaitingSessionName = false;
 
-String fileList[50];                 // Up to 50 files
-int fileCount = 0;
-String fileName = "";
-String logFileBase = "/premiere_log"; // Base for file naming
+// Concurrent sessions. Each slot holds its own file and track state, and
+// whatever logs to a session or rolls its segments is handed the slot.
+// Slot 0 is the session started from the prompt; activeSlot takes presses
+// when not routing by remote.
+#define MAX_SESSIONS 4
+#define ADDRESS_NONE 0xFFFF
+struct SessionSlot {
+  bool open = false;
+  uint16_t address = ADDRESS_NONE;   // Owning remote when routing by remote
+  String fileName;                   // Segment being logged; "" = none
+  File file;                         // Held open between records
+  String filePath;                   // What file is open on; the next segment's while idle
+  String segmentBase;                // Session path without the extension
+  SessionMeta meta = {};             // Written into the session's files
+  PressState press = {0, 0, 0, 1, -1, false};  // Segment start, track stacking, hold detection
+  usec_t lastActivity = 0;
+  int segmentNumber = 1;
+  bool segmentIdle = false;          // Segment closed; the next press opens another
+  uint32_t markerCount = 0;
+  uint32_t segmentEvents = 0;        // Presses and markers logged in this segment
+  uint32_t ringSession = 0;          // Ring session of the segment; 0 = SPIFFS
+  uint32_t hash = 0;                 // FNV-1a of the segment's records as written
+  bool hashValid = false;            // False after a resume: records before the reset are unknown
+};
+SessionSlot slots[MAX_SESSIONS];
+int activeSlot = 0;
+
+String fileList[50];                 // Up to 50 files
+int fileCount = 0;
+
+Preferences preferences;
+
+bool echoCommands = true;            // Echo logged commands to Serial
+bool discardWrites = false;          // Drop session records unstored and uncounted (self-test)
+
+// One decoded IR frame, stamped at capture time
+struct IrEvent {
+  uint16_t command;
+  uint8_t flags;
+  usec_t timeUs;
+  uint16_t address;                  // Remote address, for routing to a session slot
+};
+
+IrEvent pressQueue[PRESS_QUEUE_SIZE];
+uint32_t pressQueueHead = 0;         // Next slot to write
+uint32_t pressQueueTail = 0;         // Next slot to read
+usec_t lastAcceptedPressTime = 0;
+
+// Session records written before SPIFFS finished mounting
+struct PendingRecord {
+  String path;
+  EventRecord record;
+};
+
+PendingRecord pendingRecords[PENDING_RECORDS_MAX];
+int pendingRecordCount = 0;
+std::atomic<bool> storageReady{false};   // Set by the storage task once mounted
+std::atomic<bool> storageFailed{false};
+
+// Every sync marker on flash, so alignment never has to scan session files.
+// Hidden files start with "/." and are left out of listings.
+#define MARKER_INDEX_FILE "/.markers"
+struct MarkerEntry {
+  char path[MAX_PATH_LENGTH + 1];
+  uint32_t number;
+  uint32_t reserved;
+  usec_t timeUs;                     // Session time of the marker
+};
+static_assert(sizeof(MarkerEntry) == 48, "MarkerEntry layout is stored on flash");
+bool markerIndexStale = false;       // A marker was logged before storage was ready
+
+// Idle split: a session is a run of segment files "<name>-2", "<name>-3", ...
+#define SPLIT_PREROLL_US TRACK_STACK_WINDOW_US  // Lead-in so a segment's first clip lands on track 1
+bool prepareAfterResume = false;     // Idle segments resumed after a reset still need their next file
+
+// A slot's session file stays open between records, and new sessions take
+// a spare file whose header is already on flash, so no press pays for a create
+#define SPARE_FILE_COUNT 2
+#define SPARE_REFILL_QUIET_US 2000000ULL  // Refill only after this long without presses
+
+// =========== Ring Log ===========
+// Optional record store on a raw "ringlog" data partition (partitions.csv).
+// Each 4 KB sector starts with a header carrying a sequence number; records
+// are 32-byte entries programmed a flash page at a time. The session's
+// SPIFFS file then holds only its header and metadata.
+#define RING_PARTITION_LABEL "ringlog"
+#define RING_PARTITION_SUBTYPE 0x40
+#define RING_SECTOR_SIZE 4096
+#define RING_PAGE_SIZE 256
+#define RING_SECTOR_MAGIC 0x474E4952UL  // "RING"
+#define RING_EMPTY 0xFFFFFFFFUL
+#define RING_FLUSH_MS 500             // Program a partial page after this long without records
+#define RING_ERASE_QUIET_US 2000000ULL  // Erase the next sector only after this long without presses
+
+struct RingSectorHeader {
+  uint32_t magic;
+  uint32_t sequence;                 // Increases by one per sector written
+  uint32_t eraseCount;               // Wear of this sector
+  uint32_t floor;                    // Sectors with a lower sequence are wiped
+  uint32_t nextSession;              // Session number the ring would hand out next
+  uint32_t reserved[3];
+};
+struct RingEntry {
+  uint32_t session;                  // RING_EMPTY while unprogrammed
+  uint32_t check;                    // Rejects torn entries
+  EventRecord record;
+  uint32_t reserved[2];
+};
+static_assert(sizeof(RingSectorHeader) == 32 && sizeof(RingEntry) == 32, "Ring layout is stored on flash");
+
+const esp_partition_t *ringPartition = nullptr;
+uint32_t ringSectors = 0;
+uint32_t ringHeadSector = 0;
+uint32_t ringSequence = 0;           // Sequence of the head sector
+uint32_t ringFloor = 1;
+uint32_t ringEraseCount = 0;         // Erase count of the head sector
+uint32_t ringNextEraseCount = 0;     // Erase count the sector erased ahead will carry
+uint32_t ringWriteOffset = 0;        // Partition offset of the first buffered byte
+uint32_t ringNextSession = 1;
+int32_t ringErasedSector = -1;       // Next sector, erased ahead of need
+uint8_t ringPage[RING_PAGE_SIZE];
+uint32_t ringPageFill = 0;
+unsigned long ringLastAppend = 0;
+uint32_t ringPrograms = 0;
+uint32_t ringErases = 0;
+
+// Where a reader takes records from: the session file or the ring
+struct RecordCursor {
+  File *file;
+  SessionHeader header;
+  uint32_t ringSession;
+  uint32_t ringVisited;              // Sectors finished, oldest first
+  uint32_t ringOffset;               // Within the current sector; 0 = not entered
+  uint32_t ringSteps;                // Entries examined
+  uint32_t ringStepLimit;            // Yield after this many; 0 = no limit
+  uint32_t ringRejected;             // This session's entries that failed their check
+};
+
+// Session state mirrored to RTC slow memory, which survives watchdog and
+// brownout resets but not power loss. A heartbeat bounds the lost time.
+// Every open slot has an entry with its own checksum, so a press only
+// rewrites the entry of the slot it went to.
+#define CHECKPOINT_MAGIC 0x43504B32UL
+#define CHECKPOINT_HEARTBEAT_US 250000ULL
+#define RESUME_MAX_STALLED 3          // Resumes in a row that reset again before giving up
+#define RESUME_STABLE_US 10000000ULL  // Heartbeats this long after a resume mean it held
+struct SlotCheckpoint {
+  uint32_t magic;                    // CHECKPOINT_MAGIC while the slot is open
+  char path[MAX_PATH_LENGTH + 1];
+  char segmentBase[MAX_PATH_LENGTH + 1];
+  uint16_t address;
+  int32_t segmentNumber;
+  int32_t trackIndex;
+  uint32_t markerCount;
+  uint32_t segmentEvents;
+  uint8_t segmentIdle;
+  uint8_t reserved[3];
+  uint32_t ringSession;
+  usec_t lastClipTime;
+  usec_t lastSeenUs;                 // Session time at the latest event or heartbeat
+  uint32_t checksum;
+};
+struct SessionCheckpoint {
+  uint32_t magic;
+  uint32_t resumeCount;              // Resumes in a row the heartbeat did not get past
+  uint32_t checksum;                 // Of the two fields above
+  SlotCheckpoint slots[MAX_SESSIONS];
+};
+RTC_NOINIT_ATTR SessionCheckpoint checkpoint;
+usec_t lastHeartbeatTime = 0;
+bool resumeAbandoned = false;        // Boot loop caught: stay at the menu, no autostart
+
+// Catalogue of sessions and their metadata, kept in RAM and persisted to a
+// hidden manifest so 'list scene=12' never opens a session file
+#define MANIFEST_FILE "/.manifest"
+#define CATALOGUE_MAX 50
+#define MANIFEST_DELETED 0x01         // Tombstone: the file is erased in the background
+#define MANIFEST_VERIFIED 0x02        // Scrubbed at least once
+#define MANIFEST_CORRUPT 0x04         // The last scrub found damage
+#define MANIFEST_SEALED 0x08          // checksum holds the records as written, set when the segment closed
+#define GC_INTERVAL_MS 100            // At most one file erase per interval
+#define GC_QUIET_US 2000000ULL        // Erase only after this long without presses
+#define MANIFEST_SAVE_QUIET_US 2000000ULL  // Write the manifest only after this long without presses
+struct ManifestEntry {
+  char path[MAX_PATH_LENGTH + 1];
+  SessionMeta meta;
+  uint32_t flags;
+  uint32_t checksum;                 // FNV-1a of the records as written, when sealed
+};
+static_assert(sizeof(ManifestEntry) == 88, "ManifestEntry layout is stored on flash");
+ManifestEntry catalogue[CATALOGUE_MAX];
+int catalogueCount = 0;
+bool catalogueLoaded = false;
+bool catalogueDirty = false;
+unsigned long lastGcTime = 0;
+SessionMeta currentMeta = {};        // Applied to the next session
+
+// Background scrub: re-reads closed sessions in small chunks while capture
+// is quiet and records the outcome in the catalogue
+#define SCRUB_INTERVAL_MS 20          // At most one chunk per interval
+#define SCRUB_QUIET_US 5000000ULL     // Read back only after this long without presses
+#define SCRUB_CHUNK_BYTES 512         // Flash read per chunk
+#define SCRUB_PASS_INTERVAL_MS 600000UL
+int scrubIndex = -1;                 // Catalogue entry being verified; -1 = between passes
+String scrubPath;
+File scrubFile;
+RecordCursor scrubCursor;
+bool scrubOpen = false;
+uint32_t scrubHash = 0;
+uint32_t scrubErrors = 0;
+uint32_t scrubPasses = 0;
+unsigned long lastScrubTime = 0;
+unsigned long scrubPassEnd = 0;
+
+// Storage forecast
+#define DF_RECENT_SESSIONS 5          // Closed sessions the recording rate is taken from
+#define DF_CHECK_MS 10000             // Free-space check for the low-space warning
+#define DF_HYSTERESIS_PCT 2           // Re-arm the warning once this far above the threshold
+bool lowSpaceWarned = false;
+unsigned long lastDfCheck = 0;
+
+// Sparse index of the last file queried (see SessionQuery.h); extended as the file grows
+struct QueryIndex {
+  String path;
+  uint32_t blocks;
+  usec_t blockStart[QUERY_INDEX_MAX];
+};
+QueryIndex queryIndex;
+
+// Last accepted press per remote address, when routing by remote
+struct RemoteDebounce {
+  uint16_t address;
+  usec_t timeUs;
+};
+RemoteDebounce remoteDebounce[MAX_SESSIONS];
+
+// =========== Global Variables (Config) ===========
+#define CONFIG_IDLE_COMMIT_MS 5000    // Commit changed settings after this much quiet
+
+// Dirty bits, one per persisted field
+enum ConfigField {
+  CFG_LOG_BASE = 1 << 0,
+  CFG_PAIRED = 1 << 1,
+  CFG_SESSION_COUNTER = 1 << 2,
+  CFG_START_KEY = 1 << 3,
+  CFG_AUTO_START = 1 << 4,
+  CFG_MARKER_KEY = 1 << 5,
+  CFG_IDLE_SPLIT = 1 << 6,
+  CFG_SELECT_KEY = 1 << 7,
+  CFG_ROUTE = 1 << 8,
+  CFG_RING_STORE = 1 << 9,
+  CFG_LOW_SPACE = 1 << 10,
+};
+
+// RAM copy of the persisted settings; Preferences is only touched on load
+// and on a deferred commit
+struct Config {
+  String logBase;                    // Base for file naming
+  bool paired;
+  uint32_t sessionCounter;           // Number of the last auto-named session
+  uint16_t startKey;                 // IR command that starts a session, or KEY_NONE
+  bool autoStart;                    // Start a session at boot without the menu
+  uint16_t markerKey;                // IR command logged as a sync marker, or KEY_NONE
+  uint16_t idleSplitSec;             // Close the segment after this many idle seconds; 0 = never
+  uint16_t selectKey;                // IR command that moves focus to the next session slot
+  bool routeByRemote;                // Give each remote address its own session slot
+  bool ringStore;                    // Write new sessions' records to the ring log partition
+  uint8_t lowSpacePct;               // Warn when free SPIFFS space drops below this; 0 = never
+};
+
+Config config = {"/premiere_log", false, 0, KEY_NONE, false, KEY_NONE, 0, KEY_NONE, false, false, 10};
+uint32_t configDirty = 0;            // ConfigField bits changed since the last commit
+unsigned long configChangedTime = 0;
+
+// =========== Global Variables (Mode & BLE) ===========
+ // 0 = Menu, 1 = IR Mode, 2 = File Management, 3 = BLE Connect/Pair
+int currentMode = 0;  
+bool menuShown = false;              // Menu printed; the choice is read once it arrives
+bool bleModeStarted = false;         // BLE mode entered; bleMode() is polled from loop()
+bool bleReported = false;            // Connection already announced
+
+// Create a BLE Keyboard instance 
+BleKeyboard bleKeyboard("ESP32 Media Keyboard", "MyCompany", 100);
+
+// =========== Global Variables (Diagnostics) ===========
+// Runtime counters; relaxed atomics keep the hot-path cost to one add
+struct RuntimeStats {
+  std::atomic<uint32_t> eventsCaptured{0};     // IR frames decoded during a session
+  std::atomic<uint32_t> eventsLogged{0};       // Clips written to the session file
+  std::atomic<uint32_t> unmappedCodes{0};      // Frames with no button mapping
+  std::atomic<uint32_t> repeatsSuppressed{0};  // Held-button repeats after the first _hold
+  std::atomic<uint32_t> bytesWritten{0};       // Bytes appended to session files
+  std::atomic<uint32_t> flushCount{0};         // Held-open session file flushes plus ring page programs
+  std::atomic<uint32_t> writeFailures{0};
+  std::atomic<uint32_t> transferBytes{0};      // Bytes sent by file transfers
+  std::atomic<uint32_t> transferUs{0};         // Time spent in file transfers
+  std::atomic<uint32_t> sessionsStarted{0};
+  std::atomic<uint32_t> eventsDropped{0};      // Frames or lines lost to full buffers
+  std::atomic<uint32_t> pressQueueHighWater{0};
+  std::atomic<uint32_t> pendingHighWater{0};
+  std::atomic<uint32_t> nvsWrites{0};          // Preferences puts actually issued
+};
+
+RuntimeStats stats;
+uint32_t commandMaxUs = 0;           // Worst-case serial command latency
+String slowestCommand = "";
+
+// Boot milestones, in micros() since the application started
+enum BootPhase { BOOT_IR_ARMED, BOOT_SERIAL, BOOT_PREFS_LOADED, BOOT_SETUP_DONE, BOOT_FS_MOUNTED, BOOT_PHASES };
+const char *bootPhaseNames[BOOT_PHASES] = {"ir_armed", "serial", "prefs_loaded", "setup_done", "fs_mounted"};
+uint32_t bootPhaseUs[BOOT_PHASES];
+
+#define HEAP_SAMPLE_INTERVAL_MS 300000UL  // One heap sample every 5 minutes
+#define HEAP_SAMPLE_COUNT 48               // 4 hours of history
+
+// Subsystems whose heap usage is accounted separately
+enum HeapSubsystem { HEAP_IR, HEAP_SESSION, HEAP_SERIAL, HEAP_BLE, HEAP_SUBSYSTEMS };
+const char *heapSubsystemNames[HEAP_SUBSYSTEMS] = {"ir", "session", "serial", "ble"};
+
+struct HeapAccount {
+  int32_t netBytes;    // Bytes still held after the accounted calls returned
+  uint32_t calls;
+};
+
+struct HeapSample {
+  uint32_t uptimeS;
+  uint32_t freeBytes;
+  uint32_t largestBlock;
+  uint32_t minFreeBytes;
+};
+
+HeapAccount heapAccounts[HEAP_SUBSYSTEMS];
+HeapSample heapSamples[HEAP_SAMPLE_COUNT];
+int heapSampleCount = 0;             // Samples taken since boot
+unsigned long lastHeapSampleTime = 0;
+
+#define TRACE_CAPACITY 512                 // Begin/end events kept in RAM
+
+// Spans recorded by the trace ring
+enum TraceId { TRACE_CAPTURE, TRACE_FORMAT, TRACE_FLUSH, TRACE_TRANSFER, TRACE_BLE, TRACE_STORAGE_INIT, TRACE_SCRUB, TRACE_IDS };
+const char *traceNames[TRACE_IDS] = {"capture", "format", "flush", "transfer", "ble", "storage_init", "scrub"};
+
+struct TraceEvent {
+  uint32_t timestampUs;
+  uint8_t id;
+  char phase;          // 'B' = begin, 'E' = end
+};
+
+TraceEvent traceRing[TRACE_CAPACITY];
+uint32_t traceHead = 0;              // Total events recorded since last clear
+
+// =========== Function Prototypes ===========
+bool initFileSystem();
+void storageInitTask(void *param);
+void waitForStorage();
+void flushPendingRecords();
+void configLoad();
+void configSetLogBase(const String &logBase);
+void configSetPaired(bool paired);
+void configSetSessionCounter(uint32_t counter);
+void configSetStartKey(uint16_t startKey);
+void configSetAutoStart(bool autoStart);
+void configSetMarkerKey(uint16_t markerKey);
+void configSetIdleSplit(uint16_t seconds);
+void configSetSelectKey(uint16_t selectKey);
+void configSetRouteByRemote(bool routeByRemote);
+void configSetRingStore(bool ringStore);
+void configSetLowSpace(uint8_t percent);
+void configCommit();
+void configTick();
+void pollIrReceiver();
+bool acceptPress(const IrEvent &event);
+bool popPress(IrEvent &event);
+void clearPressQueue();
+void startSession(const String &path);
+SessionSlot *slotForFile(const String &path);
+bool openSlot(int slot, uint16_t address);
+int slotForEvent(const IrEvent &event);
+void closeSlots();
+void writeClockRecords(usec_t deviceUs, bool sync, bool timecode);
+void printSlots();
+void checkpointSave(const SessionSlot &s);
+void checkpointClearSlot(const SessionSlot &s);
+void checkpointClear();
+void checkpointTick();
+bool resumeFromCheckpoint();
+void beginSegment(SessionSlot &s, const String &path, usec_t startUs);
+bool nextAutoSessionPath(String &path);
+void closeIdleSegment(SessionSlot &s);
+void sealSegment(SessionSlot &s);
+void prepareNextSegment(SessionSlot &s);
+void discardPreparedSegment(SessionSlot &s);
+void openNextSegment(SessionSlot &s, usec_t pressTime);
+bool startAutoSession();
+void endSession();
+bool renameStoredFile(int fileIndex, String newName);
+usec_t clockNowUs();
+void clockSetVirtual(usec_t nowUs);
+void clockUseReal();
+String spareFilePath(int index);
+bool createSessionFile(const String &path, const SessionMeta &meta);
+bool claimSpareFile(const String &path, const SessionMeta &meta);
+size_t writeSessionHeader(File &file, const SessionMeta &meta);
+bool readSessionMeta(File &file, const SessionHeader &header, SessionMeta &meta);
+bool openSessionFile(SessionSlot &s, const String &path);
+void closeSessionFile(SessionSlot &s);
+bool captureQuiet(usec_t quietUs);
+void spareRefillTick();
+bool appendRecord(SessionSlot &s, const String &path, const EventRecord &record);
+void writeRecord(SessionSlot &s, const EventRecord &record);
+bool readSessionHeader(File &file, SessionHeader &header);
+bool readRecord(File &file, const SessionHeader &header, EventRecord &record);
+String formatCommand(const String &buttonName, usec_t clipTime, int trackIndex, const char *timeBase);
+String formatUtc(int64_t epochUs);
+void syncWallClock(int64_t epochMs, bool quiet);
+void printWallClock();
+bool handleClockCommand(const Command &command);
+void parseSerialCommand(const String &line, Command &command);
+bool runSharedCommand(const Command &command);
+bool handleSharedCommand(const String &input);
+bool handleMetaCommand(const Command &command);
+String formatMeta(const SessionMeta &meta);
+int catalogueFind(const String &path);
+bool catalogueAdd(const String &path, const SessionMeta &meta, bool capturing);
+void catalogueRemove(const String &path);
+int catalogueEvictCandidate(bool eraseNow);
+bool catalogueEvict(int index, bool warn);
+void catalogueRename(const String &oldPath, const String &newPath);
+void catalogueRebuild();
+void catalogueLoad();
+void catalogueSave();
+void catalogueTick();
+void listCatalogue(const SessionMeta &filter, int fields);
+bool isDeletedFile(const String &path);
+bool tombstoneFile(const String &path);
+void garbageCollectTick();
+bool sessionFileInUse(const String &path);
+bool scrubRecordValid(const EventRecord &record);
+void scrubFinish();
+void scrubTick();
+void printScrubStatus();
+bool sessionUsage(const String &path, uint32_t &bytes, uint32_t &records, usec_t &durationUs);
+void printStorageForecast();
+void storageWarningTick();
+bool parseQuery(String text, QueryOp &op, QueryFilter &filter);
+void printQueryRecord(const EventRecord &record);
+uint32_t queryIndexUpdate(File &file, const SessionHeader &header, const String &path);
+void runQuery(const String &path, QueryOp op, const QueryFilter &filter);
+String formatTimecode(uint64_t frame, const TimecodeRate &rate);
+String formatTimecodeRate(const TimecodeRate &rate);
+bool handleTimecodeCommand(const Command &command);
+bool makeTimecodeRecord(const SessionSlot &s, EventRecord &record);
+EventRecord makeSyncRecord(const SessionSlot &s, usec_t deviceUs);
+void writeDriftRecord(SessionSlot &s);
+SessionTiming currentSessionTiming(const SessionSlot &s);
+void loadSessionTiming(RecordCursor &cursor, SessionTiming &timing);
+bool ringInit();
+bool ringSectorValid(uint32_t sector, RingSectorHeader &header);
+uint32_t ringEntryCheck(const RingEntry &entry);
+bool ringSectorBlank(uint32_t sector);
+void ringFlush();
+void ringOpenSession(uint32_t session);
+bool ringAppend(uint32_t session, const EventRecord &record);
+void ringTick();
+void ringWipe();
+void printRingStatus();
+void openRecordCursor(File &file, const SessionHeader &header, RecordCursor &cursor);
+bool nextRecord(RecordCursor &cursor, EventRecord &record);
+void rewindRecordCursor(RecordCursor &cursor);
+usec_t exportPlacement(const SessionTiming &timing, usec_t timeUs, const char *&timeBase, String &comment);
+String formatRecord(const EventRecord &record, const SessionTiming &timing);
+void logMarker(SessionSlot &s, usec_t eventTime);
+bool isHiddenFile(const String &path);
+void markerIndexAppend(const String &path, uint32_t number, usec_t timeUs);
+void markerIndexRebuild();
+void markerIndexRename(const String &oldPath, const String &newPath);
+void printMarkerIndex();
+void alignSessions(uint32_t number);
+void logCommand(SessionSlot &s, int keyIndex, PressKind kind, usec_t eventTime);
+void sendFileOverSerial(const char *fileNameParam);
+void listStoredFiles();
+void deleteAllFiles();
+void sendAllFilesOverSerial();
+void handleButtonPress(SessionSlot &s, const IrEvent &event);
+String readSerialLine();
+bool parseNumber(const String &text, int minValue, int maxValue, int &value);
+bool buildSessionFileName(String input, String &path);
+void handleSerialCommand(String command);
+void enterMenu();
+void enterIrMode();
+void selectMode();
+uint32_t heapMark();
+void heapAccount(HeapSubsystem subsystem, uint32_t mark);
+void heapTrackerTick();
+void printHeapStats();
+void statAdd(std::atomic<uint32_t> &counter, uint32_t amount);
+void statMax(std::atomic<uint32_t> &counter, uint32_t value);
+void statsCopy(RuntimeStats &to, const RuntimeStats &from);
+void markBootPhase(BootPhase phase);
+void printBootProfile();
+void printStats(bool json);
+void resetStats();
+void traceBegin(TraceId id);
+void traceEnd(TraceId id);
+void dumpTrace();
+void runBenchmark(int iterations);
+void runFsCalibration(int kilobytes);
+bool runTraceTest(uint32_t seed, int events, bool benchmark);
+bool runQuerySelfTest(uint32_t seed);
+void sendVolumeUp();
+void irModeLoop();
+void bleMode();  
+void setup();
+void loop();
+
+// =========== File/IR Management Functions ===========
+
+// Initialize SPIFFS
+bool initFileSystem() {
+  if (!SPIFFS.begin(true)) {
+    Serial.println("Failed to mount SPIFFS");
+    return false;
+  }
+  Serial.println("SPIFFS mounted successfully");
+  return true;
+}
+
+// Mount SPIFFS off the main loop, so IR capture is armed before a slow
+// (possibly formatting) mount completes
+void storageInitTask(void *param) {
+  traceBegin(TRACE_STORAGE_INIT);
+  if (!initFileSystem()) {
+    storageFailed = true;
+    Serial.println("Storage unavailable; presses are kept in RAM only.");
+    traceEnd(TRACE_STORAGE_INIT);
+    vTaskDelete(NULL);
+    return;
+  }
+  markBootPhase(BOOT_FS_MOUNTED);
+  traceEnd(TRACE_STORAGE_INIT);
+  storageReady = true;
+  vTaskDelete(NULL);
+}
+
+// =========== Config Store ===========
+
+void configLoad() {
+  preferences.begin("my-app", false);
+  config.logBase = preferences.getString("logBase", "/premiere_log");
+  config.paired = preferences.getBool("paired", false);
+  config.sessionCounter = preferences.getUInt("sessionNum", 0);
+  config.startKey = preferences.getUShort("startKey", KEY_NONE);
+  config.autoStart = preferences.getBool("autoStart", false);
+  config.markerKey = preferences.getUShort("markerKey", KEY_NONE);
+  config.idleSplitSec = preferences.getUShort("idleSplit", 0);
+  config.selectKey = preferences.getUShort("selectKey", KEY_NONE);
+  config.routeByRemote = preferences.getBool("routeRemote", false);
+  config.ringStore = preferences.getBool("ringStore", false);
+  config.lowSpacePct = preferences.getUChar("lowSpace", 10);
+  configDirty = 0;
+}
+
+static void configMarkDirty(uint32_t field) {
+  configDirty |= field;
+  configChangedTime = millis();
+}
+
+void configSetLogBase(const String &logBase) {
+  if (config.logBase == logBase) return;
+  config.logBase = logBase;
+  configMarkDirty(CFG_LOG_BASE);
+}
+
+void configSetPaired(bool paired) {
+  if (config.paired == paired) return;
+  config.paired = paired;
+  configMarkDirty(CFG_PAIRED);
+}
+
+void configSetSessionCounter(uint32_t counter) {
+  if (config.sessionCounter == counter) return;
+  config.sessionCounter = counter;
+  configMarkDirty(CFG_SESSION_COUNTER);
+}
+
+void configSetStartKey(uint16_t startKey) {
+  if (config.startKey == startKey) return;
+  config.startKey = startKey;
+  configMarkDirty(CFG_START_KEY);
+}
+
+void configSetAutoStart(bool autoStart) {
+  if (config.autoStart == autoStart) return;
+  config.autoStart = autoStart;
+  configMarkDirty(CFG_AUTO_START);
+}
+
+void configSetMarkerKey(uint16_t markerKey) {
+  if (config.markerKey == markerKey) return;
+  config.markerKey = markerKey;
+  configMarkDirty(CFG_MARKER_KEY);
+}
+
+void configSetIdleSplit(uint16_t seconds) {
+  if (config.idleSplitSec == seconds) return;
+  config.idleSplitSec = seconds;
+  configMarkDirty(CFG_IDLE_SPLIT);
+}
+
+void configSetSelectKey(uint16_t selectKey) {
+  if (config.selectKey == selectKey) return;
+  config.selectKey = selectKey;
+  configMarkDirty(CFG_SELECT_KEY);
+}
+
+void configSetRouteByRemote(bool routeByRemote) {
+  if (config.routeByRemote == routeByRemote) return;
+  config.routeByRemote = routeByRemote;
+  configMarkDirty(CFG_ROUTE);
+}
+
+void configSetRingStore(bool ringStore) {
+  if (config.ringStore == ringStore) return;
+  config.ringStore = ringStore;
+  configMarkDirty(CFG_RING_STORE);
+}
+
+void configSetLowSpace(uint8_t percent) {
+  if (config.lowSpacePct == percent) return;
+  config.lowSpacePct = percent;
+  configMarkDirty(CFG_LOW_SPACE);
+}
+
+// Write every changed field to NVS in one pass
+void configCommit() {
+  if (configDirty == 0) return;
+  if (configDirty & CFG_LOG_BASE) {
+    preferences.putString("logBase", config.logBase);
+    statAdd(stats.nvsWrites, 1);
+  }
+  if (configDirty & CFG_PAIRED) {
+    preferences.putBool("paired", config.paired);
+    statAdd(stats.nvsWrites, 1);
+  }
+  if (configDirty & CFG_SESSION_COUNTER) {
+    preferences.putUInt("sessionNum", config.sessionCounter);
+    statAdd(stats.nvsWrites, 1);
+  }
+  if (configDirty & CFG_START_KEY) {
+    preferences.putUShort("startKey", config.startKey);
+    statAdd(stats.nvsWrites, 1);
+  }
+  if (configDirty & CFG_AUTO_START) {
+    preferences.putBool("autoStart", config.autoStart);
+    statAdd(stats.nvsWrites, 1);
+  }
+  if (configDirty & CFG_MARKER_KEY) {
+    preferences.putUShort("markerKey", config.markerKey);
+    statAdd(stats.nvsWrites, 1);
+  }
+  if (configDirty & CFG_IDLE_SPLIT) {
+    preferences.putUShort("idleSplit", config.idleSplitSec);
+    statAdd(stats.nvsWrites, 1);
+  }
+  if (configDirty & CFG_SELECT_KEY) {
+    preferences.putUShort("selectKey", config.selectKey);
+    statAdd(stats.nvsWrites, 1);
+  }
+  if (configDirty & CFG_ROUTE) {
+    preferences.putBool("routeRemote", config.routeByRemote);
+    statAdd(stats.nvsWrites, 1);
+  }
+  if (configDirty & CFG_RING_STORE) {
+    preferences.putBool("ringStore", config.ringStore);
+    statAdd(stats.nvsWrites, 1);
+  }
+  if (configDirty & CFG_LOW_SPACE) {
+    preferences.putUChar("lowSpace", config.lowSpacePct);
+    statAdd(stats.nvsWrites, 1);
+  }
+  configDirty = 0;
+}
+
+// Commit once settings have been quiet for CONFIG_IDLE_COMMIT_MS
+void configTick() {
+  if (configDirty != 0 && (millis() - configChangedTime) >= CONFIG_IDLE_COMMIT_MS) {
+    configCommit();
+  }
+}
+
+// Block until the storage task has finished, for commands that need SPIFFS
+void waitForStorage() {
+  if (!storageReady && !storageFailed) {
+    Serial.println("Waiting for storage...");
+    while (!storageReady && !storageFailed) {
+      delay(10);
+    }
+  }
+}
+
+// Append records buffered during boot once SPIFFS is mounted. Records of a
+// session that already ended go through a scratch slot.
+void flushPendingRecords() {
+  if (!storageReady || pendingRecordCount == 0) return;
+  SessionSlot ended;
+  for (int i = 0; i < pendingRecordCount; i++) {
+    const String &path = pendingRecords[i].path;
+    SessionSlot *owner = slotForFile(path);
+    if (!owner) {
+      int index = catalogueFind(path);
+      if (index >= 0) ended.meta = catalogue[index].meta;
+      owner = &ended;
+    }
+    // A queued record already counted in the seal checksum; a lost one voids it
+    if (!appendRecord(*owner, path, pendingRecords[i].record)) {
+      owner->hashValid = false;
+    }
+    pendingRecords[i].path = "";
+  }
+  closeSessionFile(ended);
+  Serial.printf("Flushed %d buffered records to storage.\n", pendingRecordCount);
+  pendingRecordCount = 0;
+}
+
+// Take a decoded frame off the receiver
+void pollIrReceiver() {
+  if (!IrReceiver.decode()) return;
+  IrEvent event;
+  event.command = IrReceiver.decodedIRData.command;
+  event.flags = IrReceiver.decodedIRData.flags;
+  event.address = IrReceiver.decodedIRData.address;
+  event.timeUs = clockNowUs();
+  IrReceiver.resume();
+  bool isRepeat = false;
+#ifdef IRDATA_FLAGS_IS_REPEAT
+  isRepeat = (event.flags & IRDATA_FLAGS_IS_REPEAT);
+#endif
+  // The start key works in every mode; the session then runs in IR mode
+  if (!sessionActive && event.command == config.startKey && !isRepeat) {
+    enterIrMode();
+    startAutoSession();
+    return;
+  }
+  acceptPress(event);
+}
+
+// Queue a frame if a session is recording. Frames closer than
+// PRESS_DEBOUNCE_US to the last accepted one are dropped, which is what the
+// old blocking delay after each press did.
+bool acceptPress(const IrEvent &event) {
+  if (!sessionActive) return false;
+  // Routed remotes debounce independently so two operators never drop each other's presses
+  usec_t *lastAccepted = &lastAcceptedPressTime;
+  if (config.routeByRemote) {
+    int oldest = 0;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+      if (remoteDebounce[i].address == event.address) {
+        oldest = i;
+        break;
+      }
+      if (remoteDebounce[i].timeUs < remoteDebounce[oldest].timeUs) oldest = i;
+    }
+    if (remoteDebounce[oldest].address != event.address) {
+      remoteDebounce[oldest] = {event.address, 0};
+    }
+    lastAccepted = &remoteDebounce[oldest].timeUs;
+  }
+  if (!debounceAccept(*lastAccepted, event.timeUs)) return false;
+  statAdd(stats.eventsCaptured, 1);
+  if (pressQueueHead - pressQueueTail >= PRESS_QUEUE_SIZE) {
+    statAdd(stats.eventsDropped, 1);
+    return false;
+  }
+  pressQueue[pressQueueHead % PRESS_QUEUE_SIZE] = event;
+  pressQueueHead++;
+  statMax(stats.pressQueueHighWater, pressQueueHead - pressQueueTail);
+  return true;
+}
+
+bool popPress(IrEvent &event) {
+  if (pressQueueTail == pressQueueHead) return false;
+  event = pressQueue[pressQueueTail % PRESS_QUEUE_SIZE];
+  pressQueueTail++;
+  return true;
+}
+
+void clearPressQueue() {
+  pressQueueTail = pressQueueHead;
+}
+
+// =========== Time Base ===========
+
+usec_t clockNowUs() {
+  return virtualClockEnabled ? virtualClockUs : (usec_t)esp_timer_get_time();
+}
+
+void clockSetVirtual(usec_t nowUs) {
+  virtualClockEnabled = true;
+  virtualClockUs = nowUs;
+}
+
+void clockUseReal() {
+  virtualClockEnabled = false;
+}
+
+// =========== Wall Clock Sync ===========
+// The host sends "time <unix_ms>"; the offset to the device clock is kept in
+// RAM and a REC_SYNC record pins it into the active session file. Periodic
+// "ping <unix_ms>" does the same quietly, and the spread between syncs gives
+// the crystal drift that export corrects for.
+
+// ISO 8601 UTC with milliseconds
+String formatUtc(int64_t epochUs) {
+  if (epochUs < 0) epochUs = 0;
+  time_t seconds = (time_t)(epochUs / 1000000);
+  struct tm utc;
+  gmtime_r(&seconds, &utc);
+  char text[32];
+  snprintf(text, sizeof(text), "%04d-%02d-%02dT%02d:%02d:%02d.%03uZ", utc.tm_year + 1900, utc.tm_mon + 1,
+           utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec, (unsigned)((epochUs % 1000000) / 1000));
+  return text;
+}
+
+// Record the host's wall-clock time against the device clock. A constant
+// serial latency shifts every sync equally, so it cancels out of the drift.
+void syncWallClock(int64_t epochMs, bool quiet) {
+  usec_t deviceUs = clockNowUs();
+  int64_t epochUs = epochMs * 1000;
+  wallOffsetUs = epochUs - (int64_t)deviceUs;
+  lastSyncDeviceUs = (int64_t)deviceUs;
+  if (!wallClockSynced) {
+    firstSyncDeviceUs = (int64_t)deviceUs;
+    firstSyncEpochUs = epochUs;
+  } else if ((int64_t)deviceUs - firstSyncDeviceUs >= DRIFT_MIN_BASELINE_US) {
+    int64_t deviceSpan = (int64_t)deviceUs - firstSyncDeviceUs;
+    int64_t wallSpan = epochUs - firstSyncEpochUs;
+    driftPpb = (int32_t)((wallSpan - deviceSpan) * 1000000000LL / deviceSpan);
+    driftKnown = true;
+  }
+  wallClockSynced = true;
+  wallSyncCount++;
+  if (sessionActive) {
+    writeClockRecords(deviceUs, true, false);
+  }
+  if (quiet) {
+    Serial.printf("pong %llu\n", (unsigned long long)deviceUs);
+  } else {
+    Serial.println("Wall clock set: " + formatUtc(epochUs));
+  }
+}
+
+void printWallClock() {
+  if (!wallClockSynced) {
+    Serial.println("Wall clock: not synced (send 'time <unix_ms>')");
+    return;
+  }
+  int64_t nowUs = (int64_t)clockNowUs();
+  Serial.printf("Wall clock: %s (synced %u times, last %lld s ago)\n", formatUtc(nowUs + wallOffsetUs).c_str(),
+                (unsigned)wallSyncCount, (long long)((nowUs - lastSyncDeviceUs) / 1000000));
+  if (driftKnown) {
+    Serial.printf("Clock drift: %.3f ppm over %lld s\n", driftPpb / 1000.0,
+                  (long long)((lastSyncDeviceUs - firstSyncDeviceUs) / 1000000));
+  } else {
+    Serial.println("Clock drift: unknown (needs syncs 10 min apart)");
+  }
+}
+
+// "time", "time <unix_ms>", "ping <unix_ms>" and "tc ...", accepted from every serial prompt
+bool handleClockCommand(const Command &command) {
+  if (handleTimecodeCommand(command)) {
+    return true;
+  }
+  if (command.id == CMD_TIME) {
+    printWallClock();
+    return true;
+  }
+  bool ping = command.id == CMD_PING;
+  if (!ping && command.id != CMD_TIME_SET) return false;
+  if (command.valid) {
+    syncWallClock(command.epochMs, ping);
+  } else {
+    Serial.println(ping ? "Usage: ping <unix_ms>" : "Usage: time <unix_ms>");
+  }
+  return true;
+}
+
+EventRecord makeSyncRecord(const SessionSlot &s, usec_t deviceUs) {
+  return makeSyncRecordAt(deviceUs - s.press.start, (int64_t)deviceUs + wallOffsetUs);
+}
+
+// Store the drift rate for export when the segment has too few syncs of its own
+void writeDriftRecord(SessionSlot &s) {
+  if (!driftKnown) return;
+  EventRecord record = {clockNowUs() - s.press.start, REC_DRIFT, 0, 0, 0, (uint32_t)driftPpb};
+  writeRecord(s, record);
+}
+
+// Wall-clock mapping of the session being recorded, from the latest sync
+SessionTiming currentSessionTiming(const SessionSlot &s) {
+  SessionTiming timing = {};
+  EventRecord record;
+  if (makeTimecodeRecord(s, record)) {
+    addTimingRecord(timing, record);
+  }
+  timing.driftPpb = driftKnown ? driftPpb : 0;
+  if (wallClockSynced) {
+    addSyncPoint(timing, lastSyncDeviceUs - (int64_t)s.press.start, lastSyncDeviceUs + wallOffsetUs);
+    timing.synced = true;
+    timing.epochAtZeroUs = sessionWallUs(timing, 0);
+  }
+  return timing;
+}
+
+// Scan a session's sync and drift records, then rewind to the first record
+void loadSessionTiming(RecordCursor &cursor, SessionTiming &timing) {
+  timing = {};
+  EventRecord record;
+  while (nextRecord(cursor, record)) {
+    addTimingRecord(timing, record);
+  }
+  finishTiming(timing);
+  rewindRecordCursor(cursor);
+}
+
+// =========== Timecode ===========
+// "tc 01:00:00:00 [fps] [df]" anchors sessions to camera timecode. Export
+// then places clips in sequence time, subtracting the sequence's own start
+// timecode (zeroPoint) inside Premiere.
+
+String formatTimecode(uint64_t frame, const TimecodeRate &rate) {
+  char text[16];
+  formatTimecode(frame, rate, text, sizeof(text));
+  return text;
+}
+
+String formatTimecodeRate(const TimecodeRate &rate) {
+  String text = rate.ntsc ? String(rate.fps * 1000 / 1001.0, rate.fps == 24 ? 3 : 2) : String(rate.fps);
+  return rate.dropFrame ? text + " DF" : text;
+}
+
+// The anchor as seen from a session
+bool makeTimecodeRecord(const SessionSlot &s, EventRecord &record) {
+  return makeTimecodeRecordAt(timecodeAnchor, s.press.start, record);
+}
+
+// "tc", "tc off" and "tc HH:MM:SS:FF [fps] [df]"
+bool handleTimecodeCommand(const Command &command) {
+  if (command.id == CMD_TC) {
+    if (timecodeAnchor.set) {
+      uint64_t frame = timecodeAnchor.frame +
+                       timecodeFramesIn((int64_t)clockNowUs() - timecodeAnchor.timeUs, timecodeAnchor.rate);
+      Serial.println("Timecode: " + formatTimecode(frame, timecodeAnchor.rate) + " @ " +
+                     formatTimecodeRate(timecodeAnchor.rate));
+    } else {
+      Serial.println("Timecode: not set (send 'tc HH:MM:SS:FF [fps] [df]')");
+    }
+    return true;
+  }
+  if (command.id == CMD_TC_OFF) {
+    timecodeAnchor.set = false;
+    Serial.println("Timecode anchor cleared.");
+    return true;
+  }
+  if (command.id != CMD_TC_SET) return false;
+  if (!command.valid) {
+    Serial.println("Usage: tc HH:MM:SS:FF [23.976|24|25|29.97|30|50|59.94|60] [df]");
+    return true;
+  }
+  usec_t nowUs = clockNowUs();
+  timecodeAnchor = {true, command.rate, command.frame, (int64_t)nowUs};
+  if (sessionActive) {
+    writeClockRecords(nowUs, false, true);
+  }
+  Serial.println("Timecode set: " + formatTimecode(command.frame, command.rate) + " @ " +
+                 formatTimecodeRate(command.rate));
+  return true;
+}
+
+// =========== Ring Log ===========
+
+bool ringSectorValid(uint32_t sector, RingSectorHeader &header) {
+  if (esp_partition_read(ringPartition, sector * RING_SECTOR_SIZE, &header, sizeof(header)) != ESP_OK) return false;
+  return header.magic == RING_SECTOR_MAGIC && header.sequence >= ringFloor && header.sequence <= ringSequence;
+}
+
+uint32_t ringEntryCheck(const RingEntry &entry) {
+  return checksum32(&entry.record, sizeof(entry.record)) ^ entry.session;
+}
+
+bool ringSectorBlank(uint32_t sector) {
+  uint32_t words[16];
+  for (uint32_t offset = 0; offset < RING_SECTOR_SIZE; offset += sizeof(words)) {
+    esp_partition_read(ringPartition, sector * RING_SECTOR_SIZE + offset, words, sizeof(words));
+    for (int i = 0; i < 16; i++) {
+      if (words[i] != RING_EMPTY) return false;
+    }
+  }
+  return true;
+}
+
+// Start a fresh head sector: erase unless done ahead, then write its header
+static void ringOpenSector(uint32_t sector) {
+  RingSectorHeader old;
+  esp_partition_read(ringPartition, sector * RING_SECTOR_SIZE, &old, sizeof(old));
+  uint32_t eraseCount = old.magic == RING_SECTOR_MAGIC ? old.eraseCount + 1 : 1;
+  if ((int32_t)sector != ringErasedSector) {
+    esp_partition_erase_range(ringPartition, sector * RING_SECTOR_SIZE, RING_SECTOR_SIZE);
+    ringErases++;
+  } else {
+    eraseCount = ringNextEraseCount;  // Carried over when erased ahead
+  }
+  ringErasedSector = -1;
+  ringSequence++;
+  RingSectorHeader header = {RING_SECTOR_MAGIC, ringSequence, eraseCount, ringFloor, ringNextSession, {0, 0, 0}};
+  esp_partition_write(ringPartition, sector * RING_SECTOR_SIZE, &header, sizeof(header));
+  ringPrograms++;
+  ringHeadSector = sector;
+  ringEraseCount = eraseCount;
+  ringWriteOffset = sector * RING_SECTOR_SIZE + sizeof(header);
+}
+
+// Find the head by sector sequence, then the first unprogrammed entry in it.
+// Runs at boot, before SPIFFS is mounted.
+bool ringInit() {
+  ringPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)RING_PARTITION_SUBTYPE,
+                                           RING_PARTITION_LABEL);
+  if (!ringPartition) return false;
+  ringSectors = ringPartition->size / RING_SECTOR_SIZE;
+  RingSectorHeader header;
+  bool found = false;
+  for (uint32_t sector = 0; sector < ringSectors; sector++) {
+    esp_partition_read(ringPartition, sector * RING_SECTOR_SIZE, &header, sizeof(header));
+    if (header.magic != RING_SECTOR_MAGIC || header.sequence == RING_EMPTY) continue;
+    if (!found || header.sequence > ringSequence) {
+      ringSequence = header.sequence;
+      ringHeadSector = sector;
+      ringFloor = header.floor;
+      ringEraseCount = header.eraseCount;
+      ringNextSession = header.nextSession > 1 ? header.nextSession : 1;
+      found = true;
+    }
+  }
+  if (!found) {
+    ringSequence = 0;
+    ringFloor = 1;
+    ringOpenSector(0);
+    return true;
+  }
+  // Session numbers only grow: the head's header and the newest two
+  // sectors' entries (each session opens with one) hold the highest
+  uint32_t base = ringHeadSector * RING_SECTOR_SIZE;
+  ringWriteOffset = base + RING_SECTOR_SIZE;
+  RingEntry entry;
+  for (int pass = 0; pass < 2; pass++) {
+    uint32_t sector = (ringHeadSector + ringSectors - pass) % ringSectors;
+    if (pass == 1 && !ringSectorValid(sector, header)) break;
+    for (uint32_t offset = sizeof(RingSectorHeader); offset < RING_SECTOR_SIZE; offset += sizeof(entry)) {
+      esp_partition_read(ringPartition, sector * RING_SECTOR_SIZE + offset, &entry, sizeof(entry));
+      if (entry.session == RING_EMPTY) {
+        if (pass == 0) ringWriteOffset = base + offset;
+        break;
+      }
+      if (entry.session >= ringNextSession) ringNextSession = entry.session + 1;
+    }
+  }
+  return true;
+}
+
+// Program whatever is buffered; at most the rest of one page
+void ringFlush() {
+  if (ringPageFill == 0) return;
+  traceBegin(TRACE_FLUSH);
+  esp_partition_write(ringPartition, ringWriteOffset, ringPage, ringPageFill);
+  traceEnd(TRACE_FLUSH);
+  ringPrograms++;
+  statAdd(stats.flushCount, 1);
+  ringWriteOffset += ringPageFill;
+  ringPageFill = 0;
+}
+
+bool ringAppend(uint32_t session, const EventRecord &record) {
+  if (!ringPartition) return false;
+  if ((ringWriteOffset + ringPageFill) % RING_SECTOR_SIZE == 0) {
+    ringFlush();
+    ringOpenSector((ringHeadSector + 1) % ringSectors);
+  }
+  RingEntry entry = {session, 0, record, {0, 0}};
+  entry.check = ringEntryCheck(entry);
+  memcpy(ringPage + ringPageFill, &entry, sizeof(entry));
+  ringPageFill += sizeof(entry);
+  statAdd(stats.bytesWritten, sizeof(entry));
+  ringLastAppend = millis();
+  if ((ringWriteOffset + ringPageFill) % RING_PAGE_SIZE == 0) {
+    ringFlush();
+  }
+  return true;
+}
+
+// Claim a session number on flash right away, so a reset before its first
+// record cannot hand the number out again
+void ringOpenSession(uint32_t session) {
+  if (session == 0) return;
+  EventRecord opening = {};
+  ringAppend(session, opening);
+  ringFlush();
+}
+
+// Flush a stale partial page, erase the next sector while capture is quiet,
+// and give a ring session its SPIFFS header file once storage is up
+void ringTick() {
+  if (!ringPartition) return;
+  if (ringPageFill > 0 && (millis() - ringLastAppend) >= RING_FLUSH_MS) {
+    ringFlush();
+  }
+  // Erasing ahead costs the oldest sector early, so only while the ring is in use
+  bool quiet = captureQuiet(RING_ERASE_QUIET_US);
+  uint32_t next = (ringHeadSector + 1) % ringSectors;
+  if (config.ringStore && quiet && ringErasedSector != (int32_t)next) {
+    RingSectorHeader old;
+    esp_partition_read(ringPartition, next * RING_SECTOR_SIZE, &old, sizeof(old));
+    if (ringSectorBlank(next)) {
+      ringNextEraseCount = ringEraseCount;  // Erased before a reset; its count went with the header
+    } else {
+      esp_partition_erase_range(ringPartition, next * RING_SECTOR_SIZE, RING_SECTOR_SIZE);
+      ringErases++;
+      ringNextEraseCount = old.magic == RING_SECTOR_MAGIC ? old.eraseCount + 1 : 1;
+    }
+    ringErasedSector = next;
+  }
+  if (!sessionActive || !storageReady) return;
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    SessionSlot &s = slots[i];
+    if (s.open && s.ringSession != 0 && !s.segmentIdle) {
+      openSessionFile(s, s.fileName);
+    }
+  }
+}
+
+// Logical wipe: raise the floor above every written sector. No erase needed.
+void ringWipe() {
+  if (!ringPartition || ringNextSession == 1) return;  // Never held a session
+  ringFlush();
+  ringFloor = ringSequence + 1;
+  ringOpenSector((ringHeadSector + 1) % ringSectors);
+}
+
+void printRingStatus() {
+  if (!ringPartition) {
+    Serial.println("No '" RING_PARTITION_LABEL "' partition; flash partitions.csv to enable the ring log.");
+    return;
+  }
+  uint32_t minErase = RING_EMPTY, maxErase = 0, live = 0;
+  RingSectorHeader header;
+  for (uint32_t sector = 0; sector < ringSectors; sector++) {
+    esp_partition_read(ringPartition, sector * RING_SECTOR_SIZE, &header, sizeof(header));
+    if (header.magic != RING_SECTOR_MAGIC) continue;
+    if (header.eraseCount < minErase) minErase = header.eraseCount;
+    if (header.eraseCount > maxErase) maxErase = header.eraseCount;
+    if (header.sequence >= ringFloor && header.sequence <= ringSequence) live++;
+  }
+  Serial.printf("Ring log: %s, %u sectors (%u live), head %u seq %u, next session %u\n",
+                config.ringStore ? "active" : "inactive", (unsigned)ringSectors, (unsigned)live,
+                (unsigned)ringHeadSector, (unsigned)ringSequence, (unsigned)ringNextSession);
+  Serial.printf("Wear: erases %u-%u per sector; this boot %u programs, %u erases\n",
+                (unsigned)(minErase == RING_EMPTY ? 0 : minErase), (unsigned)maxErase, (unsigned)ringPrograms,
+                (unsigned)ringErases);
+}
+
+// Position a reader after the header; ring sessions read from the partition
+void openRecordCursor(File &file, const SessionHeader &header, RecordCursor &cursor) {
+  SessionMeta meta;
+  readSessionMeta(file, header, meta);
+  cursor = {&file, header, meta.ringSession, 0, 0, 0, 0, 0};
+  if (cursor.ringSession != 0) ringFlush();
+}
+
+bool nextRecord(RecordCursor &cursor, EventRecord &record) {
+  if (cursor.ringSession == 0) return readRecord(*cursor.file, cursor.header, record);
+  if (!ringPartition) return false;
+  while (cursor.ringVisited < ringSectors) {
+    uint32_t sector = (ringHeadSector + 1 + cursor.ringVisited) % ringSectors;
+    uint32_t base = sector * RING_SECTOR_SIZE;
+    if (cursor.ringOffset == 0) {
+      RingSectorHeader header;
+      if (!ringSectorValid(sector, header)) {
+        cursor.ringVisited++;
+        continue;
+      }
+      cursor.ringOffset = sizeof(RingSectorHeader);
+    }
+    uint32_t limit = sector == ringHeadSector ? ringWriteOffset - base : RING_SECTOR_SIZE;
+    while (cursor.ringOffset + sizeof(RingEntry) <= limit) {
+      if (cursor.ringStepLimit != 0 && cursor.ringSteps >= cursor.ringStepLimit) return false;
+      cursor.ringSteps++;
+      RingEntry entry;
+      esp_partition_read(ringPartition, base + cursor.ringOffset, &entry, sizeof(entry));
+      cursor.ringOffset += sizeof(RingEntry);
+      if (entry.session != cursor.ringSession) continue;
+      if (entry.check == ringEntryCheck(entry)) {
+        if (entry.record.type == 0) continue;  // Session opening entry
+        record = entry.record;
+        return true;
+      }
+      cursor.ringRejected++;
+    }
+    cursor.ringOffset = 0;
+    cursor.ringVisited++;
+  }
+  return false;
+}
+
+void rewindRecordCursor(RecordCursor &cursor) {
+  if (cursor.ringSession == 0) {
+    cursor.file->seek(cursor.header.headerSize);
+  } else {
+    cursor.ringVisited = 0;
+    cursor.ringOffset = 0;
+  }
+}
+
+// =========== Session Storage ===========
+
+String spareFilePath(int index) {
+  return "/.spare" + String(index) + SESSION_EXTENSION;
+}
+
+size_t writeSessionHeader(File &file, const SessionMeta &meta) {
+  SessionHeader header = makeSessionHeader();
+  size_t written = file.write((const uint8_t *)&header, sizeof(header));
+  written += file.write((const uint8_t *)&meta, sizeof(meta));
+  statAdd(stats.bytesWritten, written);
+  return written;
+}
+
+// Create a file holding just the session header
+bool createSessionFile(const String &path, const SessionMeta &meta) {
+  File file = SPIFFS.open(path, FILE_WRITE);
+  if (!file) return false;
+  size_t written = writeSessionHeader(file, meta);
+  file.close();
+  return written == SESSION_HEADER_SIZE;
+}
+
+// Take a spare whose blank header has the current layout and fill in the metadata
+bool claimSpareFile(const String &path, const SessionMeta &meta) {
+  for (int i = 0; i < SPARE_FILE_COUNT; i++) {
+    String spare = spareFilePath(i);
+    File file = SPIFFS.open(spare, FILE_READ);
+    if (!file) continue;
+    bool current = file.size() == SESSION_HEADER_SIZE;
+    file.close();
+    if (!current) {
+      SPIFFS.remove(spare);
+      continue;
+    }
+    if (!SPIFFS.rename(spare, path)) continue;
+    file = SPIFFS.open(path, "r+");
+    if (file) {
+      file.seek(sizeof(SessionHeader));
+      statAdd(stats.bytesWritten, file.write((const uint8_t *)&meta, sizeof(meta)));
+      file.close();
+    }
+    return true;
+  }
+  return false;
+}
+
+// Make `path` the slot's held-open file, claiming a spare if it is new
+bool openSessionFile(SessionSlot &s, const String &path) {
+  if (s.file && s.filePath == path) return true;
+  closeSessionFile(s);
+  if (!SPIFFS.exists(path) && !claimSpareFile(path, s.meta)) {
+    createSessionFile(path, s.meta);
+  }
+  s.file = SPIFFS.open(path, FILE_APPEND);
+  if (!s.file) return false;
+  if (s.file.size() == 0) {
+    writeSessionHeader(s.file, s.meta);
+  }
+  s.filePath = path;
+  return true;
+}
+
+void closeSessionFile(SessionSlot &s) {
+  ringFlush();
+  if (s.file) {
+    s.file.close();
+  }
+  s.filePath = "";
+}
+
+// True when no open session slot has logged a press for quietUs. Background
+// flash work waits for this so it never lands between two presses.
+bool captureQuiet(usec_t quietUs) {
+  if (!sessionActive) return true;
+  usec_t now = clockNowUs();
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (!slots[i].open || slots[i].segmentIdle) continue;
+    if (now - slots[i].lastActivity < quietUs) return false;
+  }
+  return true;
+}
+
+// Top up the spare pool, one file per call, while nobody is pressing keys
+void spareRefillTick() {
+  if (!storageReady) return;
+  if (!captureQuiet(SPARE_REFILL_QUIET_US)) return;
+  if (prepareAfterResume) {
+    prepareAfterResume = false;
+    for (int i = 0; sessionActive && i < MAX_SESSIONS; i++) {
+      if (slots[i].open && slots[i].segmentIdle) prepareNextSegment(slots[i]);
+    }
+    return;
+  }
+  for (int i = 0; i < SPARE_FILE_COUNT; i++) {
+    String spare = spareFilePath(i);
+    if (!SPIFFS.exists(spare)) {
+      SessionMeta blank = {};
+      createSessionFile(spare, blank);
+      return;
+    }
+  }
+}
+
+// Append one record to the held-open file. The flush keeps each record
+// durable, as the old open/write/close per record did.
+bool appendRecord(SessionSlot &s, const String &path, const EventRecord &record) {
+  traceBegin(TRACE_FLUSH);
+  if (!openSessionFile(s, path)) {
+    statAdd(stats.writeFailures, 1);
+    Serial.println("Failed to open file for writing: " + path);
+    traceEnd(TRACE_FLUSH);
+    return false;
+  }
+  size_t written = s.file.write((const uint8_t *)&record, sizeof(record));
+  s.file.flush();
+  statAdd(stats.bytesWritten, written);
+  statAdd(stats.flushCount, 1);
+  traceEnd(TRACE_FLUSH);
+  if (written != sizeof(record)) {
+    statAdd(stats.writeFailures, 1);
+    return false;
+  }
+  return true;
+}
+
+// Write a record to the slot's session file
+void writeRecord(SessionSlot &s, const EventRecord &record) {
+  if (s.fileName == "") {
+    Serial.println("No active session file.");
+    return;
+  }
+  if (discardWrites) return;
+  if (s.ringSession != 0) {
+    ringAppend(s.ringSession, record);
+    return;
+  }
+  // The seal checksum covers only records that reach the file or its queue
+  if (!storageReady) {
+    if (pendingRecordCount >= PENDING_RECORDS_MAX) {
+      statAdd(stats.eventsDropped, 1);
+      return;
+    }
+    pendingRecords[pendingRecordCount].path = s.fileName;
+    pendingRecords[pendingRecordCount].record = record;
+    pendingRecordCount++;
+    statMax(stats.pendingHighWater, pendingRecordCount);
+    s.hash = checksum32(&record, sizeof(record), s.hash);
+    return;
+  }
+  if (appendRecord(s, s.fileName, record)) {
+    s.hash = checksum32(&record, sizeof(record), s.hash);
+  }
+}
+
+// Read and check the header; leaves a non-session file at offset 0
+bool readSessionHeader(File &file, SessionHeader &header) {
+  if (file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) && sessionHeaderValid(header)) {
+    file.seek(header.headerSize);
+    return true;
+  }
+  file.seek(0);
+  return false;
+}
+
+// Metadata of a version 2+ file; zeroed for older ones. Leaves the file at the first record.
+bool readSessionMeta(File &file, const SessionHeader &header, SessionMeta &meta) {
+  memset(&meta, 0, sizeof(meta));
+  bool present = header.headerSize >= SESSION_HEADER_SIZE;
+  if (present) {
+    file.seek(sizeof(SessionHeader));
+    present = file.read((uint8_t *)&meta, sizeof(meta)) == sizeof(meta);
+    if (!present) memset(&meta, 0, sizeof(meta));
+  }
+  file.seek(header.headerSize);
+  return present;
+}
+
+// Read the next record; tolerates record sizes from other format versions
+bool readRecord(File &file, const SessionHeader &header, EventRecord &record) {
+  uint8_t buffer[64];
+  if (header.recordSize > sizeof(buffer)) return false;
+  if (file.read(buffer, header.recordSize) != header.recordSize) return false;
+  decodeRecord(buffer, header.recordSize, record);
+  return true;
+}
+
+// Build the ExtendScript line that places a clip on the given track.
+// timeBase, when given, names a script variable subtracted from the time.
+String formatCommand(const String &buttonName, usec_t clipTime, int trackIndex, const char *timeBase) {
+  usec_t clipMs = (clipTime + 500) / 1000;
+  char seconds[40];
+  snprintf(seconds, sizeof(seconds), "%llu.%03u%s%s", (unsigned long long)(clipMs / 1000), (unsigned)(clipMs % 1000),
+           timeBase ? " - " : "", timeBase ? timeBase : "");
+  return "app.project.activeSequence.videoTracks[" + String(trackIndex + 1) +
+         "].insertClip(findClipByName(\"" + buttonName + ".mov\"), " + seconds + ");";
+}
+
+// Sequence time for a session time. Timecode-anchored sessions place clips
+// in sequence time and synced sessions add the absolute UTC time to comment.
+usec_t exportPlacement(const SessionTiming &timing, usec_t timeUs, const char *&timeBase, String &comment) {
+  usec_t placement = correctedClipTime(timing, timeUs);
+  timeBase = nullptr;
+  if (timing.timecode.set) {
+    const TimecodeAnchor &tc = timing.timecode;
+    int64_t tcUs = timecodeFrameUs(tc.frame, tc.rate) + (int64_t)placement -
+                   (int64_t)correctedClipTime(timing, (usec_t)tc.timeUs);
+    placement = tcUs < 0 ? 0 : (usec_t)tcUs;
+    timeBase = "tcBase";
+    comment += " TC " + formatTimecode(timecodeFramesIn((int64_t)placement, tc.rate), tc.rate);
+  }
+  if (timing.synced) {
+    comment += " " + formatUtc(sessionWallUs(timing, (int64_t)timeUs));
+  }
+  return placement;
+}
+
+// Render a stored record as ExtendScript; empty for records with no output
+String formatRecord(const EventRecord &record, const SessionTiming &timing) {
+  if (record.type == REC_PRESS && record.key < keyMapSize) {
+    String buttonName = keyMap[record.key].name;
+    if (record.flags & REC_FLAG_HOLD) {
+      buttonName += "_hold";
+    }
+    const char *timeBase;
+    String comment;
+    usec_t placement = exportPlacement(timing, record.timeUs, timeBase, comment);
+    String line = formatCommand(buttonName, placement, record.track, timeBase);
+    if (comment.length() > 0) {
+      line += " //" + comment;
+    }
+    return line;
+  }
+  if (record.type == REC_MARKER) {
+    const char *timeBase;
+    String comment;
+    usec_t placement = exportPlacement(timing, record.timeUs, timeBase, comment);
+    usec_t placementMs = (placement + 500) / 1000;
+    char seconds[40];
+    snprintf(seconds, sizeof(seconds), "%llu.%03u%s%s", (unsigned long long)(placementMs / 1000),
+             (unsigned)(placementMs % 1000), timeBase ? " - " : "", timeBase ? timeBase : "");
+    String line = "app.project.activeSequence.markers.createMarker(" + String(seconds) + ").name = \"sync " +
+                  String(record.value) + "\";";
+    if (comment.length() > 0) {
+      line += " //" + comment;
+    }
+    return line;
+  }
+  if (record.type == REC_SYNC) {
+    char offset[24];
+    snprintf(offset, sizeof(offset), "%llu.%06u", (unsigned long long)(record.timeUs / 1000000),
+             (unsigned)(record.timeUs % 1000000));
+    return "// sync " + formatUtc((int64_t)record.value * 1000000) + " at " + offset + " s";
+  }
+  if (record.type == REC_GAP) {
+    return "// device reset: up to " + String(record.value) + " ms before " +
+           String((double)record.timeUs / 1000000.0, 3) + " s were not recorded";
+  }
+  return "";
+}
+
+// Log a command with timestamp + track selection
+void logCommand(SessionSlot &s, int keyIndex, PressKind kind, usec_t eventTime) {
+  EventRecord record = pressRecord(s.press, keyIndex, kind, eventTime);
+  s.lastActivity = eventTime;
+  s.segmentEvents++;
+  statAdd(stats.eventsLogged, 1);
+  checkpointSave(s);
+  if (echoCommands) {
+    traceBegin(TRACE_FORMAT);
+    String commandStr = formatRecord(record, currentSessionTiming(s));
+    traceEnd(TRACE_FORMAT);
+    Serial.println(commandStr);
+  }
+  writeRecord(s, record);
+}
+
+// Log a slate/sync marker; it never places a clip or touches track stacking
+void logMarker(SessionSlot &s, usec_t eventTime) {
+  usec_t clipTime = eventTime - s.press.start;
+  s.markerCount++;
+  s.lastActivity = eventTime;
+  s.segmentEvents++;
+  EventRecord record = {clipTime, REC_MARKER, 0, 0, 0, s.markerCount};
+  checkpointSave(s);
+  if (echoCommands) {
+    Serial.println(formatRecord(record, currentSessionTiming(s)));
+  }
+  writeRecord(s, record);
+  if (storageReady && !discardWrites) {
+    markerIndexAppend(s.fileName, s.markerCount, clipTime);
+  } else if (!discardWrites) {
+    markerIndexStale = true;
+  }
+}
+
+// Send a file over Serial, rendering session records to ExtendScript
+void sendFileOverSerial(const char *fileNameParam) {
+  Serial.print("Sending: ");
+  Serial.println(fileNameParam);
+  File file = SPIFFS.open(fileNameParam, FILE_READ);
+  if (!file) {
+    Serial.println("Failed to open file for reading");
+    return;
+  }
+  Serial.println("START_FILE_TRANSFER:" + String(fileNameParam));
+  uint32_t startUs = micros();
+  SessionHeader header;
+  if (readSessionHeader(file, header)) {
+    SessionMeta meta;
+    readSessionMeta(file, header, meta);
+    if (formatMeta(meta).length() > 0) {
+      statAdd(stats.transferBytes, Serial.println("// " + formatMeta(meta)));
+    }
+    RecordCursor cursor;
+    openRecordCursor(file, header, cursor);
+    SessionTiming timing;
+    loadSessionTiming(cursor, timing);
+    if (timing.synced) {
+      statAdd(stats.transferBytes, Serial.println("// session start " + formatUtc(timing.epochAtZeroUs)));
+    }
+    if (timing.timecode.set) {
+      statAdd(stats.transferBytes, Serial.println("// timecode " + formatTimecodeRate(timing.timecode.rate)));
+      statAdd(stats.transferBytes,
+              Serial.println("var tcBase = Number(app.project.activeSequence.zeroPoint) / " PREMIERE_TICKS_PER_SECOND ";"));
+    }
+    EventRecord record;
+    while (nextRecord(cursor, record)) {
+      traceBegin(TRACE_TRANSFER);
+      String line = formatRecord(record, timing);
+      if (line.length() > 0) {
+        statAdd(stats.transferBytes, Serial.println(line));
+      }
+      traceEnd(TRACE_TRANSFER);
+    }
+  } else {
+    uint8_t chunk[256];
+    while (file.available()) {
+      traceBegin(TRACE_TRANSFER);
+      size_t n = file.read(chunk, sizeof(chunk));
+      Serial.write(chunk, n);
+      statAdd(stats.transferBytes, n);
+      traceEnd(TRACE_TRANSFER);
+    }
+  }
+  statAdd(stats.transferUs, micros() - startUs);
+  Serial.println("\nEND_FILE_TRANSFER");
+  file.close();
+}
+
+// =========== Session Catalogue ===========
+// "meta operator=ann scene=12 take=3 remote=a" tags the next session. The
+// metadata goes into the session file header and into the catalogue, which
+// answers "list scene=12" from RAM.
+
+// "operator=ann scene=12 ..." for the fields that are set
+String formatMeta(const SessionMeta &meta) {
+  String text;
+  char buffer[20];
+  struct {
+    const char *key;
+    const char *value;
+    size_t size;
+  } fields[] = {{"operator", meta.operatorName, sizeof(meta.operatorName)},
+                {"scene", meta.scene, sizeof(meta.scene)},
+                {"take", meta.take, sizeof(meta.take)},
+                {"remote", meta.remote, sizeof(meta.remote)}};
+  for (const auto &field : fields) {
+    if (field.value[0] == '\0') continue;
+    memset(buffer, 0, sizeof(buffer));
+    memcpy(buffer, field.value, field.size);
+    text += String(text.length() ? " " : "") + field.key + "=" + buffer;
+  }
+  if (meta.deviceId != 0) {
+    snprintf(buffer, sizeof(buffer), "%08X", (unsigned)meta.deviceId);
+    text += String(text.length() ? " " : "") + "device=" + buffer;
+  }
+  return text;
+}
+
+// "meta", "meta clear" and "meta key=value ..."
+bool handleMetaCommand(const Command &command) {
+  if (command.id == CMD_META) {
+    Serial.println("Next session: " + formatMeta(currentMeta));
+    return true;
+  }
+  if (command.id == CMD_META_CLEAR) {
+    uint32_t deviceId = currentMeta.deviceId;
+    memset(&currentMeta, 0, sizeof(currentMeta));
+    currentMeta.deviceId = deviceId;
+    Serial.println("Session metadata cleared.");
+    return true;
+  }
+  if (command.id != CMD_META_SET) return false;
+  if (!command.valid) {
+    Serial.println("Usage: meta operator=<name> scene=<s> take=<t> remote=<r>");
+    return true;
+  }
+  currentMeta = command.meta;
+  Serial.println("Next session: " + formatMeta(currentMeta));
+  return true;
+}
+
+// Parse a line against the current listing, timecode rate and metadata
+void parseSerialCommand(const String &line, Command &command) {
+  CommandContext context = {fileCount, timecodeAnchor.rate, currentMeta};
+  parseCommand(line.c_str(), line.length(), context, command);
+}
+
+// Commands accepted from every serial prompt, including during a session
+bool runSharedCommand(const Command &command) {
+  if (!commandIsShared(command.id)) return false;
+  if (command.id == CMD_SESSIONS) {
+    printSlots();
+    return true;
+  }
+  return handleClockCommand(command) || handleMetaCommand(command);
+}
+
+bool handleSharedCommand(const String &input) {
+  Command command;
+  parseSerialCommand(input, command);
+  return runSharedCommand(command);
+}
+
+int catalogueFind(const String &path) {
+  for (int i = 0; i < catalogueCount; i++) {
+    if (path == catalogue[i].path) return i;
+  }
+  return -1;
+}
+
+// A reused name moves to the end, where the newest sessions are. While
+// capturing no file is erased to make room: tombstones wait for
+// garbageCollectTick() and the oldest session is left out instead.
+bool catalogueAdd(const String &path, const SessionMeta &meta, bool capturing) {
+  catalogueRemove(path);
+  if (catalogueCount >= CATALOGUE_MAX) {
+    int evict = catalogueEvictCandidate(!capturing);
+    if (evict < 0) {
+      Serial.println("Catalogue full of deleted sessions still erasing: " + path +
+                     " left out of 'list key=', scrub and df.");
+      return false;
+    }
+    catalogueEvict(evict, true);
+  }
+  int index = catalogueCount++;
+  memset(&catalogue[index], 0, sizeof(ManifestEntry));
+  strncpy(catalogue[index].path, path.c_str(), MAX_PATH_LENGTH);
+  catalogue[index].meta = meta;
+  catalogueDirty = true;
+  return true;
+}
+
+// Keeps the order: the catalogue runs oldest to newest
+void catalogueRemove(const String &path) {
+  int index = catalogueFind(path);
+  if (index < 0) return;
+  catalogueCount--;
+  memmove(&catalogue[index], &catalogue[index + 1], (catalogueCount - index) * sizeof(ManifestEntry));
+  catalogueDirty = true;
+}
+
+// Entry to give up when the catalogue is full: a tombstone if its file may be
+// erased now, else the oldest session; -1 when only tombstones are left and
+// none may be erased
+int catalogueEvictCandidate(bool eraseNow) {
+  for (int i = 0; eraseNow && storageReady && i < catalogueCount; i++) {
+    if (catalogue[i].flags & MANIFEST_DELETED) return i;
+  }
+  for (int i = 0; i < catalogueCount; i++) {
+    if (!(catalogue[i].flags & MANIFEST_DELETED)) return i;
+  }
+  return eraseNow ? 0 : -1;
+}
+
+// An evicted session stays on flash but drops out of 'list key=', scrub and
+// 'df'; true when that happened
+bool catalogueEvict(int index, bool warn) {
+  String path = catalogue[index].path;
+  bool live = !(catalogue[index].flags & MANIFEST_DELETED);
+  if (!live) {
+    SPIFFS.remove(path);
+  } else if (warn) {
+    Serial.println("Catalogue full (" + String(CATALOGUE_MAX) + " sessions): " + path +
+                   " left out of 'list key=', scrub and df. Delete old sessions to make room.");
+  }
+  catalogueRemove(path);
+  return live;
+}
+
+void catalogueRename(const String &oldPath, const String &newPath) {
+  int index = catalogueFind(oldPath);
+  if (index < 0) return;
+  memset(catalogue[index].path, 0, sizeof(catalogue[index].path));
+  strncpy(catalogue[index].path, newPath.c_str(), MAX_PATH_LENGTH);
+  catalogueDirty = true;
+}
+
+// Read every session header; used when the manifest is missing
+void catalogueRebuild() {
+  File root = SPIFFS.open("/");
+  File file = root.openNextFile();
+  while (file) {
+    String path = file.path();
+    SessionHeader header;
+    SessionMeta meta;
+    if (!isHiddenFile(path) && readSessionHeader(file, header) && catalogueFind(path) < 0) {
+      readSessionMeta(file, header, meta);
+      catalogueAdd(path, meta, false);
+    }
+    file = root.openNextFile();
+  }
+  catalogueDirty = true;
+}
+
+// Merge the manifest in front of entries added since boot, which are newer
+void catalogueLoad() {
+  catalogueLoaded = true;
+  File manifest = SPIFFS.open(MANIFEST_FILE, FILE_READ);
+  if (!manifest) {
+    catalogueRebuild();
+    return;
+  }
+  ManifestEntry entry;
+  int insertAt = 0;
+  int dropped = 0;
+  while (manifest.read((uint8_t *)&entry, sizeof(entry)) == sizeof(entry)) {
+    entry.path[MAX_PATH_LENGTH] = '\0';
+    if (catalogueFind(entry.path) >= 0) continue;
+    if (catalogueCount >= CATALOGUE_MAX) {
+      // Keep the newest: drop this entry if every live one held is newer
+      int index = catalogueEvictCandidate(true);
+      bool live = !(catalogue[index].flags & MANIFEST_DELETED);
+      if (live && index >= insertAt) {
+        dropped++;
+        continue;
+      }
+      if (catalogueEvict(index, false)) dropped++;
+      if (index < insertAt) insertAt--;
+    }
+    memmove(&catalogue[insertAt + 1], &catalogue[insertAt], (catalogueCount - insertAt) * sizeof(ManifestEntry));
+    catalogue[insertAt++] = entry;
+    catalogueCount++;
+  }
+  manifest.close();
+  if (dropped > 0) {
+    Serial.printf("Catalogue full: %d older sessions left out of 'list key=', scrub and df.\n", dropped);
+    catalogueDirty = true;
+  }
+}
+
+void catalogueSave() {
+  File manifest = SPIFFS.open(MANIFEST_FILE, FILE_WRITE);
+  if (!manifest) return;
+  manifest.write((const uint8_t *)catalogue, catalogueCount * sizeof(ManifestEntry));
+  manifest.close();
+  catalogueDirty = false;
+}
+
+// Load once storage is up; write back changes while nobody is pressing keys
+void catalogueTick() {
+  if (!storageReady) return;
+  if (!catalogueLoaded) catalogueLoad();
+  if (!catalogueDirty) return;
+  if (!captureQuiet(MANIFEST_SAVE_QUIET_US)) return;
+  catalogueSave();
+}
+
+// "list scene=12": number the matches so send/delete/rename work on them
+void listCatalogue(const SessionMeta &filter, int fields) {
+  fileCount = 0;
+  for (int i = 0; i < catalogueCount && fileCount < 50; i++) {
+    if ((catalogue[i].flags & MANIFEST_DELETED) || !metaMatches(catalogue[i].meta, filter, fields)) continue;
+    fileList[fileCount] = catalogue[i].path;
+    Serial.printf("[%d] %s  %s\n", fileCount + 1, catalogue[i].path, formatMeta(catalogue[i].meta).c_str());
+    fileCount++;
+  }
+  if (fileCount == 0) {
+    Serial.println("No matching sessions.");
+  }
+}
+
+// =========== Deferred Delete ===========
+// Deleting only writes a tombstone into the catalogue and saves the
+// manifest; the file disappears from listings at once and
+// garbageCollectTick() erases it while idle.
+
+bool isDeletedFile(const String &path) {
+  int index = catalogueFind(path);
+  return index >= 0 && (catalogue[index].flags & MANIFEST_DELETED);
+}
+
+// False when the catalogue has no room; the caller removes the file directly
+bool tombstoneFile(const String &path) {
+  if (!catalogueLoaded) catalogueLoad();
+  int index = catalogueFind(path);
+  if (index < 0) {
+    SessionMeta blank = {};
+    catalogueAdd(path, blank, false);
+    index = catalogueFind(path);
+    if (index < 0) return false;
+  }
+  catalogue[index].flags |= MANIFEST_DELETED;
+  catalogueDirty = true;
+  return true;
+}
+
+// Erase one tombstoned file per GC_INTERVAL_MS while capture is quiet
+void garbageCollectTick() {
+  if (!storageReady || !catalogueLoaded || (millis() - lastGcTime) < GC_INTERVAL_MS) return;
+  if (!captureQuiet(GC_QUIET_US)) return;
+  lastGcTime = millis();
+  for (int i = 0; i < catalogueCount; i++) {
+    if (!(catalogue[i].flags & MANIFEST_DELETED)) continue;
+    String path = catalogue[i].path;
+    if (!SPIFFS.exists(path) || SPIFFS.remove(path)) {
+      catalogueRemove(path);
+    }
+    return;
+  }
+}
+
+// =========== Integrity Scrub ===========
+// Closed sessions are read back a chunk at a time and compared against the
+// checksum sealed when the segment closed. Files without one (older, or
+// resumed after a reset) only get the record checks. Ring sessions are
+// checked entry by entry instead, since the ring wraps.
+
+bool sessionFileInUse(const String &path) {
+  return sessionActive && slotForFile(path) != nullptr;
+}
+
+bool scrubRecordValid(const EventRecord &record) {
+  if (record.type < REC_PRESS || record.type > REC_GAP) return false;
+  return record.type != REC_PRESS || record.key < keyMapSize;
+}
+
+void scrubFinish() {
+  ManifestEntry &entry = catalogue[scrubIndex];
+  uint32_t flags = entry.flags & ~MANIFEST_CORRUPT;
+  if (scrubCursor.ringSession == 0 && (flags & MANIFEST_SEALED) && entry.checksum != scrubHash) {
+    scrubErrors++;
+  }
+  if (scrubErrors > 0) {
+    if (!(entry.flags & MANIFEST_CORRUPT)) {
+      Serial.printf("Scrub: %s is damaged (%u errors)\n", entry.path, (unsigned)scrubErrors);
+    }
+    flags |= MANIFEST_CORRUPT;
+  }
+  flags |= MANIFEST_VERIFIED;
+  if (flags != entry.flags) {
+    entry.flags = flags;
+    catalogueDirty = true;
+  }
+  if (scrubOpen) scrubFile.close();
+  scrubOpen = false;
+  scrubIndex++;
+}
+
+// One file open or one chunk of records per SCRUB_INTERVAL_MS, while quiet
+void scrubTick() {
+  if (!storageReady || !catalogueLoaded || (millis() - lastScrubTime) < SCRUB_INTERVAL_MS) return;
+  if (!captureQuiet(SCRUB_QUIET_US)) return;
+  lastScrubTime = millis();
+  if (scrubIndex < 0) {
+    if (scrubPasses > 0 && millis() - scrubPassEnd < SCRUB_PASS_INTERVAL_MS) return;
+    scrubIndex = 0;
+  }
+  // Renamed or deleted under us: verify whatever now sits at this index
+  if (scrubOpen && (scrubIndex >= catalogueCount || scrubPath != catalogue[scrubIndex].path ||
+                    (catalogue[scrubIndex].flags & MANIFEST_DELETED))) {
+    scrubFile.close();
+    scrubOpen = false;
+  }
+  if (!scrubOpen) {
+    while (scrubIndex < catalogueCount &&
+           ((catalogue[scrubIndex].flags & MANIFEST_DELETED) || sessionFileInUse(catalogue[scrubIndex].path))) {
+      scrubIndex++;
+    }
+    if (scrubIndex >= catalogueCount) {
+      scrubIndex = -1;
+      scrubPasses++;
+      scrubPassEnd = millis();
+      return;
+    }
+    scrubPath = catalogue[scrubIndex].path;
+    scrubCursor = {};
+    scrubErrors = 0;
+    scrubHash = checksum32(nullptr, 0);
+    SessionHeader header;
+    scrubFile = SPIFFS.open(scrubPath, FILE_READ);
+    if (!scrubFile || !readSessionHeader(scrubFile, header)) {
+      if (scrubFile) scrubFile.close();
+      scrubErrors++;
+      scrubFinish();
+      return;
+    }
+    scrubOpen = true;
+    openRecordCursor(scrubFile, header, scrubCursor);
+    if (scrubCursor.ringSession == 0 && (scrubFile.size() - header.headerSize) % header.recordSize != 0) {
+      scrubErrors++;  // Torn final record
+    }
+    return;
+  }
+  traceBegin(TRACE_SCRUB);
+  EventRecord record;
+  bool more = true;
+  if (scrubCursor.ringSession != 0) {
+    scrubCursor.ringSteps = 0;
+    scrubCursor.ringStepLimit = SCRUB_CHUNK_BYTES / sizeof(RingEntry);
+    while ((more = nextRecord(scrubCursor, record))) {
+      if (!scrubRecordValid(record)) scrubErrors++;
+    }
+    more = scrubCursor.ringVisited < ringSectors;
+  } else {
+    for (uint32_t n = SCRUB_CHUNK_BYTES / scrubCursor.header.recordSize; n > 0 && more; n--) {
+      more = nextRecord(scrubCursor, record);
+      if (!more) break;
+      if (!scrubRecordValid(record)) scrubErrors++;
+      scrubHash = checksum32(&record, sizeof(record), scrubHash);
+    }
+  }
+  traceEnd(TRACE_SCRUB);
+  if (!more) {
+    scrubErrors += scrubCursor.ringRejected;
+    scrubFinish();
+  }
+}
+
+void printScrubStatus() {
+  int verified = 0, unsealed = 0, corrupt = 0, pending = 0;
+  for (int i = 0; i < catalogueCount; i++) {
+    if (catalogue[i].flags & MANIFEST_DELETED) continue;
+    if (catalogue[i].flags & MANIFEST_CORRUPT) {
+      corrupt++;
+    } else if (catalogue[i].flags & MANIFEST_VERIFIED) {
+      verified++;
+      if (!(catalogue[i].flags & MANIFEST_SEALED) && catalogue[i].meta.ringSession == 0) unsealed++;
+    } else {
+      pending++;
+    }
+  }
+  if (scrubIndex >= 0) {
+    Serial.printf("Scrub: pass %u running, entry %d of %d\n", (unsigned)(scrubPasses + 1), scrubIndex + 1,
+                  catalogueCount);
+  } else if (scrubPasses > 0) {
+    Serial.printf("Scrub: %u passes, last finished %lus ago\n", (unsigned)scrubPasses,
+                  (millis() - scrubPassEnd) / 1000);
+  } else {
+    Serial.println("Scrub: waiting for the first pass");
+  }
+  Serial.printf("Sessions: %d verified (%d without a write checksum), %d damaged, %d not yet checked\n", verified,
+                unsealed, corrupt, pending);
+  for (int i = 0; i < catalogueCount; i++) {
+    if ((catalogue[i].flags & MANIFEST_CORRUPT) && !(catalogue[i].flags & MANIFEST_DELETED)) {
+      Serial.printf("  damaged: %s\n", catalogue[i].path);
+    }
+  }
+}
+
+// =========== Storage Forecast ===========
+
+// Size, record count and length of a SPIFFS-backed session; false for ring sessions
+bool sessionUsage(const String &path, uint32_t &bytes, uint32_t &records, usec_t &durationUs) {
+  File file = SPIFFS.open(path, FILE_READ);
+  if (!file) return false;
+  SessionHeader header;
+  SessionMeta meta;
+  bool ok = readSessionHeader(file, header) && !(readSessionMeta(file, header, meta) && meta.ringSession != 0);
+  if (ok) {
+    bytes = file.size();
+    records = bytes > header.headerSize ? (bytes - header.headerSize) / header.recordSize : 0;
+    durationUs = 0;
+    EventRecord last;
+    if (records > 0 && file.seek(header.headerSize + (records - 1) * header.recordSize) &&
+        readRecord(file, header, last)) {
+      durationUs = last.timeUs;
+    }
+  }
+  file.close();
+  return ok;
+}
+
+void printStorageForecast() {
+  if (!storageReady) {
+    Serial.println("Storage not ready.");
+    return;
+  }
+  size_t total = SPIFFS.totalBytes();
+  size_t used = SPIFFS.usedBytes();
+  size_t available = total > used ? total - used : 0;
+  Serial.printf("SPIFFS: %u of %u bytes used (%u%%), %u free\n", (unsigned)used, (unsigned)total,
+                total ? (unsigned)(100ULL * used / total) : 0, (unsigned)available);
+  // Newest sessions are at the end of the catalogue
+  uint32_t sessions = 0, bytes = 0, records = 0;
+  usec_t durationUs = 0;
+  for (int i = catalogueCount - 1; i >= 0 && sessions < DF_RECENT_SESSIONS; i--) {
+    if ((catalogue[i].flags & MANIFEST_DELETED) || sessionFileInUse(catalogue[i].path)) continue;
+    uint32_t fileBytes, fileRecords;
+    usec_t fileUs;
+    if (!sessionUsage(catalogue[i].path, fileBytes, fileRecords, fileUs) || fileUs < 1000000) continue;
+    sessions++;
+    bytes += fileBytes;
+    records += fileRecords;
+    durationUs += fileUs;
+  }
+  if (sessions == 0 || records == 0) {
+    Serial.println("No recent sessions to forecast from.");
+  } else {
+    float hours = durationUs / 3600e6f;
+    float bytesPerHour = bytes / hours;
+    Serial.printf("Recent: %u sessions, %u events over %.2f h; %.1f bytes/event, %.0f bytes/h\n",
+                  (unsigned)sessions, (unsigned)records, hours, (float)bytes / records, bytesPerHour);
+    Serial.printf("Forecast: about %.1f h of recording left\n", available / bytesPerHour);
+  }
+  if (config.ringStore && ringPartition) {
+    uint32_t perSector = (RING_SECTOR_SIZE - sizeof(RingSectorHeader)) / sizeof(RingEntry);
+    Serial.printf("Ring log: keeps the last %u events; session files take only their header\n",
+                  (unsigned)((ringSectors - 1) * perSector));
+  }
+  if (config.lowSpacePct > 0) {
+    Serial.printf("Low-space warning below %u%% free\n", (unsigned)config.lowSpacePct);
+  } else {
+    Serial.println("Low-space warning off");
+  }
+}
+
+// Warn once per crossing of the threshold. Serial only: any volume key
+// on the paired phone is the camera shutter and would cut the take.
+void storageWarningTick() {
+  if (!storageReady || config.lowSpacePct == 0 || (millis() - lastDfCheck) < DF_CHECK_MS) return;
+  lastDfCheck = millis();
+  size_t total = SPIFFS.totalBytes();
+  size_t used = SPIFFS.usedBytes();
+  if (total == 0) return;
+  unsigned freePct = used < total ? (unsigned)(100ULL * (total - used) / total) : 0;
+  if (!lowSpaceWarned && freePct < config.lowSpacePct) {
+    lowSpaceWarned = true;
+    Serial.printf("Warning: storage low, %u%% free (%u bytes). Type 'df' for a forecast.\n", freePct,
+                  (unsigned)(total - used));
+  } else if (lowSpaceWarned && freePct >= (unsigned)(config.lowSpacePct + DF_HYSTERESIS_PCT)) {
+    lowSpaceWarned = false;
+  }
+}
+
+// =========== Event Query ===========
+// "query 3 count key=ok_hold from=2:00 to=4:00" runs over the binary records
+// on the device; only the blocks the time range needs are read.
+
+bool parseQuery(String text, QueryOp &op, QueryFilter &filter) {
+  return parseQuery(text.c_str(), text.length(), op, filter);
+}
+
+// One line per record: "<seconds> <type> <detail>"
+void printQueryRecord(const EventRecord &record) {
+  usec_t ms = (record.timeUs + 500) / 1000;
+  const char *type = record.type >= REC_PRESS && record.type <= REC_GAP ? recordTypeNames[record.type] : "?";
+  Serial.printf("%llu.%03u %s", (unsigned long long)(ms / 1000), (unsigned)(ms % 1000), type);
+  if (record.type == REC_PRESS && record.key < keyMapSize) {
+    Serial.printf(" %s%s t%u", keyMap[record.key].name, (record.flags & REC_FLAG_HOLD) ? "_hold" : "",
+                  (unsigned)record.track + 1);
+  } else if (record.type == REC_DRIFT) {
+    Serial.printf(" %d", (int)(int32_t)record.value);
+  } else {
+    Serial.printf(" %u", (unsigned)record.value);
+  }
+  Serial.println();
+}
+
+// Bring the index up to date with one record read per new block; returns the record count
+uint32_t queryIndexUpdate(File &file, const SessionHeader &header, const String &path) {
+  uint32_t records = file.size() > header.headerSize ? (file.size() - header.headerSize) / header.recordSize : 0;
+  EventRecord record;
+  // Another file under the same name: its last indexed block will not match
+  if (queryIndex.path != path || queryIndex.blocks * QUERY_BLOCK_RECORDS > records + QUERY_BLOCK_RECORDS ||
+      (queryIndex.blocks > 0 &&
+       (!file.seek(header.headerSize + (queryIndex.blocks - 1) * QUERY_BLOCK_RECORDS * header.recordSize) ||
+        !readRecord(file, header, record) || record.timeUs != queryIndex.blockStart[queryIndex.blocks - 1]))) {
+    queryIndex.path = path;
+    queryIndex.blocks = 0;
+  }
+  while (queryIndex.blocks < QUERY_INDEX_MAX && queryIndex.blocks * QUERY_BLOCK_RECORDS < records) {
+    file.seek(header.headerSize + queryIndex.blocks * QUERY_BLOCK_RECORDS * header.recordSize);
+    if (!readRecord(file, header, record)) break;
+    queryIndex.blockStart[queryIndex.blocks++] = record.timeUs;
+  }
+  return records;
+}
+
+void runQuery(const String &path, QueryOp op, const QueryFilter &filter) {
+  File file = SPIFFS.open(path, FILE_READ);
+  SessionHeader header;
+  if (!file || !readSessionHeader(file, header)) {
+    Serial.println("Not a session file: " + path);
+    if (file) file.close();
+    return;
+  }
+  RecordCursor cursor;
+  openRecordCursor(file, header, cursor);
+  uint32_t first = 0, end = UINT32_MAX, records = 0;
+  if (cursor.ringSession == 0) {
+    // Ring sessions have no random access and are scanned whole
+    records = queryIndexUpdate(file, header, path);
+    uint32_t startBlock, endBlock;
+    queryBlockRange(queryIndex.blockStart, queryIndex.blocks, filter, startBlock, endBlock);
+    first = startBlock * QUERY_BLOCK_RECORDS;
+    end = endBlock < queryIndex.blocks ? endBlock * QUERY_BLOCK_RECORDS : records;
+    file.seek(header.headerSize + first * header.recordSize);
+  }
+  uint32_t matches = 0, read = 0;
+  EventRecord record, found;
+  for (uint32_t i = first; i < end && nextRecord(cursor, record); i++) {
+    read++;
+    if (!queryMatches(record, filter)) continue;
+    matches++;
+    found = record;
+    if (op == QUERY_LIST) printQueryRecord(record);
+    if (op == QUERY_FIRST) break;
+  }
+  file.close();
+  if ((op == QUERY_FIRST || op == QUERY_LAST) && matches > 0) printQueryRecord(found);
+  if (op == QUERY_COUNT) Serial.printf("count %u\n", (unsigned)matches);
+  if (cursor.ringSession == 0) {
+    Serial.printf("%u matches, %u of %u records read\n", (unsigned)matches, (unsigned)read, (unsigned)records);
+  } else {
+    Serial.printf("%u matches, %u records read from the ring log\n", (unsigned)matches, (unsigned)read);
+  }
+}
+
+// =========== Sync Markers ===========
+// "markerkey <key>" reserves one IR key as a slate. Sessions are aligned by
+// matching marker numbers through the index file instead of by hand.
+
+bool isHiddenFile(const String &path) {
+  return path.startsWith("/.");
+}
+
+void markerIndexAppend(const String &path, uint32_t number, usec_t timeUs) {
+  File index = SPIFFS.open(MARKER_INDEX_FILE, FILE_APPEND);
+  if (!index) {
+    markerIndexStale = true;
+    return;
+  }
+  MarkerEntry entry = {};
+  strncpy(entry.path, path.c_str(), MAX_PATH_LENGTH);
+  entry.number = number;
+  entry.timeUs = timeUs;
+  index.write((const uint8_t *)&entry, sizeof(entry));
+  index.close();
+}
+
+// Recreate the index from the marker records in every session file
+void markerIndexRebuild() {
+  SPIFFS.remove(MARKER_INDEX_FILE);
+  File root = SPIFFS.open("/");
+  File file = root.openNextFile();
+  while (file) {
+    String path = file.path();
+    SessionHeader header;
+    if (!isHiddenFile(path) && !isDeletedFile(path) && readSessionHeader(file, header)) {
+      RecordCursor cursor;
+      openRecordCursor(file, header, cursor);
+      EventRecord record;
+      while (nextRecord(cursor, record)) {
+        if (record.type == REC_MARKER) {
+          markerIndexAppend(path, record.value, record.timeUs);
+        }
+      }
+    }
+    file = root.openNextFile();
+  }
+  markerIndexStale = false;
+}
+
+// Point index entries at a renamed session
+void markerIndexRename(const String &oldPath, const String &newPath) {
+  File index = SPIFFS.open(MARKER_INDEX_FILE, "r+");
+  if (!index) return;
+  MarkerEntry entry;
+  size_t offset = 0;
+  while (index.read((uint8_t *)&entry, sizeof(entry)) == sizeof(entry)) {
+    if (oldPath == entry.path) {
+      memset(entry.path, 0, sizeof(entry.path));
+      strncpy(entry.path, newPath.c_str(), MAX_PATH_LENGTH);
+      index.seek(offset);
+      index.write((const uint8_t *)&entry, sizeof(entry));
+    }
+    offset += sizeof(entry);
+    index.seek(offset);
+  }
+  index.close();
+}
+
+void printMarkerIndex() {
+  if (markerIndexStale) markerIndexRebuild();
+  File index = SPIFFS.open(MARKER_INDEX_FILE, FILE_READ);
+  int count = 0;
+  MarkerEntry entry;
+  while (index && index.read((uint8_t *)&entry, sizeof(entry)) == sizeof(entry)) {
+    Serial.printf("%s marker %u at %llu.%06u s\n", entry.path, (unsigned)entry.number,
+                  (unsigned long long)(entry.timeUs / 1000000), (unsigned)(entry.timeUs % 1000000));
+    count++;
+  }
+  if (index) index.close();
+  if (count == 0) {
+    Serial.println("No sync markers recorded.");
+  }
+}
+
+// Offset to add to each session's times so marker `number` lines up with
+// the first session that has it. Deleted sessions are skipped.
+void alignSessions(uint32_t number) {
+  if (markerIndexStale) markerIndexRebuild();
+  File index = SPIFFS.open(MARKER_INDEX_FILE, FILE_READ);
+  Serial.println("START_ALIGN:" + String(number));
+  bool haveReference = false;
+  usec_t referenceUs = 0;
+  MarkerEntry entry;
+  while (index && index.read((uint8_t *)&entry, sizeof(entry)) == sizeof(entry)) {
+    if (entry.number != number || isDeletedFile(entry.path) || !SPIFFS.exists(entry.path)) continue;
+    if (!haveReference) {
+      referenceUs = entry.timeUs;
+      haveReference = true;
+    }
+    int64_t offsetUs = (int64_t)referenceUs - (int64_t)entry.timeUs;
+    Serial.printf("ALIGN %s %s%lld.%06u\n", entry.path, offsetUs < 0 ? "-" : "",
+                  (long long)(llabs(offsetUs) / 1000000), (unsigned)(llabs(offsetUs) % 1000000));
+  }
+  if (index) index.close();
+  Serial.println("END_ALIGN");
+}
+
+// List all stored files
+void listStoredFiles() {
+  File root = SPIFFS.open("/");
+  File file = root.openNextFile();
+  fileCount = 0;
+  while (file && fileCount < 50) {
+    if (isHiddenFile(file.path()) || isDeletedFile(file.path())) {
+      file = root.openNextFile();
+      continue;
+    }
+    fileList[fileCount] = file.path();
+    int entry = catalogueFind(fileList[fileCount]);
+    if (entry >= 0 && formatMeta(catalogue[entry].meta).length() > 0) {
+      Serial.printf("[%d] %s  %s\n", fileCount + 1, file.path(), formatMeta(catalogue[entry].meta).c_str());
+    } else {
+      Serial.printf("[%d] %s\n", fileCount + 1, file.path());
+    }
+    file = root.openNextFile();
+    fileCount++;
+  }
+  if (fileCount == 0) {
+    Serial.println("No files found.");
+  }
+}
+
+// Delete all session files; only tombstones and the manifest are written here
+void deleteAllFiles() {
+  File root = SPIFFS.open("/");
+  File file = root.openNextFile();
+  int queued = 0;
+  while (file) {
+    String path = file.path();
+    file = root.openNextFile();
+    if (isHiddenFile(path) || isDeletedFile(path)) continue;
+    if (tombstoneFile(path)) {
+      queued++;
+    } else {
+      SPIFFS.remove(path);
+    }
+  }
+  ringWipe();
+  markerIndexStale = true;
+  fileCount = 0;
+  // The tombstones must survive a reset, or the files come back
+  if (catalogueDirty) catalogueSave();
+  Serial.printf("All files deleted (%d erasing in the background).\n", queued);
+}
+
+// Rename a listed file; the new name gets the session extension like a typed name
+bool renameStoredFile(int fileIndex, String newName) {
+  String path;
+  if (!buildSessionFileName(newName, path)) {
+    Serial.println("Invalid name.");
+    return false;
+  }
+  String oldPath = fileList[fileIndex - 1];
+  if (sessionFileInUse(oldPath)) {
+    Serial.println("Cannot rename an active session.");
+    return false;
+  }
+  if (isDeletedFile(path) && SPIFFS.remove(path)) {
+    catalogueRemove(path);
+  }
+  if (SPIFFS.exists(path) || !SPIFFS.rename(oldPath, path)) {
+    Serial.println("Failed to rename " + oldPath + " to " + path);
+    return false;
+  }
+  markerIndexRename(oldPath, path);
+  catalogueRename(oldPath, path);
+  Serial.println("Renamed " + oldPath + " to " + path);
+  fileList[fileIndex - 1] = path;
+  return true;
+}
+
+// Send all files over Serial
+void sendAllFilesOverSerial() {
+  if (fileCount == 0) {
+    Serial.println("No files to send.");
+    return;
+  }
+  Serial.println("START_ALL_FILE_TRANSFER");
+  for (int i = 0; i < fileCount; i++) {
+    sendFileOverSerial(fileList[i].c_str());
+  }
+  Serial.println("END_ALL_FILE_TRANSFER");
+}
+
+// Handle IR remote commands (except ending the session)
+void handleButtonPress(SessionSlot &s, const IrEvent &event) {
+  if (event.command == config.markerKey) {
+    #ifdef IRDATA_FLAGS_IS_REPEAT
+      if (event.flags & IRDATA_FLAGS_IS_REPEAT) {
+        statAdd(stats.repeatsSuppressed, 1);
+        return;
+      }
+    #endif
+    logMarker(s, event.timeUs);
+    return;
+  }
+  bool isRepeat = false;
+  #ifdef IRDATA_FLAGS_IS_REPEAT
+    isRepeat = (event.flags & IRDATA_FLAGS_IS_REPEAT);
+  #else
+    const usec_t holdThreshold = 700000;
+    isRepeat = (keyIndexForCode(event.command) == s.press.lastKey &&
+                (event.timeUs - s.press.lastButton) < holdThreshold);
+  #endif
+  int keyIndex;
+  PressKind kind = capturePress(s.press, event.command, isRepeat, keyIndex);
+  if (keyIndex < 0) {
+    statAdd(stats.unmappedCodes, 1);
+    return;
+  }
+  if (kind == PRESS_SUPPRESS) {
+    statAdd(stats.repeatsSuppressed, 1);
+    return;
+  }
+  logCommand(s, keyIndex, kind, event.timeUs);
+}
+
+// Read one line from Serial within a fixed deadline. Lines longer than
+// SERIAL_LINE_MAX are drained and rejected rather than truncated.
+String readSerialLine() {
+  String line;
+  line.reserve(SERIAL_LINE_MAX);
+  bool overflow = false;
+  unsigned long start = millis();
+  while ((millis() - start) < SERIAL_LINE_TIMEOUT_MS) {
+    int c = Serial.read();
+    if (c < 0) {
+      delay(1);
+      continue;
+    }
+    if (c == '\n') break;
+    if (line.length() < SERIAL_LINE_MAX) {
+      line += (char)c;
+    } else {
+      overflow = true;
+    }
+  }
+  if (overflow) {
+    Serial.println("Input line too long, ignored.");
+    return "";
+  }
+  return line;
+}
+
+bool parseNumber(const String &text, int minValue, int maxValue, int &value) {
+  return parseNumber(text.c_str(), text.length(), minValue, maxValue, value);
+}
+
+// Turn a typed session name into "/<name>.bin"
+bool buildSessionFileName(String input, String &path) {
+  char buffer[MAX_PATH_LENGTH + 1];
+  if (!buildSessionFileName(input.c_str(), input.length(), buffer, sizeof(buffer))) return false;
+  path = buffer;
+  return true;
+}
+
+// Handle serial commands in File Management mode. parseCommand() in
+// lib/SessionCore has already checked the arguments; this only acts.
+void handleSerialCommand(String line) {
+  Command command;
+  parseSerialCommand(line, command);
+  if (command.id == CMD_MENU) {
+    enterMenu();
+    return;
+  }
+  if (runSharedCommand(command)) {
+    return;
+  }
+  switch (command.id) {
+    case CMD_SETBASE:
+      if (command.valid) {
+        configSetLogBase(String(command.text).substring(0, command.textLength));
+        Serial.println("Log file base changed to: " + config.logBase);
+      } else {
+        Serial.println("Invalid base name.");
+      }
+      break;
+    case CMD_STARTKEY:
+    case CMD_MARKERKEY:
+    case CMD_SELECTKEY: {
+      if (!command.valid) {
+        Serial.println("Unknown key. Use a button name, a command number or 'off'.");
+        break;
+      }
+      uint16_t code = (uint16_t)command.number;
+      const char *what = command.id == CMD_STARTKEY    ? "Session start key"
+                         : command.id == CMD_MARKERKEY ? "Sync marker key"
+                                                       : "Session select key";
+      if (command.id == CMD_STARTKEY) configSetStartKey(code);
+      if (command.id == CMD_MARKERKEY) configSetMarkerKey(code);
+      if (command.id == CMD_SELECTKEY) configSetSelectKey(code);
+      Serial.println(String(what) + (code == KEY_NONE ? String(" disabled.") : " set to code " + String(code) + "."));
+      break;
+    }
+    case CMD_IDLESPLIT:
+      if (command.valid) {
+        configSetIdleSplit((uint16_t)command.number);
+        Serial.println(command.number == 0 ? String("Idle split disabled.")
+                                           : "Sessions split after " + String(command.number) + " s without presses.");
+      } else {
+        Serial.println("Usage: idlesplit <10-36000 seconds|off>");
+      }
+      break;
+    case CMD_ROUTE:
+      configSetRouteByRemote(command.enable);
+      Serial.println(config.routeByRemote ? "Each remote records its own session."
+                                          : "All remotes record into the focused session.");
+      break;
+    case CMD_STORE:
+      if (command.enable && !ringPartition) {
+        printRingStatus();
+        break;
+      }
+      configSetRingStore(command.enable);
+      Serial.println(config.ringStore ? "New sessions write records to the ring log."
+                                      : "New sessions write records to SPIFFS files.");
+      break;
+    case CMD_RING:
+      printRingStatus();
+      break;
+    case CMD_DF:
+      printStorageForecast();
+      break;
+    case CMD_DF_WARN:
+      if (command.valid) {
+        configSetLowSpace((uint8_t)command.number);
+        lowSpaceWarned = false;
+        Serial.println(command.number == 0 ? String("Low-space warning disabled.")
+                                           : "Warning when free space drops below " + String(command.number) + "%.");
+      } else {
+        Serial.println("Usage: df warn <1-50 percent|off>");
+      }
+      break;
+    case CMD_SCRUB_STATUS:
+      printScrubStatus();
+      break;
+    case CMD_SCRUB:
+      if (scrubIndex < 0) {
+        scrubPassEnd = millis() - SCRUB_PASS_INTERVAL_MS;
+      }
+      Serial.println("Scrub pass will start when capture is quiet.");
+      break;
+    case CMD_MARKERS:
+      printMarkerIndex();
+      break;
+    case CMD_MARKERS_REBUILD:
+      markerIndexRebuild();
+      Serial.println("Marker index rebuilt.");
+      break;
+    case CMD_ALIGN:
+      if (command.valid) {
+        alignSessions((uint32_t)command.number);
+      } else {
+        Serial.println("Usage: align [marker_number]");
+      }
+      break;
+    case CMD_AUTOSTART:
+      configSetAutoStart(command.enable);
+      Serial.println(config.autoStart ? "Sessions start at boot." : "Boot shows the menu.");
+      break;
+    case CMD_RENAME:
+      if (command.valid) {
+        renameStoredFile(command.number, String(command.text).substring(0, command.textLength));
+      } else {
+        Serial.println("Usage: rename <num> <new_name>");
+      }
+      break;
+    case CMD_SAVE:
+      configCommit();
+      Serial.println("Settings saved.");
+      break;
+    case CMD_DELETE_ALL:
+      deleteAllFiles();
+      break;
+    case CMD_DELETE:
+      if (command.valid) {
+        String fileToDelete = fileList[command.number - 1];
+        if (tombstoneFile(fileToDelete) || SPIFFS.remove(fileToDelete)) {
+          if (catalogueDirty) catalogueSave();
+          Serial.println("Deleted file: " + fileToDelete);
+        } else {
+          Serial.println("Failed to delete file: " + fileToDelete);
+        }
+        listStoredFiles();
+      } else {
+        Serial.println("Invalid file number.");
+      }
+      break;
+    case CMD_STATS:
+      printStats(false);
+      break;
+    case CMD_STATS_JSON:
+      printStats(true);
+      break;
+    case CMD_STATS_RESET:
+      resetStats();
+      Serial.println("Statistics reset.");
+      break;
+    case CMD_STATS_HEAP:
+      printHeapStats();
+      break;
+    case CMD_STATS_BOOT:
+      printBootProfile();
+      break;
+    case CMD_TRACE_DUMP:
+      dumpTrace();
+      break;
+    case CMD_TRACE_CLEAR:
+      traceHead = 0;
+      Serial.println("Trace cleared.");
+      break;
+    case CMD_SELFTEST:
+      if (command.valid) {
+        runTraceTest(command.seed, command.events, false);
+        runQuerySelfTest(command.seed);
+      } else {
+        Serial.println("Usage: selftest [seed] [events]");
+      }
+      break;
+    case CMD_BENCH:
+      if (command.valid) {
+        runBenchmark(command.number);
+      } else {
+        Serial.println("Invalid iteration count (1-10000).");
+      }
+      break;
+    case CMD_BENCH_FS:
+      if (command.valid) {
+        runFsCalibration(command.number);
+      } else {
+        Serial.println("Invalid size in KB (1-512).");
+      }
+      break;
+    case CMD_BENCH_TRACE:
+      if (command.valid) {
+        runTraceTest(command.seed, command.events, true);
+      } else {
+        Serial.println("Usage: bench trace [seed] [events]");
+      }
+      break;
+    case CMD_LIST:
+      listStoredFiles();
+      break;
+    case CMD_LIST_FILTER:
+      if (command.valid) {
+        listCatalogue(command.meta, command.fields);
+      } else {
+        Serial.println("Usage: list [operator=<name>] [scene=<s>] [take=<t>] [remote=<r>] [device=<hex>]");
+      }
+      break;
+    case CMD_QUERY:
+      if (command.number == 0) {
+        Serial.println("Invalid file number.");
+      } else if (!command.valid) {
+        Serial.println("Usage: query <num> count|list|first|last [key=<name>[_hold]] [type=<type>] [from=<m:ss>] [to=<m:ss>]");
+      } else {
+        runQuery(fileList[command.number - 1], command.op, command.filter);
+      }
+      break;
+    case CMD_SEND_ALL:
+      sendAllFilesOverSerial();
+      break;
+    case CMD_SEND:
+      if (command.valid) {
+        sendFileOverSerial(fileList[command.number - 1].c_str());
+      } else {
+        Serial.println("Invalid file number.");
+      }
+      break;
+    default:
+      Serial.println("Unknown command. Available commands:");
+      Serial.println("  list                 - List all stored files with numbers");
+      Serial.println("  list scene=12 ...    - List sessions whose metadata matches");
+      Serial.println("  meta [key=value ...] - Operator/scene/take/remote for the next session");
+      Serial.println("  delete               - Delete all stored files");
+      Serial.println("  delete <num>         - Delete a specific file by number");
+      Serial.println("  send <num>           - Send a specific file over Serial by number");
+      Serial.println("  send all             - Send all files over Serial");
+      Serial.println("  query <num> <op> ... - count|list|first|last over a file's records");
+      Serial.println("  setbase <new_base>   - Change the log file base");
+      Serial.println("  save                 - Write changed settings to flash now");
+      Serial.println("  startkey <key|off>   - IR key that starts an auto-named session");
+      Serial.println("  autostart on|off     - Start an auto-named session at boot");
+      Serial.println("  markerkey <key|off>  - IR key logged as a slate/sync marker");
+      Serial.println("  markers [rebuild]    - List the sync marker index, or rebuild it");
+      Serial.println("  idlesplit <s|off>    - Start a new segment file after s idle seconds");
+      Serial.println("  route remote|off     - Run a separate session per remote address");
+      Serial.println("  selectkey <key|off>  - IR key that switches between concurrent sessions");
+      Serial.println("  sessions             - Show the concurrent session slots");
+      Serial.println("  store ring|spiffs    - Record engine for new sessions");
+      Serial.println("  ring                 - Ring log position and wear");
+      Serial.println("  scrub [status]       - Verify stored sessions now / show results");
+      Serial.println("  df                   - Free space and remaining recording time");
+      Serial.println("  df warn <pct|off>    - Low-space warning threshold");
+      Serial.println("  align [n]            - Per-session offsets that line up marker n");
+      Serial.println("  rename <num> <name>  - Rename a stored session");
+      Serial.println("  time [unix_ms]       - Show or set the wall clock for session files");
+      Serial.println("  ping <unix_ms>       - Quiet clock sync for drift tracking");
+      Serial.println("  tc [HH:MM:SS:FF] [fps] [df] - Show or set the camera timecode anchor");
+      Serial.println("  stats                - Show event, storage and transfer counters");
+      Serial.println("  stats json           - Counters as one JSON line");
+      Serial.println("  stats reset          - Zero the counters");
+      Serial.println("  stats heap           - Show heap usage, fragmentation and history");
+      Serial.println("  stats boot           - Show boot phase timings");
+      Serial.println("  trace dump           - Emit the trace ring as Chrome trace JSON");
+      Serial.println("  trace clear          - Discard recorded trace events");
+      Serial.println("  bench [n]            - Time the per-press hot path over n events");
+      Serial.println("  bench fs [kb]        - Measure SPIFFS open/write/close costs");
+      Serial.println("  bench trace [s] [n]  - Replay a generated press trace into flash");
+      Serial.println("  selftest [s] [n]     - Check capture invariants on a generated trace");
+      Serial.println("  menu                 - Return to the main menu");
+      break;
+  }
+}
+
+// =========== Heap Tracking ===========
+// String-heavy code fragments the heap over long sessions. Each subsystem's
+// net retained bytes are accounted at its call sites, and free heap, largest
+// free block and low-water mark are sampled periodically.
+
+// Free heap before an accounted call
+uint32_t heapMark() {
+  return ESP.getFreeHeap();
+}
+
+// Charge the bytes retained since heapMark() to a subsystem
+void heapAccount(HeapSubsystem subsystem, uint32_t mark) {
+  heapAccounts[subsystem].netBytes += (int32_t)mark - (int32_t)ESP.getFreeHeap();
+  heapAccounts[subsystem].calls++;
+}
+
+static HeapSample takeHeapSample() {
+  HeapSample sample;
+  sample.uptimeS = millis() / 1000;
+  sample.freeBytes = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  sample.largestBlock = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  sample.minFreeBytes = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  return sample;
+}
+
+static uint32_t heapFragmentation(const HeapSample &sample) {
+  if (sample.freeBytes == 0) return 100;
+  return 100 - (uint32_t)((uint64_t)sample.largestBlock * 100 / sample.freeBytes);
+}
+
+static void printHeapSample(const HeapSample &sample) {
+  Serial.printf("%8us %8u %8u %8u %5u%%\n", sample.uptimeS, sample.freeBytes, sample.largestBlock,
+                sample.minFreeBytes, heapFragmentation(sample));
+}
+
+// Record a heap sample once per interval; call from every polling loop
+void heapTrackerTick() {
+  if (heapSampleCount > 0 && (millis() - lastHeapSampleTime) < HEAP_SAMPLE_INTERVAL_MS) {
+    return;
+  }
+  lastHeapSampleTime = millis();
+  heapSamples[heapSampleCount % HEAP_SAMPLE_COUNT] = takeHeapSample();
+  heapSampleCount++;
+}
+
+void printHeapStats() {
+  Serial.printf("%9s %8s %8s %8s %6s\n", "uptime", "free", "largest", "min", "frag");
+  printHeapSample(takeHeapSample());
+  Serial.println("Per subsystem (net retained bytes / calls):");
+  for (int i = 0; i < HEAP_SUBSYSTEMS; i++) {
+    Serial.printf("  %-8s %8d %8u\n", heapSubsystemNames[i], heapAccounts[i].netBytes,
+                  heapAccounts[i].calls);
+  }
+  int first = heapSampleCount > HEAP_SAMPLE_COUNT ? heapSampleCount - HEAP_SAMPLE_COUNT : 0;
+  Serial.printf("History (%d samples, every %lus):\n", heapSampleCount - first,
+                HEAP_SAMPLE_INTERVAL_MS / 1000);
+  for (int i = first; i < heapSampleCount; i++) {
+    printHeapSample(heapSamples[i % HEAP_SAMPLE_COUNT]);
+  }
+}
+
+// =========== Runtime Statistics ===========
+
+void statAdd(std::atomic<uint32_t> &counter, uint32_t amount) {
+  counter.fetch_add(amount, std::memory_order_relaxed);
+}
+
+// Raise a high-water mark
+void statMax(std::atomic<uint32_t> &counter, uint32_t value) {
+  uint32_t current = counter.load(std::memory_order_relaxed);
+  while (value > current && !counter.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+  }
+}
+
+// 'bench' and 'selftest' put the counters back when they finish, so
+// synthetic events never show up in the scraped stats
+void statsCopy(RuntimeStats &to, const RuntimeStats &from) {
+  to.eventsCaptured = from.eventsCaptured.load();
+  to.eventsLogged = from.eventsLogged.load();
+  to.unmappedCodes = from.unmappedCodes.load();
+  to.repeatsSuppressed = from.repeatsSuppressed.load();
+  to.bytesWritten = from.bytesWritten.load();
+  to.flushCount = from.flushCount.load();
+  to.writeFailures = from.writeFailures.load();
+  to.transferBytes = from.transferBytes.load();
+  to.transferUs = from.transferUs.load();
+  to.sessionsStarted = from.sessionsStarted.load();
+  to.eventsDropped = from.eventsDropped.load();
+  to.pressQueueHighWater = from.pressQueueHighWater.load();
+  to.pendingHighWater = from.pendingHighWater.load();
+  to.nvsWrites = from.nvsWrites.load();
+}
+
+void markBootPhase(BootPhase phase) {
+  bootPhaseUs[phase] = micros();
+}
+
+void printBootProfile() {
+  Serial.println("Boot phase        us since start");
+  for (int i = 0; i < BOOT_PHASES; i++) {
+    if (bootPhaseUs[i] == 0) {
+      Serial.printf("  %-14s %10s\n", bootPhaseNames[i], "pending");
+    } else {
+      Serial.printf("  %-14s %10u\n", bootPhaseNames[i], bootPhaseUs[i]);
+    }
+  }
+  Serial.printf("Time to first capture: %u us\n", bootPhaseUs[BOOT_IR_ARMED]);
+}
+
+void resetStats() {
+  std::atomic<uint32_t> *counters[] = {
+    &stats.eventsCaptured, &stats.eventsLogged, &stats.unmappedCodes, &stats.repeatsSuppressed,
+    &stats.bytesWritten, &stats.flushCount, &stats.writeFailures, &stats.transferBytes,
+    &stats.transferUs, &stats.sessionsStarted, &stats.eventsDropped, &stats.pressQueueHighWater,
+    &stats.pendingHighWater, &stats.nvsWrites,
+  };
+  for (auto *counter : counters) {
+    counter->store(0, std::memory_order_relaxed);
+  }
+  commandMaxUs = 0;
+  slowestCommand = "";
+}
+
+// Print counters; json = one line for the fleet scraper
+void printStats(bool json) {
+  uint32_t transferBytes = stats.transferBytes.load(std::memory_order_relaxed);
+  uint32_t transferUs = stats.transferUs.load(std::memory_order_relaxed);
+  uint32_t throughput = transferUs ? (uint32_t)((uint64_t)transferBytes * 1000000 / transferUs) : 0;
+  uint32_t uptimeS = millis() / 1000;
+  if (json) {
+    Serial.printf("{\"uptime_s\":%u,\"events_captured\":%u,\"events_logged\":%u,"
+                  "\"unmapped_codes\":%u,\"repeats_suppressed\":%u,\"bytes_written\":%u,"
+                  "\"flushes\":%u,\"write_failures\":%u,\"transfer_bytes\":%u,"
+                  "\"transfer_bps\":%u,\"sessions_started\":%u,\"events_dropped\":%u,"
+                  "\"press_queue_hwm\":%u,\"pending_hwm\":%u,\"nvs_writes\":%u,\"cmd_max_us\":%u,"
+                  "\"free_heap\":%u}\n",
+                  uptimeS, stats.eventsCaptured.load(), stats.eventsLogged.load(),
+                  stats.unmappedCodes.load(), stats.repeatsSuppressed.load(),
+                  stats.bytesWritten.load(), stats.flushCount.load(), stats.writeFailures.load(),
+                  transferBytes, throughput, stats.sessionsStarted.load(), stats.eventsDropped.load(),
+                  stats.pressQueueHighWater.load(), stats.pendingHighWater.load(), stats.nvsWrites.load(), commandMaxUs,
+                  ESP.getFreeHeap());
+    return;
+  }
+  Serial.printf("Uptime:              %uh %02um %02us\n", uptimeS / 3600, (uptimeS / 60) % 60, uptimeS % 60);
+  Serial.printf("Sessions started:    %u\n", stats.sessionsStarted.load());
+  Serial.printf("Events captured:     %u\n", stats.eventsCaptured.load());
+  Serial.printf("Events logged:       %u\n", stats.eventsLogged.load());
+  Serial.printf("Unmapped codes:      %u\n", stats.unmappedCodes.load());
+  Serial.printf("Repeats suppressed:  %u\n", stats.repeatsSuppressed.load());
+  Serial.printf("Bytes written:       %u\n", stats.bytesWritten.load());
+  Serial.printf("Flushes:             %u\n", stats.flushCount.load());
+  Serial.printf("Write failures:      %u\n", stats.writeFailures.load());
+  Serial.printf("Events dropped:      %u\n", stats.eventsDropped.load());
+  Serial.printf("Queue high-water:    %u/%u presses, %u/%u pending records\n",
+                stats.pressQueueHighWater.load(), PRESS_QUEUE_SIZE, stats.pendingHighWater.load(),
+                PENDING_RECORDS_MAX);
+  Serial.printf("NVS writes:          %u\n", stats.nvsWrites.load());
+  Serial.printf("Transfer:            %u bytes at %u B/s\n", transferBytes, throughput);
+  Serial.printf("Slowest command:     %u us (%s)\n", commandMaxUs, slowestCommand.c_str());
+}
+
+// =========== Trace Recorder ===========
+// Fixed RAM ring of begin/end events. 'trace dump' emits it as Chrome trace
+// JSON (chrome://tracing, Perfetto) between START_TRACE/END_TRACE markers.
+
+static inline void traceRecord(TraceId id, char phase) {
+  TraceEvent &event = traceRing[traceHead % TRACE_CAPACITY];
+  event.timestampUs = micros();
+  event.id = id;
+  event.phase = phase;
+  traceHead++;
+}
+
+void traceBegin(TraceId id) {
+  traceRecord(id, 'B');
+}
+
+void traceEnd(TraceId id) {
+  traceRecord(id, 'E');
+}
+
+void dumpTrace() {
+  uint32_t first = traceHead > TRACE_CAPACITY ? traceHead - TRACE_CAPACITY : 0;
+  uint32_t last = traceHead;
+  Serial.println("START_TRACE");
+  Serial.println("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (uint32_t i = first; i < last; i++) {
+    const TraceEvent &event = traceRing[i % TRACE_CAPACITY];
+    Serial.printf("{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%u,\"pid\":1,\"tid\":1}%s\n",
+                  traceNames[event.id], event.phase, event.timestampUs, (i + 1 < last) ? "," : "");
+  }
+  Serial.println("]}");
+  Serial.println("END_TRACE");
+}
+
+// =========== Hot Path Benchmark ===========
+
+// A benchmark or self-test logs into a scratch slot of its own; only these
+// globals are borrowed from the live session and handed back afterwards
+struct SessionSnapshot {
+  bool active;
+  usec_t lastAccepted;
+  bool echo;
+  uint16_t markerKey;
+  bool routeByRemote;
+};
+
+static SessionSnapshot saveSessionState() {
+  SessionSnapshot snap = {sessionActive, lastAcceptedPressTime, echoCommands, config.markerKey,
+                          config.routeByRemote};
+  return snap;
+}
+
+static void restoreSessionState(const SessionSnapshot &snap) {
+  sessionActive = snap.active;
+  lastAcceptedPressTime = snap.lastAccepted;
+  echoCommands = snap.echo;
+  config.markerKey = snap.markerKey;
+  config.routeByRemote = snap.routeByRemote;
+}
+
+// Per-stage result of one benchmark run
+struct BenchResult {
+  const char *name;
+  uint32_t cycles;
+  int32_t netHeapBytes;              // Heap still held after the stage; a transient
+  int32_t netHeapBlocks;             // String that is freed again nets to zero
+  unsigned long written;
+};
+
+static size_t benchAllocatedBlocks() {
+  multi_heap_info_t info;
+  heap_caps_get_info(&info, MALLOC_CAP_8BIT);
+  return info.allocated_blocks;
+}
+
+static void printBenchResult(const BenchResult &r, int iterations) {
+  uint32_t cyclesPerEvent = r.cycles / iterations;
+  uint32_t nsPerEvent = (uint32_t)((uint64_t)r.cycles * 1000 / ESP.getCpuFreqMHz() / iterations);
+  Serial.printf("%-22s %10u %12u %10.2f %10.2f %10.1f\n", r.name, nsPerEvent, cyclesPerEvent,
+                (float)r.netHeapBytes / iterations, (float)r.netHeapBlocks / iterations,
+                (float)r.written / iterations);
+}
+
+// Time each stage of handleButtonPress() -> logCommand() -> writeRecord()
+// against a scratch file, then the whole path end to end. Cycle counts come
+// from the CPU cycle counter so they can be compared with host numbers.
+void runBenchmark(int iterations) {
+  const char *benchFile = "/bench" SESSION_EXTENSION;
+
+  SessionSnapshot snap = saveSessionState();
+  RuntimeStats savedStats;
+  statsCopy(savedStats, stats);
+  SPIFFS.remove(benchFile);
+  SessionSlot bench;
+  bench.fileName = benchFile;
+  pressStateInit(bench.press, clockNowUs());
+  config.markerKey = KEY_NONE;
+  config.routeByRemote = false;
+  echoCommands = false;
+
+  BenchResult results[4] = {
+    {"BM_formatRecord", 0, 0, 0, 0},
+    {"BM_writeRecord", 0, 0, 0, 0},
+    {"BM_logCommand", 0, 0, 0, 0},
+    {"BM_handleButtonPress", 0, 0, 0, 0},
+  };
+  String line;
+  EventRecord record = {1000000, REC_PRESS, 0, 1, 0, 0};
+  SessionTiming timing = {};
+
+  for (int stage = 0; stage < 4; stage++) {
+    BenchResult &r = results[stage];
+    uint32_t freeBefore = ESP.getFreeHeap();
+    size_t blocksBefore = benchAllocatedBlocks();
+    uint32_t writtenBefore = stats.bytesWritten.load();
+    for (int i = 0; i < iterations; i++) {
+      IrEvent event = {keyMap[i % 5].code, 0, clockNowUs()};
+      uint32_t start = ESP.getCycleCount();
+      switch (stage) {
+        case 0: line = formatRecord(record, timing); break;
+        case 1: writeRecord(bench, record); break;
+        case 2: logCommand(bench, 0, PRESS_TAP, event.timeUs); break;
+        case 3: handleButtonPress(bench, event); break;
+      }
+      r.cycles += ESP.getCycleCount() - start;
+    }
+    r.netHeapBytes = (int32_t)freeBefore - (int32_t)ESP.getFreeHeap();
+    r.netHeapBlocks = (int32_t)benchAllocatedBlocks() - (int32_t)blocksBefore;
+    r.written = stats.bytesWritten.load() - writtenBefore;
+  }
+
+  Serial.printf("Benchmark: %d events/stage, CPU %u MHz\n", iterations, ESP.getCpuFreqMHz());
+  Serial.printf("%-22s %10s %12s %10s %10s %10s\n", "Benchmark", "ns/event", "cycles/event",
+                "netB/ev", "netBlk/ev", "bytes/ev");
+  for (int stage = 0; stage < 4; stage++) {
+    printBenchResult(results[stage], iterations);
+  }
 
-unsigned long lastClipTime = 0;      // Time of last logged clip
-int currentTrackIndex = 1;           // Track index for next clip
+  closeSessionFile(bench);
+  SPIFFS.remove(benchFile);
+  restoreSessionState(snap);
+  statsCopy(stats, savedStats);
+}
 
-Preferences preferences;
+// =========== Session Trace Generator ===========
+// Traces from lib/SessionCore run on the virtual clock. 'selftest' feeds
+// them through acceptPress() -> handleButtonPress() and checks invariants;
+// 'bench trace' replays the same traces into flash as a throughput corpus.
 
-// =========== Global Variables (Mode & BLE) ===========
- // 1 = IR Mode, 2 = File Management, 3 = BLE Connect/Pair
-int currentMode = 0;  
+#define TRACE_MAX_VIOLATIONS 5       // Violations printed before going quiet
 
-// Create a BLE Keyboard instance 
-BleKeyboard bleKeyboard("ESP32 Media Keyboard", "MyCompany", 100);
+static IrEvent traceIrEvent(const TracePress &trace) {
+  IrEvent event;
+  event.command = trace.command;
+  event.flags = 0;
+#ifdef IRDATA_FLAGS_IS_REPEAT
+  if (trace.repeat) event.flags = IRDATA_FLAGS_IS_REPEAT;
+#endif
+  event.timeUs = trace.timeUs;
+  event.address = 0;                 // One remote; routing is off during the run
+  return event;
+}
 
-// =========== Function Prototypes ===========
-void initFileSystem();
-void writeToFile(String line);
-void logCommand(String buttonName);
-void sendFileOverSerial(const char *fileNameParam);
-void listStoredFiles();
-void deleteAllFiles();
-void sendAllFilesOverSerial();
-void handleButtonPress(uint32_t command);
-void handleSerialCommand(String command);
-void selectMode();
-void sendVolumeUp();
-void irModeLoop();
-void bleMode();  
-void setup();
-void loop();
+// Run one generated trace; benchmark = write to flash and report throughput
+bool runTraceTest(uint32_t seed, int events, bool benchmark) {
+  const char *benchFile = "/bench" SESSION_EXTENSION;
+  SessionSnapshot snap = saveSessionState();
+  RuntimeStats savedStats;
+  statsCopy(savedStats, stats);
+  TraceGenerator gen;
+  traceGenInit(gen, seed);
 
-// =========== File/IR Management Functions ===========
+  if (benchmark) SPIFFS.remove(benchFile);
+  SessionSlot bench;
+  bench.fileName = benchFile;
+  pressStateInit(bench.press, gen.timeUs);
+  config.markerKey = KEY_NONE;
+  config.routeByRemote = false;
+  discardWrites = !benchmark;
+  echoCommands = false;
+  sessionActive = true;
+  lastAcceptedPressTime = gen.timeUs - PRESS_DEBOUNCE_US;
+  clockSetVirtual(gen.timeUs);
+  clearPressQueue();
 
-// Initialize SPIFFS
-void initFileSystem() {
-  if (!SPIFFS.begin(true)) {
-    Serial.println("Failed to mount SPIFFS");
-    while (1);
+  int violations = 0;
+  uint32_t accepted = 0;
+  uint32_t loggedBefore = stats.eventsLogged.load();
+  int pendingBefore = pendingRecordCount;
+  uint32_t freeBefore = ESP.getFreeHeap();
+  uint32_t cycles = 0;
+  uint32_t startMs = millis();
+
+  for (int i = 0; i < events; i++) {
+    IrEvent event = traceIrEvent(traceGenNext(gen));
+    clockSetVirtual(event.timeUs);
+    bool expectAccept = (event.timeUs - lastAcceptedPressTime) >= PRESS_DEBOUNCE_US;
+    usec_t prevClip = bench.press.lastClip;
+    uint32_t loggedPrev = stats.eventsLogged.load();
+    uint32_t start = ESP.getCycleCount();
+    bool ok = acceptPress(event);
+    IrEvent queued;
+    while (popPress(queued)) {
+      handleButtonPress(bench, queued);
+    }
+    cycles += ESP.getCycleCount() - start;
+    if (ok) accepted++;
+
+    const char *failure = NULL;
+    if (expectAccept && !ok) {
+      failure = "press at rated rate was not accepted";
+    } else if (stats.eventsLogged.load() != loggedPrev && bench.press.lastClip < prevClip) {
+      failure = "clip time went backwards";
+    } else if (bench.press.track < 1 || bench.press.track > MAX_TRACK_INDEX) {
+      failure = "track index out of range";
+    } else if (pendingRecordCount != pendingBefore) {
+      failure = "pending line buffer grew";
+    }
+    if (failure) {
+      if (violations < TRACE_MAX_VIOLATIONS) {
+        Serial.printf("  event %d (t=%llu us, code %u): %s\n", i, (unsigned long long)event.timeUs,
+                      event.command, failure);
+      }
+      violations++;
+    }
   }
-  Serial.println("SPIFFS mounted successfully");
-}
 
-// Write a line to the active session file
-void writeToFile(String line) {
-  if (currentFileName == "") {
-    Serial.println("No active session file.");
-    return;
+  int32_t heapGrowth = (int32_t)freeBefore - (int32_t)ESP.getFreeHeap();
+  if (heapGrowth > 1024) {
+    Serial.printf("  heap grew by %d bytes\n", heapGrowth);
+    violations++;
   }
-  File file = SPIFFS.open(currentFileName, FILE_APPEND);
-  if (file) {
-    file.println(line);
-    file.close();
-  } else {
-    Serial.println("Failed to open file for writing: " + currentFileName);
+  uint32_t logged = stats.eventsLogged.load() - loggedBefore;
+  uint32_t elapsedMs = millis() - startMs;
+  Serial.printf("Trace seed=%u events=%d accepted=%u logged=%u violations=%d: %s\n", seed, events,
+                accepted, logged, violations, violations ? "FAIL" : "PASS");
+  if (benchmark) {
+    Serial.printf("Throughput: %u events/s, %u cycles/event\n",
+                  elapsedMs ? (uint32_t)((uint64_t)events * 1000 / elapsedMs) : 0,
+                  events ? cycles / events : 0);
+    closeSessionFile(bench);
+    SPIFFS.remove(benchFile);
   }
-}
 
-// Log a command with timestamp + track selection
-void logCommand(String buttonName) {
-  unsigned long clipTime = millis() - timestampStart;
-  // If clip is inserted less than 1 second after last clip, increment track;
-  // otherwise, use track 1.
-  if ((clipTime - lastClipTime) < 1000) {
-    currentTrackIndex++;
-  } else {
-    currentTrackIndex = 1;
-  }
-  lastClipTime = clipTime;
-  String commandStr = "app.project.activeSequence.videoTracks[" + String(currentTrackIndex+1) +
-                      "].insertClip(findClipByName(\"" + buttonName + ".mov\"), " +
-                      String(clipTime / 1000.0, 3) + ");";
-  Serial.println(commandStr);
-  writeToFile(commandStr);
+  discardWrites = false;
+  clockUseReal();
+  clearPressQueue();
+  restoreSessionState(snap);
+  statsCopy(stats, savedStats);
+  return violations == 0;
 }
 
-// Send a file over Serial
-void sendFileOverSerial(const char *fileNameParam) {
-  Serial.print("Sending: ");
-  Serial.println(fileNameParam);
-  File file = SPIFFS.open(fileNameParam, FILE_READ);
-  if (!file) {
-    Serial.println("Failed to open file for reading");
-    return;
+// Count matches through the sparse index and by a full scan for random
+// filters, open-ended ones included; any difference is an index bug
+bool runQuerySelfTest(uint32_t seed) {
+  const uint32_t records = 2000;
+  const int filters = 50;
+  usec_t blockStart[(records + QUERY_BLOCK_RECORDS - 1) / QUERY_BLOCK_RECORDS];
+  uint32_t blocks = 0;
+  TraceGenerator gen;
+  traceGenInit(gen, seed);
+  usec_t timeUs = 0;
+  for (uint32_t i = 0; i < records; i++) {
+    EventRecord record = traceQueryRecord(gen, timeUs);
+    if (i % QUERY_BLOCK_RECORDS == 0) blockStart[blocks++] = record.timeUs;
   }
-  Serial.println("START_FILE_TRANSFER:" + String(fileNameParam));
-  while (file.available()) {
-    Serial.write(file.read());
+  usec_t spanUs = timeUs;
+  int mismatches = 0;
+  TraceGenerator pick;
+  traceGenInit(pick, seed + 1);
+  for (int f = 0; f < filters; f++) {
+    QueryFilter filter = {-1, false, 0, 0, (usec_t)-1};
+    if (traceRange(pick, 0, 2) > 0) filter.fromUs = (usec_t)traceRange(pick, 0, spanUs / 1000) * 1000;
+    if (traceRange(pick, 0, 2) > 0) filter.toUs = filter.fromUs + (usec_t)traceRange(pick, 0, spanUs / 4000) * 1000;
+    if (traceRange(pick, 0, 1)) filter.type = REC_PRESS;
+    uint32_t startBlock, endBlock;
+    queryBlockRange(blockStart, blocks, filter, startBlock, endBlock);
+    uint32_t first = startBlock * QUERY_BLOCK_RECORDS;
+    uint32_t end = endBlock < blocks ? endBlock * QUERY_BLOCK_RECORDS : records;
+    uint32_t full = 0, indexed = 0;
+    traceGenInit(gen, seed);
+    timeUs = 0;
+    for (uint32_t i = 0; i < records; i++) {
+      EventRecord record = traceQueryRecord(gen, timeUs);
+      if (!queryMatches(record, filter)) continue;
+      full++;
+      if (i >= first && i < end) indexed++;
+    }
+    if (full != indexed) {
+      if (mismatches < TRACE_MAX_VIOLATIONS) {
+        Serial.printf("  filter %d: full scan %u, indexed %u\n", f, (unsigned)full, (unsigned)indexed);
+      }
+      mismatches++;
+    }
   }
-  Serial.println("\nEND_FILE_TRANSFER");
-  file.close();
+  Serial.printf("Query index seed=%u filters=%d mismatches=%d: %s\n", seed, filters, mismatches,
+                mismatches ? "FAIL" : "PASS");
+  return mismatches == 0;
 }
 
-// List all stored files
-void listStoredFiles() {
-  File root = SPIFFS.open("/");
-  File file = root.openNextFile();
-  fileCount = 0;
-  while (file && fileCount < 50) {
-    fileList[fileCount] = file.path();
-    Serial.printf("[%d] %s\n", fileCount + 1, file.path());
-    file = root.openNextFile();
-    fileCount++;
-  }
-  if (fileCount == 0) {
-    Serial.println("No files found.");
-  }
+// =========== Filesystem Cost Calibration ===========
+// Measures what a write policy actually pays on this flash: per-open
+// metadata cost, small appends, page-sized programs, and the stalls that
+// show up as SPIFFS garbage-collects at higher fill levels. The FSCAL line
+// calibrates the host storage model (FlashModel.h) the native tests use.
+
+#define FSCAL_PAGE_SIZE 256
+#define FSCAL_STALL_FACTOR 8
+
+// Min/avg/max accumulator for one measured operation
+struct FsCalStat {
+  uint32_t count;
+  uint32_t totalUs;
+  uint32_t minUs;
+  uint32_t maxUs;
+};
+
+static void fsCalAdd(FsCalStat &stat, uint32_t us) {
+  if (stat.count == 0 || us < stat.minUs) stat.minUs = us;
+  if (us > stat.maxUs) stat.maxUs = us;
+  stat.totalUs += us;
+  stat.count++;
 }
 
-// Delete all files
-void deleteAllFiles() {
-  File root = SPIFFS.open("/");
-  File file = root.openNextFile();
-  while (file) {
-    fileName = "/";
-    fileName.concat(file.name());
-    SPIFFS.remove(fileName);
-    file = root.openNextFile();
-  }
-  Serial.println("All files deleted.");
-  fileName = "";
+static uint32_t fsCalAvg(const FsCalStat &stat) {
+  return stat.count ? stat.totalUs / stat.count : 0;
 }
 
-// Send all files over Serial
-void sendAllFilesOverSerial() {
-  if (fileCount == 0) {
-    Serial.println("No files to send.");
-    return;
-  }
-  Serial.println("START_ALL_FILE_TRANSFER");
-  for (int i = 0; i < fileCount; i++) {
-    sendFileOverSerial(fileList[i].c_str());
-  }
-  Serial.println("END_ALL_FILE_TRANSFER");
+static void printFsCalStat(const char *name, const FsCalStat &stat) {
+  Serial.printf("%-16s %8u %8u %8u %8u\n", name, stat.count, stat.minUs, fsCalAvg(stat), stat.maxUs);
 }
 
-// Handle IR remote commands (except ending the session)
-void handleButtonPress(uint32_t command) {
-  String buttonName = "";
-  switch ((int)command) {
-    case 25: buttonName = "ok"; break;
-    case 24: buttonName = "right"; break;
-    case 22: buttonName = "down"; break;
-    case 23: buttonName = "left"; break;
-    case 21: buttonName = "up"; break;
-    case 71: buttonName = "home"; break;
-    case 16: buttonName = "settings"; break;
-    case 72: buttonName = "back"; break;
-    case 50: buttonName = "tv"; break;
-    default: buttonName = ""; break;
-  }
-  if (buttonName == "") return;
-  
-  bool isRepeat = false;
-  #ifdef IRDATA_FLAGS_IS_REPEAT
-    isRepeat = (IrReceiver.decodedIRData.flags & IRDATA_FLAGS_IS_REPEAT);
-  #else
-    const unsigned long holdThreshold = 700;
-    isRepeat = (buttonName == lastButton && (millis() - lastButtonTimestamp) < holdThreshold);
-  #endif
-  if (isRepeat) {
-    if (!holdLogged) {
-      buttonName += "_hold";
-      holdLogged = true;
-    } else {
-      return;
-    }
-  } else {
-    holdLogged = false;
+void runFsCalibration(int kilobytes) {
+  const char *calFile = "/fscal.bin";
+  EventRecord record = {123456000, REC_PRESS, 0, 2, 0, 0};
+  uint8_t page[FSCAL_PAGE_SIZE];
+  memset(page, 0xA5, sizeof(page));
+  FsCalStat openCreate = {0, 0, 0, 0}, openAppend = {0, 0, 0, 0}, recordAppend = {0, 0, 0, 0};
+  FsCalStat pageWrite = {0, 0, 0, 0}, closeFile = {0, 0, 0, 0}, removeFile = {0, 0, 0, 0};
+  uint32_t stallCount = 0;
+  uint32_t stallUs = 0;
+
+  size_t total = SPIFFS.totalBytes();
+  float fillBefore = total ? 100.0f * SPIFFS.usedBytes() / total : 0;
+  SPIFFS.remove(calFile);
+
+  // Create/close/remove cycles: pure metadata cost
+  for (int i = 0; i < 8; i++) {
+    uint32_t t0 = micros();
+    File file = SPIFFS.open(calFile, FILE_WRITE);
+    uint32_t t1 = micros();
+    file.close();
+    uint32_t t2 = micros();
+    SPIFFS.remove(calFile);
+    uint32_t t3 = micros();
+    fsCalAdd(openCreate, t1 - t0);
+    fsCalAdd(closeFile, t2 - t1);
+    fsCalAdd(removeFile, t3 - t2);
   }
-  logCommand(buttonName);
-  lastButton = buttonName;
-  lastButtonTimestamp = millis();
-}
 
-// Handle serial commands in File Management mode
-void handleSerialCommand(String command) {
-  command.trim();
-  if (command == "menu") {
-    selectMode();
-    return;
+  // Open-per-record appends, the cost the held-open session file avoids
+  for (int i = 0; i < 32; i++) {
+    uint32_t t0 = micros();
+    File file = SPIFFS.open(calFile, FILE_APPEND);
+    uint32_t t1 = micros();
+    file.write((const uint8_t *)&record, sizeof(record));
+    uint32_t t2 = micros();
+    file.close();
+    uint32_t t3 = micros();
+    fsCalAdd(openAppend, t1 - t0);
+    fsCalAdd(recordAppend, t2 - t1);
+    fsCalAdd(closeFile, t3 - t2);
   }
-  if (command.startsWith("setbase ")) {
-    String newBase = command.substring(8);
-    newBase.trim();
-    if (newBase.length() > 0) {
-      logFileBase = newBase;
-      preferences.putString("logBase", logFileBase);
-      Serial.println("Log file base changed to: " + logFileBase);
-    } else {
-      Serial.println("Invalid base name.");
+
+  // Page-sized programs into one open file; outliers are GC stalls
+  File file = SPIFFS.open(calFile, FILE_APPEND);
+  int pages = kilobytes * 1024 / FSCAL_PAGE_SIZE;
+  for (int i = 0; file && i < pages; i++) {
+    uint32_t t0 = micros();
+    size_t n = file.write(page, sizeof(page));
+    file.flush();
+    uint32_t us = micros() - t0;
+    if (n != sizeof(page)) {
+      Serial.println("Filesystem full, calibration stopped early.");
+      break;
     }
-    return;
-  }
-  if (command == "delete") {
-    deleteAllFiles();
-    return;
-  } else if (command.startsWith("delete ")) {
-    String argument = command.substring(7);
-    argument.trim();
-    int fileIndex = argument.toInt();
-    if (fileIndex > 0 && fileIndex <= fileCount) {
-      String fileToDelete = fileList[fileIndex - 1];
-      if (SPIFFS.remove(fileToDelete)) {
-        Serial.println("Deleted file: " + fileToDelete);
-      } else {
-        Serial.println("Failed to delete file: " + fileToDelete);
-      }
-      listStoredFiles();
-    } else {
-      Serial.println("Invalid file number.");
+    if (pageWrite.count >= 8 && us > FSCAL_STALL_FACTOR * fsCalAvg(pageWrite)) {
+      stallCount++;
+      stallUs += us;
     }
-    return;
+    fsCalAdd(pageWrite, us);
   }
-  if (command == "list") {
-    listStoredFiles();
-  } else if (command.startsWith("send ")) {
-    String argument = command.substring(5);
-    if (argument == "all") {
-      sendAllFilesOverSerial();
-    } else {
-      int fileIndex = argument.toInt();
-      if (fileIndex > 0 && fileIndex <= fileCount) {
-        sendFileOverSerial(fileList[fileIndex - 1].c_str());
-      } else {
-        Serial.println("Invalid file number.");
-      }
-    }
-  } else {
-    Serial.println("Unknown command. Available commands:");
-    Serial.println("  list                 - List all stored files with numbers");
-    Serial.println("  delete               - Delete all stored files");
-    Serial.println("  delete <num>         - Delete a specific file by number");
-    Serial.println("  send <num>           - Send a specific file over Serial by number");
-    Serial.println("  send all             - Send all files over Serial");
-    Serial.println("  setbase <new_base>   - Change the log file base");
-    Serial.println("  menu                 - Return to the main menu");
+  file.close();
+  float fillAfter = total ? 100.0f * SPIFFS.usedBytes() / total : 0;
+  uint32_t t0 = micros();
+  SPIFFS.remove(calFile);
+  fsCalAdd(removeFile, micros() - t0);
+
+  // A raw sector erase, on the ring sector already erased ahead so no data is lost
+  uint32_t eraseUs = 0;
+  if (ringPartition && ringErasedSector >= 0) {
+    t0 = micros();
+    esp_partition_erase_range(ringPartition, ringErasedSector * RING_SECTOR_SIZE, RING_SECTOR_SIZE);
+    eraseUs = micros() - t0;
+    ringErases++;
+    ringNextEraseCount++;
   }
+
+  Serial.printf("SPIFFS fill %.1f%% -> %.1f%% of %u bytes\n", fillBefore, fillAfter, (unsigned)total);
+  Serial.printf("%-16s %8s %8s %8s %8s\n", "Operation", "count", "min_us", "avg_us", "max_us");
+  printFsCalStat("open_create", openCreate);
+  printFsCalStat("open_append", openAppend);
+  printFsCalStat("record_append", recordAppend);
+  printFsCalStat("page_write", pageWrite);
+  printFsCalStat("close", closeFile);
+  printFsCalStat("remove", removeFile);
+  if (eraseUs) Serial.printf("%-16s %8u %8u %8u %8u\n", "sector_erase", 1, eraseUs, eraseUs, eraseUs);
+  // Read by parseFsCal() in lib/SessionCore/src/FlashModel.cpp
+  Serial.printf("FSCAL fill=%.1f open_create_us=%u open_append_us=%u record_append_us=%u "
+                "page_write_us=%u close_us=%u remove_us=%u erase_us=%u pages=%u stalls=%u stall_avg_us=%u\n",
+                fillBefore, fsCalAvg(openCreate), fsCalAvg(openAppend), fsCalAvg(recordAppend),
+                fsCalAvg(pageWrite), fsCalAvg(closeFile), fsCalAvg(removeFile), eraseUs, pageWrite.count,
+                stallCount, stallCount ? stallUs / stallCount : 0);
 }
 
 // =========== Menu Selection ===========
+// The menu is a state of loop(), not a wait: IR capture, buffered writes
+// and background flash work keep running until a choice is typed.
+
+// Back to the menu; loop() prints it on its next pass
+void enterMenu() {
+  currentMode = 0;
+  menuShown = false;
+}
+
+// Switch to IR mode from wherever the start key caught us. A BLE link stays
+// up so the session start still reaches the phone.
+void enterIrMode() {
+  if (currentMode == 1) return;
+  Serial.println("Start key pressed; switching to IR Mode.");
+  currentMode = 1;
+  menuShown = false;
+  bleModeStarted = false;
+  awaitingSessionName = false;
+}
+
 void selectMode() {
-  Serial.println();
-  Serial.println("========== MENU ==========");
-  Serial.println("Select Mode:");
-  Serial.println("1 - IR Mode (Record IR signals)");
-  Serial.println("2 - File Management Mode");
-  Serial.println("3 - BLE Connect/Pair");
-  Serial.println("Enter your choice:");
-  
-  while (!Serial.available()) {
-    delay(100);
+  if (!menuShown) {
+    Serial.println();
+    Serial.println("========== MENU ==========");
+    Serial.println("Select Mode:");
+    Serial.println("1 - IR Mode (Record IR signals)");
+    Serial.println("2 - File Management Mode");
+    Serial.println("3 - BLE Connect/Pair");
+    Serial.println("Enter your choice:");
+    menuShown = true;
   }
-  char choice = Serial.read();
-  while (Serial.available()) { Serial.read(); }
+  if (!Serial.available()) return;
+  String choice = readSerialLine();
+  choice.trim();
+  menuShown = false;
   
-  if (choice == '1') {
+  if (choice == "1") {
     currentMode = 1;
     Serial.println("IR Mode selected.");
-  } else if (choice == '2') {
+  } else if (choice == "2") {
+    waitForStorage();
     currentMode = 2;
     Serial.println("File Management Mode selected.");
-    Serial.println("Current log file base is: " + logFileBase);
+    Serial.println("Current log file base is: " + config.logBase);
     Serial.println("Available commands:");
-    Serial.println("  list, delete, delete <num>, send <num>, send all, setbase <new_base>, menu");
+    Serial.println("  list, list scene=<s> ..., meta [key=value ...], delete, delete <num>, send <num>, send all, query <num> count|list|first|last [key= type= from= to=], setbase <new_base>, save, startkey <key|off>, autostart on|off, markerkey <key|off>, markers, align [n], idlesplit <s|off>, route remote|off, selectkey <key|off>, sessions, store ring|spiffs, ring, scrub [status], df, df warn <pct|off>, rename <num> <name>, time [unix_ms], ping <unix_ms>, tc [HH:MM:SS:FF] [fps] [df], stats, stats json, stats reset, stats heap, stats boot, trace dump, trace clear, bench [n], bench fs [kb], bench trace, selftest, menu");
     Serial.println("Type 'menu' to return to main menu.");
     listStoredFiles();
-  } else if (choice == '3') {
+  } else if (choice == "3") {
     currentMode = 3;
     Serial.println("BLE Connect/Pair selected.");
   } else {
@@ -298,41 +3380,462 @@ void selectMode() {
 
 // Send a Volume Up keypress via BLE Keyboard
 void sendVolumeUp() {
+  uint32_t mark = heapMark();
   if (bleKeyboard.isConnected()) {
     Serial.println("Sending Volume Up...");
+    traceBegin(TRACE_BLE);
     bleKeyboard.press(KEY_MEDIA_VOLUME_UP);
     delay(100);
     bleKeyboard.release(KEY_MEDIA_VOLUME_UP);
+    traceEnd(TRACE_BLE);
     Serial.println("Volume Up sent.");
   } else {
     Serial.println("BLE keyboard not connected; cannot send Volume Up.");
   }
+  heapAccount(HEAP_BLE, mark);
 }
 
-// BLE Connect/Pair Mode (Option 3)
+// BLE Connect/Pair Mode (Option 3), polled from loop()
 void bleMode() {
-  if (!bleKeyboard.isConnected()) {
-    bleKeyboard.begin();
-    Serial.println("BLE Keyboard started. Waiting for iOS to connect...");
+  if (!bleModeStarted) {
+    if (!bleKeyboard.isConnected()) {
+      bleKeyboard.begin();
+      Serial.println("BLE Keyboard started. Waiting for iOS to connect...");
+    }
+    Serial.println("Type 'menu' to return to main menu.");
+    bleModeStarted = true;
+    bleReported = false;
   }
-  Serial.println("Type 'menu' to return to main menu.");
-  
-  while (true) {
-    if (bleKeyboard.isConnected()) {
-      preferences.putBool("paired", true);
-      Serial.println("BLE keyboard is connected to iOS!");
+  if (bleKeyboard.isConnected() && !bleReported) {
+    configSetPaired(true);
+    Serial.println("BLE keyboard is connected to iOS!");
+    bleReported = true;
+  }
+  if (Serial.available()) {
+    String cmd = readSerialLine();
+    cmd.trim();
+    if (cmd.equalsIgnoreCase("menu")) {
+      bleKeyboard.end();
+      bleModeStarted = false;
+      enterMenu();
     }
-    if (Serial.available()) {
-      String cmd = Serial.readStringUntil('\n');
-      cmd.trim();
-      if (cmd.equalsIgnoreCase("menu")) {
-        bleKeyboard.end();
-        currentMode = 0;
-        return;
+  }
+}
+
+// =========== Session Control ===========
+
+// Point capture at a new file whose time zero is startUs
+void beginSegment(SessionSlot &s, const String &path, usec_t startUs) {
+  s.fileName = path;
+  pressStateInit(s.press, startUs);
+  s.markerCount = 0;
+  s.segmentEvents = 0;
+  s.segmentIdle = false;
+  s.lastActivity = startUs;
+  // A name reused before the collector got to it must start empty
+  if (storageReady && isDeletedFile(path)) {
+    SPIFFS.remove(path);
+  }
+  s.ringSession = (config.ringStore && ringPartition) ? ringNextSession++ : 0;
+  ringOpenSession(s.ringSession);
+  s.hash = checksum32(nullptr, 0);
+  s.hashValid = true;
+  s.meta.ringSession = s.ringSession;
+  catalogueAdd(path, s.meta, true);
+  // Claim the file now so the first press does not pay for creating it
+  if (storageReady && !discardWrites) {
+    openSessionFile(s, path);
+  }
+  if (wallClockSynced) {
+    writeRecord(s, makeSyncRecord(s, s.press.start));
+  }
+  EventRecord timecodeRecord;
+  if (makeTimecodeRecord(s, timecodeRecord)) {
+    writeRecord(s, timecodeRecord);
+  }
+}
+
+// Begin recording into the given file
+void startSession(const String &path) {
+  activeSlot = 0;
+  SessionSlot &s = slots[0];
+  s = SessionSlot();
+  s.open = true;
+  s.meta = currentMeta;
+  sessionActive = true;
+  awaitingSessionName = false;
+  beginSegment(s, path, clockNowUs());
+  s.segmentBase = path.substring(0, path.length() - strlen(SESSION_EXTENSION));
+  s.segmentNumber = 1;
+  checkpointSave(s);
+  statAdd(stats.sessionsStarted, 1);
+  Serial.println("Session started: " + s.fileName);
+  // Send Volume Up at session start if BLE is connected
+  sendVolumeUp();
+  // Ignore frames for one debounce window after the session starts
+  clearPressQueue();
+  lastAcceptedPressTime = clockNowUs();
+}
+
+// Next unused "<logFileBase><N>". The counter is committed right away so a
+// reset cannot hand out the same name twice.
+bool nextAutoSessionPath(String &path) {
+  for (int attempt = 0; attempt < 100; attempt++) {
+    configSetSessionCounter(config.sessionCounter + 1);
+    if (!buildSessionFileName(config.logBase + String(config.sessionCounter), path)) {
+      Serial.println("Log file base too long for auto-numbered sessions.");
+      return false;
+    }
+    if (storageReady && SPIFFS.exists(path)) continue;
+    configCommit();
+    return true;
+  }
+  Serial.println("No free auto-numbered session name.");
+  return false;
+}
+
+// Start a session under the next auto-numbered name
+bool startAutoSession() {
+  String path;
+  if (!nextAutoSessionPath(path)) return false;
+  startSession(path);
+  return true;
+}
+
+// Close the segment after config.idleSplitSec without presses. The session
+// stays active; the next press opens the following segment.
+void closeIdleSegment(SessionSlot &s) {
+  writeDriftRecord(s);
+  sealSegment(s);
+  s.segmentIdle = true;
+  closeSessionFile(s);
+  checkpointSave(s);
+  Serial.printf("No presses for %u s, segment closed: %s\n", (unsigned)config.idleSplitSec, s.fileName.c_str());
+  prepareNextSegment(s);
+}
+
+// Claim and open the next segment's file while idle, so the press that
+// reopens capture only appends. Ring segments get their session number at
+// that press, so they keep claiming then.
+void prepareNextSegment(SessionSlot &s) {
+  if (!storageReady || discardWrites || (config.ringStore && ringPartition)) return;
+  String path;
+  if (!buildSessionFileName(s.segmentBase + "-" + String(s.segmentNumber + 1), path)) return;
+  if (SPIFFS.exists(path)) {
+    // Only a file left prepared before a reset may be taken over
+    if (catalogueFind(path) >= 0) return;
+    File file = SPIFFS.open(path, FILE_READ);
+    bool empty = file && file.size() == SESSION_HEADER_SIZE;
+    file.close();
+    if (!empty) return;
+  }
+  openSessionFile(s, path);
+}
+
+// Drop a prepared file the session never used
+void discardPreparedSegment(SessionSlot &s) {
+  if (!s.segmentIdle || s.filePath.length() == 0 || s.filePath == s.fileName) return;
+  String path = s.filePath;
+  closeSessionFile(s);
+  SPIFFS.remove(path);
+}
+
+// Store the checksum of the records as they were written; scrub compares the
+// file against it from then on
+void sealSegment(SessionSlot &s) {
+  if (!s.hashValid || s.ringSession != 0 || discardWrites) return;
+  int index = catalogueFind(s.fileName);
+  if (index < 0) return;
+  catalogue[index].checksum = s.hash;
+  catalogue[index].flags |= MANIFEST_SEALED;
+  catalogueDirty = true;
+}
+
+// "<session>-<n>" for the next segment, or an auto-numbered name if that is too long
+void openNextSegment(SessionSlot &s, usec_t pressTime) {
+  String path;
+  s.segmentNumber++;
+  if (!buildSessionFileName(s.segmentBase + "-" + String(s.segmentNumber), path) || (storageReady && SPIFFS.exists(path) && path != s.filePath)) {
+    discardPreparedSegment(s);
+    if (!nextAutoSessionPath(path)) {
+      // Out of names: reopen this segment on its own time base rather than lose presses
+      s.segmentNumber--;
+      s.segmentIdle = false;
+      int index = catalogueFind(s.fileName);
+      if (index >= 0) {
+        catalogue[index].flags &= ~MANIFEST_SEALED;
+        catalogueDirty = true;
       }
+      checkpointSave(s);
+      Serial.println("No free name for a new segment; continuing " + s.fileName + " instead.");
+      return;
     }
-    delay(100);
   }
+  beginSegment(s, path, pressTime > SPLIT_PREROLL_US ? pressTime - SPLIT_PREROLL_US : 0);
+  checkpointSave(s);
+  Serial.println("Segment started: " + s.fileName);
+}
+
+void endSession() {
+  closeSlots();
+  SessionSlot &s = slots[0];
+  Serial.println("Session ended: " + s.fileName);
+  // Send Volume Up at session end if BLE is connected
+  sendVolumeUp();
+  if (!s.segmentIdle) {
+    writeDriftRecord(s);
+    sealSegment(s);
+  }
+  // Automatically save the file (always saved)
+  Serial.println("File saved.");
+  configCommit();
+  sessionActive = false;
+  s.open = false;
+  discardPreparedSegment(s);
+  s.segmentIdle = false;
+  closeSessionFile(s);
+  checkpointClear();
+  s.fileName = "";
+}
+
+// =========== Session Slots ===========
+
+// The open slot logging to `path`, if any
+SessionSlot *slotForFile(const String &path) {
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (slots[i].open && path == slots[i].fileName) return &slots[i];
+  }
+  return nullptr;
+}
+
+// Start an auto-named session in a free slot and focus it
+bool openSlot(int slot, uint16_t address) {
+  String path;
+  if (!nextAutoSessionPath(path)) return false;
+  SessionSlot &s = slots[slot];
+  s = SessionSlot();
+  s.open = true;
+  s.address = address;
+  s.meta = currentMeta;
+  if (address != ADDRESS_NONE) {
+    snprintf(s.meta.remote, sizeof(s.meta.remote), "%04X", (unsigned)address);
+  }
+  beginSegment(s, path, clockNowUs());
+  s.segmentBase = path.substring(0, path.length() - strlen(SESSION_EXTENSION));
+  s.segmentNumber = 1;
+  checkpointSave(s);
+  activeSlot = slot;
+  Serial.printf("Session slot %d started: %s\n", slot + 1, path.c_str());
+  return true;
+}
+
+// Slot for a press when routing by remote: the remote's own slot, a new one,
+// or slot 0 once all are taken. Otherwise the focused slot.
+int slotForEvent(const IrEvent &event) {
+  if (!config.routeByRemote) return activeSlot;
+  if (slots[0].address == ADDRESS_NONE) {
+    slots[0].address = event.address;
+    checkpointSave(slots[0]);
+  }
+  int freeSlot = -1;
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (slots[i].open && slots[i].address == event.address) return i;
+    if (!slots[i].open && freeSlot < 0) freeSlot = i;
+  }
+  if (freeSlot >= 0 && openSlot(freeSlot, event.address)) return freeSlot;
+  return 0;
+}
+
+// End every slot but 0, leaving slot 0 in focus
+void closeSlots() {
+  for (int i = 1; i < MAX_SESSIONS; i++) {
+    SessionSlot &s = slots[i];
+    if (!s.open) continue;
+    if (!s.segmentIdle) {
+      writeDriftRecord(s);
+      sealSegment(s);
+    }
+    discardPreparedSegment(s);
+    closeSessionFile(s);
+    s.open = false;
+    checkpointClearSlot(s);
+    Serial.println("Session slot " + String(i + 1) + " ended: " + s.fileName);
+  }
+  activeSlot = 0;
+}
+
+// Sync and timecode records are relative to a segment's start, so every
+// open slot gets its own copy; idle segments pick them up when they reopen
+void writeClockRecords(usec_t deviceUs, bool sync, bool timecode) {
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    SessionSlot &s = slots[i];
+    if (!s.open || s.segmentIdle) continue;
+    if (sync) {
+      writeRecord(s, makeSyncRecord(s, deviceUs));
+    }
+    EventRecord record;
+    if (timecode && makeTimecodeRecord(s, record)) {
+      writeRecord(s, record);
+    }
+  }
+}
+
+void printSlots() {
+  if (!sessionActive) {
+    Serial.println("No session active.");
+    return;
+  }
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (!slots[i].open) continue;
+    Serial.printf("%c slot %d: %s", i == activeSlot ? '*' : ' ', i + 1, slots[i].fileName.c_str());
+    if (slots[i].address != ADDRESS_NONE) {
+      Serial.printf(" (remote %04X)", (unsigned)slots[i].address);
+    }
+    Serial.println();
+  }
+}
+
+// =========== Session Checkpoint ===========
+
+static int slotIndex(const SessionSlot &s) {
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    if (&slots[i] == &s) return i;
+  }
+  return -1;
+}
+
+static uint32_t checkpointHeaderChecksum() {
+  return checksum32(&checkpoint, offsetof(SessionCheckpoint, checksum));
+}
+
+static bool checkpointSlotValid(const SlotCheckpoint &entry) {
+  return entry.magic == CHECKPOINT_MAGIC &&
+         entry.checksum == checksum32(&entry, offsetof(SlotCheckpoint, checksum));
+}
+
+// Mirror a slot's state after every event. Scratch slots (bench, self-test)
+// are not checkpointed.
+void checkpointSave(const SessionSlot &s) {
+  int slot = slotIndex(s);
+  if (slot < 0) return;
+  if (checkpoint.magic != CHECKPOINT_MAGIC || checkpoint.checksum != checkpointHeaderChecksum()) {
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.magic = CHECKPOINT_MAGIC;
+    checkpoint.checksum = checkpointHeaderChecksum();
+  }
+  SlotCheckpoint &entry = checkpoint.slots[slot];
+  memset(&entry, 0, sizeof(entry));
+  entry.magic = CHECKPOINT_MAGIC;
+  strncpy(entry.path, s.fileName.c_str(), MAX_PATH_LENGTH);
+  strncpy(entry.segmentBase, s.segmentBase.c_str(), MAX_PATH_LENGTH);
+  entry.address = s.address;
+  entry.segmentNumber = s.segmentNumber;
+  entry.trackIndex = s.press.track;
+  entry.markerCount = s.markerCount;
+  entry.segmentEvents = s.segmentEvents;
+  entry.segmentIdle = s.segmentIdle;
+  entry.ringSession = s.ringSession;
+  entry.lastClipTime = s.press.lastClip;
+  entry.lastSeenUs = clockNowUs() - s.press.start;
+  entry.checksum = checksum32(&entry, offsetof(SlotCheckpoint, checksum));
+  lastHeartbeatTime = clockNowUs();
+}
+
+// A slot ended on its own; the rest of the session stays resumable
+void checkpointClearSlot(const SessionSlot &s) {
+  int slot = slotIndex(s);
+  if (slot >= 0) checkpoint.slots[slot].magic = 0;
+}
+
+void checkpointClear() {
+  checkpoint.magic = 0;
+}
+
+// Advance every open slot's last-seen time so a reset loses at most one
+// heartbeat. Once a resumed session has run RESUME_STABLE_US the resume
+// counts as held.
+void checkpointTick() {
+  if (!sessionActive || clockNowUs() - lastHeartbeatTime < CHECKPOINT_HEARTBEAT_US) return;
+  for (int i = 0; i < MAX_SESSIONS; i++) {
+    SlotCheckpoint &entry = checkpoint.slots[i];
+    if (!slots[i].open || entry.magic != CHECKPOINT_MAGIC) continue;
+    entry.lastSeenUs = clockNowUs() - slots[i].press.start;
+    entry.checksum = checksum32(&entry, offsetof(SlotCheckpoint, checksum));
+  }
+  if (checkpoint.resumeCount > 0 && (usec_t)esp_timer_get_time() >= RESUME_STABLE_US) {
+    checkpoint.resumeCount = 0;
+    checkpoint.checksum = checkpointHeaderChecksum();
+  }
+  lastHeartbeatTime = clockNowUs();
+}
+
+// Rebuild one slot from its entry. Session time continues from the last
+// heartbeat plus the time since boot; a gap record marks the seam.
+static uint32_t resumeSlot(int slot, usec_t bootUs) {
+  SlotCheckpoint &entry = checkpoint.slots[slot];
+  entry.path[MAX_PATH_LENGTH] = '\0';
+  entry.segmentBase[MAX_PATH_LENGTH] = '\0';
+  usec_t resumeTime = entry.lastSeenUs + bootUs;
+  SessionSlot &s = slots[slot];
+  s = SessionSlot();
+  s.open = true;
+  s.address = entry.address;
+  s.fileName = entry.path;
+  s.segmentBase = entry.segmentBase;
+  s.segmentNumber = entry.segmentNumber;
+  s.press.track = entry.trackIndex;
+  s.markerCount = entry.markerCount;
+  s.segmentEvents = entry.segmentEvents;
+  s.segmentIdle = entry.segmentIdle;
+  s.ringSession = entry.ringSession;
+  s.hashValid = false;
+  if (s.segmentIdle) prepareAfterResume = true;
+  // Its entries may all have been in the page buffer when the reset hit
+  if (s.ringSession >= ringNextSession) ringNextSession = s.ringSession + 1;
+  s.press.lastClip = entry.lastClipTime;
+  // Wraps below zero on purpose; session times are differences of usec_t
+  s.press.start = bootUs - resumeTime;
+  s.lastActivity = bootUs;
+  uint32_t gapMs = (uint32_t)((CHECKPOINT_HEARTBEAT_US + bootUs) / 1000);
+  EventRecord record = {resumeTime, REC_GAP, 0, 0, 0, gapMs};
+  if (!s.segmentIdle) {
+    writeRecord(s, record);
+  }
+  checkpointSave(s);
+  return gapMs;
+}
+
+// Pick up a session interrupted by a reset, with every slot that was open
+bool resumeFromCheckpoint() {
+  if (checkpoint.magic != CHECKPOINT_MAGIC || checkpoint.checksum != checkpointHeaderChecksum() ||
+      !checkpointSlotValid(checkpoint.slots[0])) {
+    return false;
+  }
+  checkpoint.slots[0].path[MAX_PATH_LENGTH] = '\0';
+  // A crash that comes back soon after every resume would otherwise boot-loop
+  if (checkpoint.resumeCount >= RESUME_MAX_STALLED) {
+    Serial.printf("Not resuming %s: it reset again after each of the last %u resumes. Checkpoint cleared.\n",
+                  checkpoint.slots[0].path, (unsigned)checkpoint.resumeCount);
+    checkpointClear();
+    resumeAbandoned = true;
+    return false;
+  }
+  checkpoint.resumeCount++;
+  checkpoint.checksum = checkpointHeaderChecksum();
+  usec_t bootUs = clockNowUs();
+  currentMode = 1;
+  sessionActive = true;
+  awaitingSessionName = false;
+  activeSlot = 0;
+  uint32_t gapMs = resumeSlot(0, bootUs);
+  Serial.printf("Resumed session %s after a reset (up to %u ms unrecorded)\n", slots[0].fileName.c_str(),
+                (unsigned)gapMs);
+  for (int i = 1; i < MAX_SESSIONS; i++) {
+    if (!checkpointSlotValid(checkpoint.slots[i])) continue;
+    resumeSlot(i, bootUs);
+    Serial.printf("Resumed session slot %d: %s\n", i + 1, slots[i].fileName.c_str());
+  }
+  return true;
 }
 
 // =========== IR Mode Loop ===========
@@ -340,65 +3843,84 @@ void bleMode() {
 void irModeLoop() {
   if (!sessionActive) {
     if (!awaitingSessionName) {
-      Serial.println("Enter file name for new session (or type 'menu' to return to menu):");
+      Serial.println("Enter file name for new session, or press Enter for " + config.logBase +
+                     String(config.sessionCounter + 1) + " (or type 'menu' to return to menu):");
       awaitingSessionName = true;
     }
     if (Serial.available()) {
-      String input = Serial.readStringUntil('\n');
+      uint32_t mark = heapMark();
+      String input = readSerialLine();
       input.trim();
       if (input.equalsIgnoreCase("menu")) {
         awaitingSessionName = false;
-        selectMode();
+        enterMenu();
+        return;
+      }
+      if (handleSharedCommand(input)) {
+        return;
+      }
+      // An empty line takes the next auto-numbered name
+      if (input.length() == 0) {
+        startAutoSession();
+        heapAccount(HEAP_SESSION, mark);
+        return;
+      }
+      String path;
+      if (!buildSessionFileName(input, path)) {
+        Serial.println("Invalid session name. Use letters, digits, '_', '-' or '.' (max 26 chars).");
         return;
       }
-      if (input.charAt(0) != '/') {
-        input = "/" + input;
-      }
-      currentFileName = input + ".txt";
-      sessionActive = true;
-      awaitingSessionName = false;
-      timestampStart = millis();
-      lastClipTime = 0;
-      currentTrackIndex = 1;
-      Serial.println("Session started: " + currentFileName);
-      // Send Volume Up at session start if BLE is connected
-      sendVolumeUp();
-      while (IrReceiver.decode()) { IrReceiver.resume(); }
-      delay(500);
+      startSession(path);
+      heapAccount(HEAP_SESSION, mark);
     }
   } else {
-    // Session is active—record IR commands
-    if (IrReceiver.decode()) {
-      uint32_t cmd = IrReceiver.decodedIRData.command;
-      handleButtonPress(cmd);
-      delay(500);
-      IrReceiver.resume();
+    // Session is active—record queued IR presses
+    IrEvent event;
+    while (popPress(event)) {
+      uint32_t mark = heapMark();
+      // The select key moves focus to the next slot, opening it if needed
+      if (event.command == config.selectKey) {
+        if (config.routeByRemote) {
+          Serial.println("Select key ignored: each remote has its own slot while 'route remote' is on.");
+          continue;
+        }
+        int next = (activeSlot + 1) % MAX_SESSIONS;
+        if (slots[next].open) {
+          activeSlot = next;
+          Serial.println("Session slot " + String(next + 1) + ": " + slots[next].fileName);
+        } else {
+          openSlot(next, ADDRESS_NONE);
+        }
+        continue;
+      }
+      activeSlot = slotForEvent(event);
+      SessionSlot &s = slots[activeSlot];
+      if (s.segmentIdle) {
+        openNextSegment(s, event.timeUs);
+      }
+      traceBegin(TRACE_CAPTURE);
+      handleButtonPress(s, event);
+      traceEnd(TRACE_CAPTURE);
+      heapAccount(HEAP_IR, mark);
+    }
+    if (config.idleSplitSec > 0) {
+      usec_t idleUs = (usec_t)config.idleSplitSec * 1000000ULL;
+      for (int i = 0; i < MAX_SESSIONS; i++) {
+        SessionSlot &s = slots[i];
+        if (s.open && !s.segmentIdle && s.segmentEvents > 0 && clockNowUs() - s.lastActivity >= idleUs) {
+          closeIdleSegment(s);
+        }
+      }
     }
     // Check if user typed "end" to finish session
     if (Serial.available()) {
-      String input = Serial.readStringUntil('\n');
+      String input = readSerialLine();
       input.trim();
-      if (input.equalsIgnoreCase("end")) {
-        Serial.println("Session ended: " + currentFileName);
-        // Send Volume Up at session end if BLE is connected
-        sendVolumeUp();
-        // Automatically save the file (always saved)
-        Serial.println("File saved.");
-        sessionActive = false;
-        currentFileName = "";
-        Serial.println("Type 'menu' to return to main menu, or press Enter to start a new session.");
-        unsigned long startTime = millis();
-        while ((millis() - startTime) < 3000) {
-          if (Serial.available()) {
-            String menuDecision = Serial.readStringUntil('\n');
-            menuDecision.trim();
-            if (menuDecision.equalsIgnoreCase("menu")) {
-              selectMode();
-              return;
-            }
-          }
-          delay(100);
-        }
+      if (handleSharedCommand(input)) {
+        // Clock sync or metadata for the next session
+      } else if (input.equalsIgnoreCase("end")) {
+        // The name prompt that follows also takes 'menu'
+        endSession();
       }
     }
   }
@@ -406,26 +3928,61 @@ void irModeLoop() {
 
 // =========== Setup & Loop ===========
 void setup() {
-  Serial.begin(115200);
+  // Arm IR capture first; everything else can happen while it records
   IrReceiver.begin(IR_RECEIVE_PIN, ENABLE_LED_FEEDBACK);
-  initFileSystem();
-  
-  preferences.begin("my-app", false);
-  logFileBase = preferences.getString("logBase", "/premiere_log");
-  Serial.println("Log file base loaded: " + logFileBase);
-  
-  selectMode();
+  markBootPhase(BOOT_IR_ARMED);
+  Serial.begin(115200);
+  markBootPhase(BOOT_SERIAL);
+
+  // NVS is quick to read and names the auto-started session
+  configLoad();
+  currentMeta.deviceId = (uint32_t)(ESP.getEfuseMac() >> 16);
+  // The ring needs no filesystem, so a resumed session can log right away
+  ringInit();
+  markBootPhase(BOOT_PREFS_LOADED);
+  Serial.println("Log file base loaded: " + config.logBase);
+
+  // SPIFFS mounts in the background; session lines are held in RAM until it finishes
+  xTaskCreatePinnedToCore(storageInitTask, "storageInit", 4096, NULL, 1, NULL, 0);
+  if (resumeFromCheckpoint()) {
+    // Interrupted session picked up; its records wait in RAM for the mount
+  } else if (config.autoStart && !resumeAbandoned) {
+    currentMode = 1;
+    startAutoSession();
+  }
+  markBootPhase(BOOT_SETUP_DONE);
+  // loop() shows the menu while currentMode is 0
 }
 
 void loop() {
+  pollIrReceiver();
+  flushPendingRecords();
+  spareRefillTick();
+  ringTick();
+  checkpointTick();
+  catalogueTick();
+  garbageCollectTick();
+  scrubTick();
+  storageWarningTick();
+  configTick();
+  heapTrackerTick();
   if (currentMode == 0) {
     selectMode();
   } else if (currentMode == 1) {
     irModeLoop();
   } else if (currentMode == 2) {
     if (Serial.available()) {
-      String input = Serial.readStringUntil('\n');
+      uint32_t mark = heapMark();
+      String input = readSerialLine();
+      input.trim();
+      uint32_t startUs = micros();
       handleSerialCommand(input);
+      uint32_t elapsedUs = micros() - startUs;
+      if (elapsedUs > commandMaxUs) {
+        commandMaxUs = elapsedUs;
+        slowestCommand = input.substring(0, 24);
+      }
+      heapAccount(HEAP_SERIAL, mark);
     }
   } else if (currentMode == 3) {
     bleMode();
@@ -0,0 +1,176 @@
+// Host counterpart of the firmware's 'bench': the capture path's stages
+// timed on a replayed trace, with every heap allocation counted. The
+// device numbers include SPIFFS; here the flash stage is the cost model,
+// so ns/event is host CPU time and flash_us/ev is modelled device time.
+#include <FlashModel.h>
+#include <SessionCapture.h>
+#include <TraceGenerator.h>
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+#define BENCH_EVENTS 200000
+#define BENCH_SEED 1
+#define BENCH_FSCAL                                                                                           \
+  "FSCAL fill=40.0 open_create_us=9000 open_append_us=3000 record_append_us=40 page_write_us=900 "          \
+  "close_us=1500 remove_us=6000 erase_us=30000 pages=256 stalls=8 stall_avg_us=40000"
+
+static size_t allocatedBlocks = 0;
+static size_t allocatedBytes = 0;
+
+void *operator new(size_t size) {
+  allocatedBlocks++;
+  allocatedBytes += size;
+  void *p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+void setUp(void) {}
+void tearDown(void) {}
+
+struct BenchResult {
+  const char *name;
+  uint64_t ns;
+  size_t allocBlocks;                // Every allocation, freed or not
+  size_t allocBytes;
+  uint64_t written;                  // Bytes handed to storage
+  uint64_t flashUs;                  // Modelled device time in storage
+};
+
+static TracePress trace[BENCH_EVENTS];
+static EventRecord records[BENCH_EVENTS];
+static bool logged[BENCH_EVENTS];
+static FlashCosts costs;
+
+// The firmware's state for one session: acceptPress() debounces, then
+// handleButtonPress() -> logCommand() run capturePress() and pressRecord()
+struct CaptureState {
+  usec_t lastAcceptedUs;
+  PressState press;
+};
+
+static bool captureDecide(CaptureState &state, const TracePress &press, int &keyIndex, PressKind &kind) {
+  if (!debounceAccept(state.lastAcceptedUs, press.timeUs)) return false;
+  kind = capturePress(state.press, press.command, press.repeat, keyIndex);
+  return kind != PRESS_SUPPRESS;
+}
+
+static void captureInit(CaptureState &state) {
+  state.lastAcceptedUs = trace[0].timeUs - PRESS_DEBOUNCE_US;
+  pressStateInit(state.press, trace[0].timeUs);
+}
+
+static BenchResult runStage(int stage) {
+  static const char *const names[] = {"BM_captureDecision", "BM_recordBuild", "BM_flashAppend", "BM_endToEnd"};
+  BenchResult r = {names[stage], 0, 0, 0, 0, 0};
+  CaptureState state;
+  captureInit(state);
+  FlashModel model;
+  flashModelInit(model, costs, 1378241, 0);
+  flashOpen(model, true);
+  uint64_t flashBefore = model.elapsedUs;
+  volatile uint32_t sink = 0;
+  size_t blocksBefore = allocatedBlocks, bytesBefore = allocatedBytes;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < BENCH_EVENTS; i++) {
+    int keyIndex = 0;
+    PressKind kind = PRESS_TAP;
+    switch (stage) {
+      case 0:
+        sink = sink + captureDecide(state, trace[i], keyIndex, kind);
+        break;
+      case 1:
+        if (!logged[i]) break;
+        records[i] = pressRecord(state.press, records[i].key,
+                                 (records[i].flags & REC_FLAG_HOLD) ? PRESS_HOLD : PRESS_TAP, trace[i].timeUs);
+        // The ring log checks every entry the same way
+        sink = sink ^ checksum32(&records[i], sizeof(records[i]));
+        break;
+      case 2:
+        if (!logged[i]) break;
+        flashAppend(model, sizeof(EventRecord));
+        r.written += sizeof(EventRecord);
+        break;
+      case 3:
+        if (!captureDecide(state, trace[i], keyIndex, kind)) break;
+        {
+          EventRecord record = pressRecord(state.press, keyIndex, kind, trace[i].timeUs);
+          sink = sink ^ checksum32(&record, sizeof(record));
+        }
+        flashAppend(model, sizeof(EventRecord));
+        r.written += sizeof(EventRecord);
+        break;
+    }
+  }
+  r.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  r.allocBlocks = allocatedBlocks - blocksBefore;
+  r.allocBytes = allocatedBytes - bytesBefore;
+  r.flashUs = model.elapsedUs - flashBefore;
+  return r;
+}
+
+void test_capture_path_allocates_nothing(void) {
+  // Which trace events get logged, so the later stages see the same ones
+  CaptureState state;
+  captureInit(state);
+  for (int i = 0; i < BENCH_EVENTS; i++) {
+    int keyIndex = 0;
+    PressKind kind = PRESS_TAP;
+    logged[i] = captureDecide(state, trace[i], keyIndex, kind);
+    records[i].key = (uint8_t)keyIndex;
+    records[i].flags = kind == PRESS_HOLD ? REC_FLAG_HOLD : 0;
+  }
+
+  BenchResult results[4];
+  for (int stage = 0; stage < 4; stage++) {
+    results[stage] = runStage(stage);
+  }
+  char line[128];
+  snprintf(line, sizeof(line), "Benchmark: %d events/stage, seed %d", BENCH_EVENTS, BENCH_SEED);
+  TEST_MESSAGE(line);
+  snprintf(line, sizeof(line), "%-22s %10s %10s %10s %10s %12s", "Benchmark", "ns/event", "allocs/ev", "allocB/ev",
+           "bytes/ev", "flash_us/ev");
+  TEST_MESSAGE(line);
+  for (const BenchResult &r : results) {
+    snprintf(line, sizeof(line), "%-22s %10.1f %10.2f %10.2f %10.1f %12.1f", r.name, (double)r.ns / BENCH_EVENTS,
+             (double)r.allocBlocks / BENCH_EVENTS, (double)r.allocBytes / BENCH_EVENTS,
+             (double)r.written / BENCH_EVENTS, (double)r.flashUs / BENCH_EVENTS);
+    TEST_MESSAGE(line);
+  }
+  for (const BenchResult &r : results) {
+    TEST_ASSERT_EQUAL_UINT32(0, r.allocBlocks);
+  }
+  // End to end stores exactly what the stages store
+  TEST_ASSERT_EQUAL_UINT64(results[2].written, results[3].written);
+  TEST_ASSERT_EQUAL_UINT64(results[2].flashUs, results[3].flashUs);
+}
+
+// The counter itself works, or a zero above would mean nothing
+void test_allocation_counter(void) {
+  size_t before = allocatedBlocks;
+  char *volatile p = new char[40];
+  delete[] p;
+  TEST_ASSERT_EQUAL_UINT32(before + 1, allocatedBlocks);
+}
+
+int main(void) {
+  parseFsCal(BENCH_FSCAL, strlen(BENCH_FSCAL), costs);
+  TraceGenerator gen;
+  traceGenInit(gen, BENCH_SEED);
+  for (int i = 0; i < BENCH_EVENTS; i++) {
+    trace[i] = traceGenNext(gen);
+  }
+  UNITY_BEGIN();
+  RUN_TEST(test_allocation_counter);
+  RUN_TEST(test_capture_path_allocates_nothing);
+  return UNITY_END();
+}
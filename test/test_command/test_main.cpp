@@ -0,0 +1,116 @@
+// The serial command parser handleSerialCommand() dispatches on
+#include <SessionCommand.h>
+#include <string.h>
+#include <unity.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static Command parse(const char *text, int fileCount = 3) {
+  CommandContext context = {fileCount, {25, false, false}, {}};
+  Command command;
+  parseCommand(text, strlen(text), context, command);
+  return command;
+}
+
+void test_key_arguments(void) {
+  Command command = parse("startkey ok");
+  TEST_ASSERT_EQUAL(CMD_STARTKEY, command.id);
+  TEST_ASSERT_TRUE(command.valid);
+  TEST_ASSERT_EQUAL(25, command.number);
+  command = parse("markerkey off");
+  TEST_ASSERT_EQUAL(CMD_MARKERKEY, command.id);
+  TEST_ASSERT_EQUAL(KEY_NONE, command.number);
+  command = parse("selectkey 71");
+  TEST_ASSERT_TRUE(command.valid);
+  TEST_ASSERT_EQUAL(71, command.number);
+  TEST_ASSERT_FALSE(parse("selectkey 65535").valid);
+  TEST_ASSERT_FALSE(parse("startkey okay").valid);
+}
+
+void test_defaults_when_bare(void) {
+  Command command = parse("align");
+  TEST_ASSERT_EQUAL(CMD_ALIGN, command.id);
+  TEST_ASSERT_EQUAL(1, command.number);
+  command = parse("bench");
+  TEST_ASSERT_EQUAL(CMD_BENCH, command.id);
+  TEST_ASSERT_EQUAL(200, command.number);
+  command = parse("bench fs");
+  TEST_ASSERT_EQUAL(CMD_BENCH_FS, command.id);
+  TEST_ASSERT_EQUAL(64, command.number);
+  command = parse("selftest");
+  TEST_ASSERT_EQUAL(CMD_SELFTEST, command.id);
+  TEST_ASSERT_EQUAL_UINT32(1, command.seed);
+  TEST_ASSERT_EQUAL(5000, command.events);
+  TEST_ASSERT_EQUAL(CMD_DELETE_ALL, parse("delete").id);
+  TEST_ASSERT_EQUAL(CMD_LIST, parse("  list  ").id);
+}
+
+void test_file_numbers_follow_the_listing(void) {
+  TEST_ASSERT_TRUE(parse("send 3").valid);
+  TEST_ASSERT_FALSE(parse("send 4").valid);
+  TEST_ASSERT_FALSE(parse("delete 0").valid);
+  TEST_ASSERT_FALSE(parse("delete 1", 0).valid);
+  TEST_ASSERT_EQUAL(CMD_SEND_ALL, parse("send all").id);
+  Command command = parse("rename 2 take_two");
+  TEST_ASSERT_EQUAL(CMD_RENAME, command.id);
+  TEST_ASSERT_TRUE(command.valid);
+  TEST_ASSERT_EQUAL(2, command.number);
+  TEST_ASSERT_EQUAL(8, command.textLength);
+  TEST_ASSERT_EQUAL_MEMORY("take_two", command.text, 8);
+  TEST_ASSERT_FALSE(parse("rename 2").valid);
+}
+
+// A bad file number leaves number 0 so the reply can say which part was wrong
+void test_query_file_number(void) {
+  Command command = parse("query 2 count key=ok");
+  TEST_ASSERT_EQUAL(CMD_QUERY, command.id);
+  TEST_ASSERT_TRUE(command.valid);
+  TEST_ASSERT_EQUAL(2, command.number);
+  TEST_ASSERT_EQUAL(QUERY_COUNT, command.op);
+  command = parse("query 9 count");
+  TEST_ASSERT_FALSE(command.valid);
+  TEST_ASSERT_EQUAL(0, command.number);
+  command = parse("query 2 sum");
+  TEST_ASSERT_FALSE(command.valid);
+  TEST_ASSERT_EQUAL(2, command.number);
+}
+
+void test_shared_commands(void) {
+  TEST_ASSERT_TRUE(commandIsShared(parse("sessions").id));
+  TEST_ASSERT_TRUE(commandIsShared(parse("tc off").id));
+  Command command = parse("tc 01:00:00:00");
+  TEST_ASSERT_EQUAL(CMD_TC_SET, command.id);
+  TEST_ASSERT_TRUE(command.valid);
+  TEST_ASSERT_EQUAL_UINT32(90000, command.frame);
+  command = parse("meta scene=4 take=2");
+  TEST_ASSERT_EQUAL(CMD_META_SET, command.id);
+  TEST_ASSERT_TRUE(command.valid);
+  TEST_ASSERT_EQUAL_STRING("4", command.meta.scene);
+  TEST_ASSERT_EQUAL(META_SCENE | META_TAKE, command.fields);
+  TEST_ASSERT_FALSE(commandIsShared(parse("list").id));
+  TEST_ASSERT_FALSE(commandIsShared(parse("menu").id));
+}
+
+// Verbs that need an argument are unknown when bare, so the help is shown
+void test_unknown_lines(void) {
+  TEST_ASSERT_EQUAL(CMD_UNKNOWN, parse("").id);
+  TEST_ASSERT_EQUAL(CMD_UNKNOWN, parse("   ").id);
+  TEST_ASSERT_EQUAL(CMD_UNKNOWN, parse("frobnicate").id);
+  TEST_ASSERT_EQUAL(CMD_UNKNOWN, parse("startkey").id);
+  TEST_ASSERT_EQUAL(CMD_UNKNOWN, parse("query").id);
+  TEST_ASSERT_EQUAL(CMD_UNKNOWN, parse("ping").id);
+  TEST_ASSERT_EQUAL(CMD_UNKNOWN, parse("menu now").id);
+  TEST_ASSERT_EQUAL(CMD_UNKNOWN, parse("store flash").id);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_key_arguments);
+  RUN_TEST(test_defaults_when_bare);
+  RUN_TEST(test_file_numbers_follow_the_listing);
+  RUN_TEST(test_query_file_number);
+  RUN_TEST(test_shared_commands);
+  RUN_TEST(test_unknown_lines);
+  return UNITY_END();
+}
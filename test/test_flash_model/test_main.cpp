@@ -0,0 +1,199 @@
+// Write policies replayed against the flash cost model. The costs come from
+// an FSCAL line: set FSCAL to the one 'bench fs' printed on the device to
+// rank the policies for that board; the line below is only an example.
+#include <FlashModel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unity.h>
+
+#define EXAMPLE_FSCAL                                                                                         \
+  "FSCAL fill=40.0 open_create_us=9000 open_append_us=3000 record_append_us=40 page_write_us=900 "          \
+  "close_us=1500 remove_us=6000 erase_us=30000 pages=256 stalls=8 stall_avg_us=40000"
+#define MODEL_CAPACITY 1378241        // SPIFFS bytes on the default 1.5 MB partition
+#define MODEL_RECORDS 20000
+#define RING_ENTRY_SIZE 32            // RingEntry in main.cpp
+#define RING_HEADER_SIZE 32           // RingSectorHeader in main.cpp
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static FlashCosts calibrated;
+
+static bool parse(const char *line, FlashCosts &costs) {
+  return parseFsCal(line, strlen(line), costs);
+}
+
+enum WritePolicy { POLICY_OPEN_PER_RECORD, POLICY_FLUSH_PER_RECORD, POLICY_PAGE_BUFFERED, POLICY_RING, POLICY_COUNT };
+static const char *const policyNames[POLICY_COUNT] = {"open/append/close", "held open + flush", "page buffered",
+                                                      "ring partition"};
+
+// Modelled microseconds to store MODEL_RECORDS records
+static uint64_t replay(WritePolicy policy, FlashModel &model) {
+  const uint32_t recordSize = sizeof(EventRecord);
+  if (policy == POLICY_RING) {
+    const uint32_t entriesPerSector = (FLASH_SECTOR_SIZE - RING_HEADER_SIZE) / RING_ENTRY_SIZE;
+    uint32_t pageFill = 0;
+    for (uint32_t i = 0; i < MODEL_RECORDS; i++) {
+      if (i % entriesPerSector == 0) {
+        flashEraseRaw(model);
+        flashProgramRaw(model, RING_HEADER_SIZE);
+      }
+      pageFill += RING_ENTRY_SIZE;
+      if (pageFill == FLASH_PAGE_SIZE) {
+        flashProgramRaw(model, pageFill);
+        pageFill = 0;
+      }
+    }
+    if (pageFill) flashProgramRaw(model, pageFill);
+    return model.elapsedUs;
+  }
+  if (policy != POLICY_OPEN_PER_RECORD) flashOpen(model, true);
+  for (uint32_t i = 0; i < MODEL_RECORDS; i++) {
+    if (policy == POLICY_OPEN_PER_RECORD) flashOpen(model, i == 0);
+    flashAppend(model, recordSize);
+    if (policy == POLICY_OPEN_PER_RECORD) flashClose(model);
+    if (policy == POLICY_FLUSH_PER_RECORD) flashFlush(model);
+  }
+  if (policy != POLICY_OPEN_PER_RECORD) flashClose(model);
+  return model.elapsedUs;
+}
+
+static uint64_t replayPolicy(WritePolicy policy, float fill, FlashModel &model) {
+  flashModelInit(model, calibrated, MODEL_CAPACITY, (uint32_t)(MODEL_CAPACITY * fill));
+  return replay(policy, model);
+}
+
+void test_parse_fscal(void) {
+  FlashCosts costs;
+  TEST_ASSERT_TRUE(parse(EXAMPLE_FSCAL, costs));
+  TEST_ASSERT_FLOAT_WITHIN(0.01f, 40.0f, costs.fillPct);
+  TEST_ASSERT_EQUAL_UINT32(9000, costs.openCreateUs);
+  TEST_ASSERT_EQUAL_UINT32(900, costs.pageWriteUs);
+  TEST_ASSERT_EQUAL_UINT32(30000, costs.eraseUs);
+  TEST_ASSERT_EQUAL_UINT32(256, costs.pages);
+  TEST_ASSERT_EQUAL_UINT32(8, costs.stalls);
+  // Lines from before erase_us and the page count was printed
+  TEST_ASSERT_TRUE(parse("fill=70 open_create_us=1 open_append_us=2 record_append_us=3 page_write_us=4 "
+                         "close_us=5 remove_us=6 stalls=3 stall_avg_us=7",
+                         costs));
+  TEST_ASSERT_EQUAL_UINT32(7, costs.eraseUs);
+  TEST_ASSERT_EQUAL_UINT32(0, costs.stalls);
+
+  TEST_ASSERT_FALSE(parse("FSCAL fill=40 open_create_us=1", costs));
+  TEST_ASSERT_FALSE(parse("open_create_us=1 open_append_us=2 record_append_us=3 page_write_us=4 "
+                          "close_us=5 remove_us=6 stall_avg_us=7",
+                          costs));
+  TEST_ASSERT_FALSE(parse("fill=140 open_create_us=1 open_append_us=2 record_append_us=3 page_write_us=4 "
+                          "close_us=5 remove_us=6 stall_avg_us=7",
+                          costs));
+  TEST_ASSERT_FALSE(parse("fill=40 open_create_us=-1 open_append_us=2 record_append_us=3 page_write_us=4 "
+                          "close_us=5 remove_us=6 stall_avg_us=7",
+                          costs));
+  TEST_ASSERT_FALSE(parse("fill=40 open_create_us=1 open_append_us=2 record_append_us=3 page_write_us=4 "
+                          "close_us=5 remove_us=6 pages=4 stalls=5 stall_avg_us=7",
+                          costs));
+}
+
+void test_stall_rate_follows_fill(void) {
+  FlashModel model;
+  flashModelInit(model, calibrated, MODEL_CAPACITY, (uint32_t)(MODEL_CAPACITY * calibrated.fillPct / 100));
+  if (calibrated.stalls > 0) {
+    TEST_ASSERT_FLOAT_WITHIN(0.02f, (float)calibrated.stalls / calibrated.pages, flashStallRate(model));
+  }
+  float previous = -1;
+  for (int percent = 0; percent <= 100; percent += 5) {
+    flashModelInit(model, calibrated, MODEL_CAPACITY, MODEL_CAPACITY / 100 * percent);
+    float rate = flashStallRate(model);
+    TEST_ASSERT_TRUE(rate >= previous && rate <= 1);
+    previous = rate;
+  }
+  FlashCosts quiet = calibrated;
+  quiet.stalls = 0;
+  flashModelInit(model, quiet, MODEL_CAPACITY, MODEL_CAPACITY);
+  TEST_ASSERT_EQUAL_FLOAT(0, flashStallRate(model));
+}
+
+void test_buffered_appends_program_whole_pages(void) {
+  FlashModel model;
+  replayPolicy(POLICY_PAGE_BUFFERED, 0.2f, model);
+  uint32_t bytes = MODEL_RECORDS * sizeof(EventRecord);
+  TEST_ASSERT_EQUAL_UINT32((bytes + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE, model.programs);
+  TEST_ASSERT_EQUAL_UINT32(1, model.opens);
+  replayPolicy(POLICY_FLUSH_PER_RECORD, 0.2f, model);
+  TEST_ASSERT_EQUAL_UINT32(MODEL_RECORDS, model.programs);
+  replayPolicy(POLICY_RING, 0.2f, model);
+  TEST_ASSERT_EQUAL_UINT32(0, model.stalls);
+  const uint32_t entriesPerSector = (FLASH_SECTOR_SIZE - RING_HEADER_SIZE) / RING_ENTRY_SIZE;
+  TEST_ASSERT_EQUAL_UINT32((MODEL_RECORDS + entriesPerSector - 1) / entriesPerSector, model.erases);
+}
+
+// At the fill it was measured at, the model must give back what the device
+// measured. The expected figures are worked by hand from EXAMPLE_FSCAL's
+// per-operation costs, counting the operations each policy does per record;
+// 8 stalls in 256 page writes put 8/256 * 40000 = 1250 us of GC on each page.
+void test_model_reproduces_calibration(void) {
+  FlashCosts example;
+  TEST_ASSERT_TRUE(parse(EXAMPLE_FSCAL, example));
+  // A store large enough that the replay does not move its fill off 40%
+  const uint32_t capacity = 1000000000;
+  FlashModel model;
+
+  // bench fs itself: create, 256 page-sized writes, close
+  flashModelInit(model, example, capacity, capacity / 100 * 40);
+  flashOpen(model, true);
+  for (int i = 0; i < 256; i++) flashAppend(model, FLASH_PAGE_SIZE);
+  flashClose(model);
+  // 9000 + 256 * (40 + 900) + 8 * 40000 + 1500
+  TEST_ASSERT_EQUAL_UINT32(8, model.stalls);
+  TEST_ASSERT_EQUAL_UINT64(571140, model.elapsedUs);
+
+  static const struct {
+    WritePolicy policy;
+    double usPerRecord;
+  } expected[] = {
+    {POLICY_OPEN_PER_RECORD, 6690},    // open 3000 + append 40 + page 900 + GC 1250 + close 1500
+    {POLICY_FLUSH_PER_RECORD, 2190},   // append 40 + page 900 + GC 1250
+    {POLICY_PAGE_BUFFERED, 174.375},   // append 40 + 16/256 of (page 900 + GC 1250)
+    {POLICY_RING, 350.4},              // 32/256 of page 900 + 158 erases of 30000 and their headers
+  };
+  for (const auto &e : expected) {
+    flashModelInit(model, example, capacity, capacity / 100 * 40);
+    double perRecord = (double)replay(e.policy, model) / MODEL_RECORDS;
+    TEST_ASSERT_FLOAT_WITHIN_MESSAGE(e.usPerRecord * 0.01, e.usPerRecord, perRecord, policyNames[e.policy]);
+  }
+}
+
+// The policies at other fill levels, for the board the FSCAL line came from
+void test_policy_ranking(void) {
+  static const float fills[] = {0.2f, 0.5f, 0.8f, 0.95f};
+  char line[128];
+  snprintf(line, sizeof(line), "%-18s %10s %10s %10s %10s  (us/record at SPIFFS fill)", "policy", "20%", "50%",
+           "80%", "95%");
+  TEST_MESSAGE(line);
+  for (int p = 0; p < POLICY_COUNT; p++) {
+    int length = snprintf(line, sizeof(line), "%-18s", policyNames[p]);
+    for (int f = 0; f < 4; f++) {
+      FlashModel model;
+      uint64_t us = replayPolicy((WritePolicy)p, fills[f], model);
+      length += snprintf(line + length, sizeof(line) - length, " %10.1f", (double)us / MODEL_RECORDS);
+    }
+    TEST_MESSAGE(line);
+  }
+}
+
+int main(void) {
+  const char *line = getenv("FSCAL");
+  if (!line) line = EXAMPLE_FSCAL;
+  if (!parseFsCal(line, strlen(line), calibrated)) {
+    printf("FSCAL line not understood: %s\n", line);
+    return 1;
+  }
+  UNITY_BEGIN();
+  RUN_TEST(test_parse_fscal);
+  RUN_TEST(test_stall_rate_follows_fill);
+  RUN_TEST(test_buffered_appends_program_whole_pages);
+  RUN_TEST(test_model_reproduces_calibration);
+  RUN_TEST(test_policy_ranking);
+  return UNITY_END();
+}
@@ -0,0 +1,138 @@
+// Record codec, name rules and the strict parsers behind the serial commands
+#include <SessionFormat.h>
+#include <string.h>
+#include <unity.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static bool parse(const char *text, int minValue, int maxValue, int &value) {
+  return parseNumber(text, strlen(text), minValue, maxValue, value);
+}
+
+static bool build(const char *input, char *path) {
+  return buildSessionFileName(input, strlen(input), path, MAX_PATH_LENGTH + 1);
+}
+
+void test_checksum_is_fnv1a(void) {
+  TEST_ASSERT_EQUAL_HEX32(0x811C9DC5UL, checksum32(nullptr, 0));
+  TEST_ASSERT_EQUAL_HEX32(0xE40C292CUL, checksum32("a", 1));
+  TEST_ASSERT_EQUAL_HEX32(0xBF9CF968UL, checksum32("foobar", 6));
+  // Chaining over parts gives the checksum of the whole
+  TEST_ASSERT_EQUAL_HEX32(checksum32("foobar", 6), checksum32("bar", 3, checksum32("foo", 3)));
+}
+
+void test_header_round_trip(void) {
+  SessionHeader header = makeSessionHeader();
+  TEST_ASSERT_TRUE(sessionHeaderValid(header));
+  TEST_ASSERT_EQUAL(SESSION_HEADER_SIZE, header.headerSize);
+  TEST_ASSERT_EQUAL(sizeof(EventRecord), header.recordSize);
+  header.magic ^= 1;
+  TEST_ASSERT_FALSE(sessionHeaderValid(header));
+  header = makeSessionHeader();
+  header.recordSize = 0;
+  TEST_ASSERT_FALSE(sessionHeaderValid(header));
+}
+
+void test_record_decode_other_sizes(void) {
+  EventRecord record = {123456789, REC_PRESS, 4, 7, REC_FLAG_HOLD, 0xAABBCCDD};
+  uint8_t buffer[32];
+  memset(buffer, 0x5A, sizeof(buffer));
+  memcpy(buffer, &record, sizeof(record));
+  EventRecord decoded;
+  // A later version's longer record keeps the fields this one knows
+  decodeRecord(buffer, sizeof(buffer), decoded);
+  TEST_ASSERT_EQUAL_MEMORY(&record, &decoded, sizeof(record));
+  // A shorter one leaves the missing fields zero
+  decodeRecord(buffer, 12, decoded);
+  TEST_ASSERT_EQUAL_UINT64(record.timeUs, decoded.timeUs);
+  TEST_ASSERT_EQUAL(REC_PRESS, decoded.type);
+  TEST_ASSERT_EQUAL_UINT32(0, decoded.value);
+}
+
+void test_parse_number_is_strict(void) {
+  int value = -1;
+  TEST_ASSERT_TRUE(parse("42", 1, 50, value));
+  TEST_ASSERT_EQUAL_INT(42, value);
+  TEST_ASSERT_FALSE(parse("51", 1, 50, value));
+  TEST_ASSERT_FALSE(parse("0", 1, 50, value));
+  TEST_ASSERT_FALSE(parse("", 0, 50, value));
+  TEST_ASSERT_FALSE(parse("0x", 0, 50, value));
+  TEST_ASSERT_FALSE(parse("-1", -5, 50, value));
+  TEST_ASSERT_FALSE(parse(" 1", 0, 50, value));
+  TEST_ASSERT_FALSE(parse("1234567890", 0, 2000000000, value));
+  // Only the given length is read
+  TEST_ASSERT_TRUE(parseNumber("12:34", 2, 0, 99, value));
+  TEST_ASSERT_EQUAL_INT(12, value);
+}
+
+void test_parse_epoch_ms(void) {
+  int64_t epochMs = 0;
+  TEST_ASSERT_TRUE(parseEpochMs("1718000000123", 13, epochMs));
+  TEST_ASSERT_EQUAL_INT64(1718000000123LL, epochMs);
+  TEST_ASSERT_FALSE(parseEpochMs("0", 1, epochMs));
+  TEST_ASSERT_FALSE(parseEpochMs("1718000000123.5", 15, epochMs));
+  TEST_ASSERT_FALSE(parseEpochMs("1234567890123456", 16, epochMs));
+}
+
+void test_session_names(void) {
+  char path[MAX_PATH_LENGTH + 1];
+  TEST_ASSERT_TRUE(build("take_04", path));
+  TEST_ASSERT_EQUAL_STRING("/take_04.bin", path);
+  TEST_ASSERT_TRUE(build("/scene-12.v2", path));
+  TEST_ASSERT_EQUAL_STRING("/scene-12.v2.bin", path);
+  // Internal files are "/.<name>"; a typed name must never land on one
+  TEST_ASSERT_FALSE(build(".spare0", path));
+  TEST_ASSERT_FALSE(build("/.manifest", path));
+  TEST_ASSERT_FALSE(build("/", path));
+  TEST_ASSERT_FALSE(build("", path));
+  TEST_ASSERT_FALSE(build("a b", path));
+  TEST_ASSERT_FALSE(build("a/b", path));
+  // The extension has to fit in the SPIFFS name limit too
+  TEST_ASSERT_TRUE(build("abcdefghijklmnopqrstuvwxyz", path));
+  TEST_ASSERT_EQUAL(MAX_PATH_LENGTH, strlen(path));
+  TEST_ASSERT_FALSE(build("abcdefghijklmnopqrstuvwxyz0", path));
+}
+
+void test_meta_fields(void) {
+  SessionMeta meta = {};
+  const char *text = "  operator=ann scene=12  take=3 device=1A2b ";
+  int fields = parseMetaFields(text, strlen(text), meta);
+  TEST_ASSERT_EQUAL_INT(META_OPERATOR | META_SCENE | META_TAKE | META_DEVICE, fields);
+  TEST_ASSERT_EQUAL_STRING("ann", meta.operatorName);
+  TEST_ASSERT_EQUAL_STRING("12", meta.scene);
+  TEST_ASSERT_EQUAL_STRING("3", meta.take);
+  TEST_ASSERT_EQUAL_HEX32(0x1A2B, meta.deviceId);
+
+  SessionMeta filter = {};
+  text = "OPERATOR=x";
+  TEST_ASSERT_EQUAL_INT(-1, parseMetaFields(text, strlen(text), filter));
+  text = "operator=ANN";
+  fields = parseMetaFields(text, strlen(text), filter);
+  TEST_ASSERT_TRUE(metaMatches(meta, filter, fields));
+  text = "scene=13";
+  fields = parseMetaFields(text, strlen(text), filter);
+  TEST_ASSERT_FALSE(metaMatches(meta, filter, fields));
+
+  // Values that would not leave room for the terminator are refused
+  text = "scene=12345678";
+  TEST_ASSERT_EQUAL_INT(-1, parseMetaFields(text, strlen(text), filter));
+  text = "device=123456789";
+  TEST_ASSERT_EQUAL_INT(-1, parseMetaFields(text, strlen(text), filter));
+  text = "take=a;b";
+  TEST_ASSERT_EQUAL_INT(-1, parseMetaFields(text, strlen(text), filter));
+  text = "=3";
+  TEST_ASSERT_EQUAL_INT(-1, parseMetaFields(text, strlen(text), filter));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_checksum_is_fnv1a);
+  RUN_TEST(test_header_round_trip);
+  RUN_TEST(test_record_decode_other_sizes);
+  RUN_TEST(test_parse_number_is_strict);
+  RUN_TEST(test_parse_epoch_ms);
+  RUN_TEST(test_session_names);
+  RUN_TEST(test_meta_fields);
+  return UNITY_END();
+}
@@ -0,0 +1,182 @@
+// Query parsing and the block index: an indexed query must find exactly
+// what a full scan finds
+#include <SessionQuery.h>
+#include <TraceGenerator.h>
+#include <string.h>
+#include <unity.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static bool parse(const char *text, QueryOp &op, QueryFilter &filter) {
+  return parseQuery(text, strlen(text), op, filter);
+}
+
+static bool parseTime(const char *text, usec_t &timeUs) {
+  return parseQueryTime(text, strlen(text), timeUs);
+}
+
+void test_query_time_forms(void) {
+  usec_t timeUs = 0;
+  TEST_ASSERT_TRUE(parseTime("90", timeUs));
+  TEST_ASSERT_EQUAL_UINT64(90000000ULL, timeUs);
+  TEST_ASSERT_TRUE(parseTime("1:30.25", timeUs));
+  TEST_ASSERT_EQUAL_UINT64(90250000ULL, timeUs);
+  TEST_ASSERT_TRUE(parseTime("2:00:00", timeUs));
+  TEST_ASSERT_EQUAL_UINT64(7200000000ULL, timeUs);
+  TEST_ASSERT_TRUE(parseTime("0.000001", timeUs));
+  TEST_ASSERT_EQUAL_UINT64(1, timeUs);
+  TEST_ASSERT_FALSE(parseTime("", timeUs));
+  TEST_ASSERT_FALSE(parseTime("1..5", timeUs));
+  TEST_ASSERT_FALSE(parseTime("1.5.2", timeUs));
+  TEST_ASSERT_FALSE(parseTime("1.5:00", timeUs));
+  TEST_ASSERT_FALSE(parseTime("1::00", timeUs));
+  TEST_ASSERT_FALSE(parseTime(":30", timeUs));
+  TEST_ASSERT_FALSE(parseTime("-5", timeUs));
+  // Would wrap the microsecond count
+  TEST_ASSERT_FALSE(parseTime("99999999999999999999", timeUs));
+  TEST_ASSERT_FALSE(parseTime("9999999999:00:00", timeUs));
+}
+
+void test_parse_query(void) {
+  QueryOp op;
+  QueryFilter filter;
+  TEST_ASSERT_TRUE(parse("count", op, filter));
+  TEST_ASSERT_EQUAL(QUERY_COUNT, op);
+  TEST_ASSERT_EQUAL_INT(-1, filter.key);
+  TEST_ASSERT_EQUAL(0, filter.type);
+  TEST_ASSERT_EQUAL_UINT64((usec_t)-1, filter.toUs);
+
+  char text[64];
+  snprintf(text, sizeof(text), " list  key=%s_hold from=1:00 to=2:00 ", keyMap[1].name);
+  TEST_ASSERT_TRUE(parse(text, op, filter));
+  TEST_ASSERT_EQUAL(QUERY_LIST, op);
+  TEST_ASSERT_EQUAL_INT(1, filter.key);
+  TEST_ASSERT_TRUE(filter.hold);
+  TEST_ASSERT_EQUAL(REC_PRESS, filter.type);
+  TEST_ASSERT_EQUAL_UINT64(60000000ULL, filter.fromUs);
+  TEST_ASSERT_EQUAL_UINT64(120000000ULL, filter.toUs);
+
+  snprintf(text, sizeof(text), "last type=%s", recordTypeNames[REC_SYNC]);
+  TEST_ASSERT_TRUE(parse(text, op, filter));
+  TEST_ASSERT_EQUAL(QUERY_LAST, op);
+  TEST_ASSERT_EQUAL(REC_SYNC, filter.type);
+
+  TEST_ASSERT_FALSE(parse("", op, filter));
+  TEST_ASSERT_FALSE(parse("sum", op, filter));
+  TEST_ASSERT_FALSE(parse("count key=nosuchkey", op, filter));
+  TEST_ASSERT_FALSE(parse("count type=", op, filter));
+  TEST_ASSERT_FALSE(parse("count =5", op, filter));
+  TEST_ASSERT_FALSE(parse("count from", op, filter));
+  TEST_ASSERT_FALSE(parse("count color=red", op, filter));
+  TEST_ASSERT_FALSE(parse("count from=10 to=5", op, filter));
+}
+
+void test_query_matches(void) {
+  EventRecord press = {5000000, REC_PRESS, 2, 1, 0, 0};
+  EventRecord hold = {6000000, REC_PRESS, 2, 1, REC_FLAG_HOLD, 0};
+  QueryFilter filter = {2, false, REC_PRESS, 0, (usec_t)-1};
+  TEST_ASSERT_TRUE(queryMatches(press, filter));
+  TEST_ASSERT_FALSE(queryMatches(hold, filter));
+  filter.hold = true;
+  TEST_ASSERT_TRUE(queryMatches(hold, filter));
+  filter = {-1, false, 0, 5000001, 6000000};
+  TEST_ASSERT_FALSE(queryMatches(press, filter));
+  TEST_ASSERT_TRUE(queryMatches(hold, filter));
+  filter.type = REC_SYNC;
+  TEST_ASSERT_FALSE(queryMatches(hold, filter));
+}
+
+// Records, block index and a set of filters from one seed; the index is
+// capped at indexMax blocks the way the firmware's is
+static void checkIndexAgainstScan(uint32_t seed, uint32_t records, uint32_t indexMax) {
+  static usec_t blockStart[QUERY_INDEX_MAX];
+  static EventRecord session[QUERY_INDEX_MAX * QUERY_BLOCK_RECORDS * 2];
+  TEST_ASSERT_LESS_OR_EQUAL(sizeof(session) / sizeof(session[0]), records);
+  TraceGenerator gen;
+  traceGenInit(gen, seed);
+  usec_t timeUs = 0;
+  uint32_t blocks = 0;
+  for (uint32_t i = 0; i < records; i++) {
+    session[i] = traceQueryRecord(gen, timeUs);
+    if (i % QUERY_BLOCK_RECORDS == 0 && blocks < indexMax) blockStart[blocks++] = session[i].timeUs;
+  }
+  usec_t spanUs = timeUs;
+  TraceGenerator pick;
+  traceGenInit(pick, seed ^ 0x9E3779B9UL);
+  for (int f = 0; f < 200; f++) {
+    QueryFilter filter = {-1, false, 0, 0, (usec_t)-1};
+    // Open-ended either way, or a range that may start before or end after the session
+    if (traceRange(pick, 0, 2) > 0) filter.fromUs = (usec_t)traceRange(pick, 0, spanUs / 1000 + 2000) * 1000;
+    if (traceRange(pick, 0, 2) > 0) filter.toUs = filter.fromUs + (usec_t)traceRange(pick, 0, spanUs / 3000) * 1000;
+    if (traceRange(pick, 0, 2) == 0) filter.type = traceRange(pick, 0, 1) ? REC_PRESS : REC_SYNC;
+    if (traceRange(pick, 0, 3) == 0) {
+      filter.key = traceRange(pick, 0, keyMapSize - 1);
+      filter.type = REC_PRESS;
+    }
+    uint32_t startBlock, endBlock;
+    queryBlockRange(blockStart, blocks, filter, startBlock, endBlock);
+    TEST_ASSERT_LESS_OR_EQUAL(endBlock, startBlock);
+    TEST_ASSERT_LESS_OR_EQUAL(blocks, endBlock);
+    uint32_t first = startBlock * QUERY_BLOCK_RECORDS;
+    uint32_t end = endBlock < blocks ? endBlock * QUERY_BLOCK_RECORDS : records;
+    uint32_t full = 0, indexed = 0;
+    usec_t fullFirst = 0, fullLast = 0, indexedFirst = 0, indexedLast = 0;
+    for (uint32_t i = 0; i < records; i++) {
+      if (!queryMatches(session[i], filter)) continue;
+      if (full++ == 0) fullFirst = session[i].timeUs;
+      fullLast = session[i].timeUs;
+      if (i < first || i >= end) continue;
+      if (indexed++ == 0) indexedFirst = session[i].timeUs;
+      indexedLast = session[i].timeUs;
+    }
+    TEST_ASSERT_EQUAL_UINT32(full, indexed);
+    TEST_ASSERT_EQUAL_UINT64(fullFirst, indexedFirst);
+    TEST_ASSERT_EQUAL_UINT64(fullLast, indexedLast);
+  }
+}
+
+void test_index_matches_full_scan(void) {
+  for (uint32_t seed = 1; seed <= 200; seed++) {
+    checkIndexAgainstScan(seed, 2000 + seed * 7, QUERY_INDEX_MAX);
+  }
+}
+
+// Past QUERY_INDEX_MAX blocks the tail is scanned, not skipped
+void test_index_cap_scans_the_tail(void) {
+  for (uint32_t seed = 1; seed <= 20; seed++) {
+    checkIndexAgainstScan(seed, QUERY_INDEX_MAX * QUERY_BLOCK_RECORDS + 500 * seed, QUERY_INDEX_MAX);
+    checkIndexAgainstScan(seed, 3000, 4);
+  }
+}
+
+void test_index_edge_cases(void) {
+  QueryFilter filter = {-1, false, 0, 0, (usec_t)-1};
+  uint32_t startBlock = 99, endBlock = 99;
+  queryBlockRange(nullptr, 0, filter, startBlock, endBlock);
+  TEST_ASSERT_EQUAL_UINT32(0, startBlock);
+  TEST_ASSERT_EQUAL_UINT32(0, endBlock);
+  usec_t blockStart[] = {0, 10000000, 20000000, 30000000};
+  filter.fromUs = 25000000;
+  filter.toUs = 26000000;
+  queryBlockRange(blockStart, 4, filter, startBlock, endBlock);
+  TEST_ASSERT_EQUAL_UINT32(2, startBlock);
+  TEST_ASSERT_EQUAL_UINT32(3, endBlock);
+  // A range past the last indexed block runs on to the end
+  filter.fromUs = 90000000;
+  filter.toUs = (usec_t)-1;
+  queryBlockRange(blockStart, 4, filter, startBlock, endBlock);
+  TEST_ASSERT_EQUAL_UINT32(3, startBlock);
+  TEST_ASSERT_EQUAL_UINT32(4, endBlock);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_query_time_forms);
+  RUN_TEST(test_parse_query);
+  RUN_TEST(test_query_matches);
+  RUN_TEST(test_index_matches_full_scan);
+  RUN_TEST(test_index_cap_scans_the_tail);
+  RUN_TEST(test_index_edge_cases);
+  return UNITY_END();
+}
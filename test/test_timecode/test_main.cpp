@@ -0,0 +1,106 @@
+// SMPTE timecode labels, the tc command and anchoring sessions to timecode
+#include <SessionTime.h>
+#include <string.h>
+#include <unity.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static bool command(const char *text, TimecodeRate &rate, uint32_t &frame) {
+  return parseTimecodeCommand(text, strlen(text), rate, frame);
+}
+
+// Every frame of the day formats to a label that parses back to it
+static void checkRoundTrip(TimecodeRate rate, uint32_t step) {
+  uint32_t perDay = rate.fps * 86400;
+  if (rate.dropFrame) perDay -= rate.fps / 15 * 9 * 144;
+  char text[16];
+  for (uint32_t frame = 0; frame < perDay; frame += step) {
+    formatTimecode(frame, rate, text, sizeof(text));
+    uint32_t parsed = 0;
+    if (!parseTimecode(text, strlen(text), rate, parsed) || parsed != frame) {
+      TEST_FAIL_MESSAGE(text);
+    }
+  }
+  formatTimecode(perDay, rate, text, sizeof(text));
+  TEST_ASSERT_EQUAL_STRING(rate.dropFrame ? "00:00:00;00" : "00:00:00:00", text);
+}
+
+void test_timecode_round_trip(void) {
+  checkRoundTrip({30, true, true}, 1);
+  checkRoundTrip({60, true, true}, 1);
+  checkRoundTrip({25, false, false}, 7);
+  checkRoundTrip({24, true, false}, 7);
+}
+
+void test_drop_frame_labels(void) {
+  TimecodeRate rate = {30, true, true};
+  char text[16];
+  formatTimecode(1799, rate, text, sizeof(text));
+  TEST_ASSERT_EQUAL_STRING("00:00:59;29", text);
+  formatTimecode(1800, rate, text, sizeof(text));
+  TEST_ASSERT_EQUAL_STRING("00:01:00;02", text);
+  formatTimecode(17982, rate, text, sizeof(text));
+  TEST_ASSERT_EQUAL_STRING("00:10:00;00", text);
+  uint32_t frame = 0;
+  TEST_ASSERT_FALSE(parseTimecode("00:01:00;01", 11, rate, frame));
+  TEST_ASSERT_TRUE(parseTimecode("00:10:00;01", 11, rate, frame));
+  TEST_ASSERT_EQUAL_UINT32(17983, frame);
+}
+
+void test_timecode_command(void) {
+  TimecodeRate rate = {25, false, false};
+  uint32_t frame = 0;
+  TEST_ASSERT_TRUE(command("01:00:00:00", rate, frame));
+  TEST_ASSERT_EQUAL_UINT32(90000, frame);
+  TEST_ASSERT_EQUAL(25, rate.fps);
+  // ';' alone means 29.97 drop-frame
+  TEST_ASSERT_TRUE(command(" 01:00:00;00 ", rate, frame));
+  TEST_ASSERT_TRUE(rate.ntsc && rate.dropFrame && rate.fps == 30);
+  TEST_ASSERT_EQUAL_UINT32(107892, frame);
+  TEST_ASSERT_TRUE(command("00:00:10:00 59.94 df", rate, frame));
+  TEST_ASSERT_TRUE(rate.dropFrame && rate.fps == 60);
+  TEST_ASSERT_TRUE(command("00:00:10:00 30", rate, frame));
+  TEST_ASSERT_FALSE(rate.dropFrame);
+  TEST_ASSERT_EQUAL_UINT32(300, frame);
+
+  TEST_ASSERT_FALSE(command("00:00:10:00 24 df", rate, frame));
+  TEST_ASSERT_FALSE(command("00:00:10:00 25 x", rate, frame));
+  TEST_ASSERT_FALSE(command("00:00:10:00 25 df df", rate, frame));
+  TEST_ASSERT_FALSE(command("00:00:10:00 26", rate, frame));
+  TEST_ASSERT_FALSE(command("00:00:10:25 25", rate, frame));
+  TEST_ASSERT_FALSE(command("24:00:00:00", rate, frame));
+  TEST_ASSERT_FALSE(command("0:00:10:00", rate, frame));
+  TEST_ASSERT_FALSE(command("", rate, frame));
+}
+
+void test_timecode_record_snaps_to_next_frame(void) {
+  TimecodeAnchor anchor = {true, {25, false, false}, 90000, 1000000};
+  EventRecord record;
+  // Anchor set 10 ms before the session: first boundary is 30 ms in
+  TEST_ASSERT_TRUE(makeTimecodeRecordAt(anchor, 1010000, record));
+  TEST_ASSERT_EQUAL(REC_TIMECODE, record.type);
+  TEST_ASSERT_EQUAL_UINT64(30000, record.timeUs);
+  TEST_ASSERT_EQUAL_UINT32(90001, record.value);
+  // Anchor set during the session stays where it was
+  TEST_ASSERT_TRUE(makeTimecodeRecordAt(anchor, 500000, record));
+  TEST_ASSERT_EQUAL_UINT64(500000, record.timeUs);
+  TEST_ASSERT_EQUAL_UINT32(90000, record.value);
+  // And reads back as the same anchor
+  SessionTiming timing = {};
+  addTimingRecord(timing, record);
+  TEST_ASSERT_TRUE(timing.timecode.set);
+  TEST_ASSERT_EQUAL_UINT32(90000, timing.timecode.frame);
+  TEST_ASSERT_EQUAL(25, timing.timecode.rate.fps);
+  anchor.set = false;
+  TEST_ASSERT_FALSE(makeTimecodeRecordAt(anchor, 0, record));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_timecode_round_trip);
+  RUN_TEST(test_drop_frame_labels);
+  RUN_TEST(test_timecode_command);
+  RUN_TEST(test_timecode_record_snaps_to_next_frame);
+  return UNITY_END();
+}
@@ -0,0 +1,213 @@
+// Randomized press traces through the capture decisions, checked against
+// the same invariants as the firmware's 'selftest', over many seeds
+#include <SessionCapture.h>
+#include <TraceGenerator.h>
+#include <unity.h>
+
+#define TRACE_SEEDS 300
+#define TRACE_EVENTS 5000
+#define MILLIS_WRAP_US 4294967296000ULL   // Where a 32-bit millis() wraps
+
+void setUp(void) {}
+void tearDown(void) {}
+
+// What acceptPress(), handleButtonPress() and logCommand() keep per session
+struct CaptureState {
+  usec_t lastAcceptedUs;
+  PressState press;
+  uint32_t accepted, taps, holds, suppressed, unmapped;
+};
+
+struct TraceStats {
+  uint32_t repeats, unmapped, idles, bursts;
+  bool crossedWrap;
+};
+
+static void captureInit(CaptureState &state, usec_t startUs) {
+  state = {};
+  state.lastAcceptedUs = startUs - PRESS_DEBOUNCE_US;
+  pressStateInit(state.press, startUs);
+}
+
+// Returns the record logged for the press, if any
+static bool capture(CaptureState &state, const TracePress &press, EventRecord &record) {
+  if (!debounceAccept(state.lastAcceptedUs, press.timeUs)) return false;
+  state.accepted++;
+  int keyIndex;
+  PressKind kind = capturePress(state.press, press.command, press.repeat, keyIndex);
+  if (keyIndex < 0) {
+    state.unmapped++;
+    return false;
+  }
+  if (kind == PRESS_SUPPRESS) {
+    state.suppressed++;
+    return false;
+  }
+  kind == PRESS_HOLD ? state.holds++ : state.taps++;
+  record = pressRecord(state.press, keyIndex, kind, press.timeUs);
+  return true;
+}
+
+// Replays one seed; returns a hash of everything logged so runs can be compared
+static uint32_t replay(uint32_t seed, TraceStats &traceStats, CaptureState &state) {
+  TraceGenerator gen;
+  traceGenInit(gen, seed);
+  traceStats = {};
+  usec_t startUs = gen.timeUs;
+  captureInit(state, startUs);
+  usec_t previousUs = startUs;
+  usec_t previousClip = 0;
+  bool logged = false;
+  uint32_t hash = checksum32(nullptr, 0);
+  for (int i = 0; i < TRACE_EVENTS; i++) {
+    TracePress press = traceGenNext(gen);
+    TEST_ASSERT_GREATER_THAN(previousUs, press.timeUs);
+    usec_t gapUs = press.timeUs - previousUs;
+    if (press.repeat) traceStats.repeats++;
+    if (gapUs >= 60000000ULL) traceStats.idles++;
+    if (gapUs < 1000000ULL && !press.repeat) traceStats.bursts++;
+    if (keyIndexForCode(press.command) < 0) traceStats.unmapped++;
+    if (previousUs < MILLIS_WRAP_US && press.timeUs >= MILLIS_WRAP_US) traceStats.crossedWrap = true;
+    previousUs = press.timeUs;
+
+    // Anything spaced at least the debounce interval from the last accepted press gets in
+    bool expectAccept = press.timeUs - state.lastAcceptedUs >= PRESS_DEBOUNCE_US;
+    uint32_t acceptedBefore = state.accepted;
+    EventRecord record;
+    if (capture(state, press, record)) {
+      if (logged) TEST_ASSERT_GREATER_OR_EQUAL(previousClip, record.timeUs);
+      TEST_ASSERT_TRUE(record.track >= 1 && record.track <= MAX_TRACK_INDEX);
+      previousClip = record.timeUs;
+      logged = true;
+      hash = checksum32(&record, sizeof(record), hash);
+    }
+    TEST_ASSERT_EQUAL(expectAccept, state.accepted != acceptedBefore);
+  }
+  return hash;
+}
+
+void test_traces_keep_capture_invariants(void) {
+  TraceStats total = {};
+  uint32_t wrapSeeds = 0, taps = 0, holds = 0, suppressed = 0, unmapped = 0;
+  for (uint32_t seed = 1; seed <= TRACE_SEEDS; seed++) {
+    TraceStats traceStats;
+    CaptureState state;
+    replay(seed, traceStats, state);
+    total.repeats += traceStats.repeats;
+    total.unmapped += traceStats.unmapped;
+    total.idles += traceStats.idles;
+    total.bursts += traceStats.bursts;
+    if (traceStats.crossedWrap) wrapSeeds++;
+    taps += state.taps;
+    holds += state.holds;
+    suppressed += state.suppressed;
+    unmapped += state.unmapped;
+  }
+  // The traces exercise what they are meant to
+  TEST_ASSERT_EQUAL_UINT32(TRACE_SEEDS, wrapSeeds);
+  TEST_ASSERT_GREATER_THAN(0, total.repeats);
+  TEST_ASSERT_GREATER_THAN(0, total.unmapped);
+  TEST_ASSERT_GREATER_THAN(0, total.idles);
+  TEST_ASSERT_GREATER_THAN(0, total.bursts);
+  TEST_ASSERT_GREATER_THAN(0, taps);
+  TEST_ASSERT_GREATER_THAN(0, holds);
+  TEST_ASSERT_GREATER_THAN(0, suppressed);
+  TEST_ASSERT_GREATER_THAN(0, unmapped);
+}
+
+void test_traces_are_deterministic(void) {
+  for (uint32_t seed = 1; seed <= 20; seed++) {
+    TraceStats traceStats;
+    CaptureState state;
+    uint32_t first = replay(seed, traceStats, state);
+    TEST_ASSERT_EQUAL_HEX32(first, replay(seed, traceStats, state));
+    TEST_ASSERT_TRUE(first != replay(seed + 1000, traceStats, state));
+  }
+  // Seed 0 is taken as 1 rather than sticking xorshift at zero
+  TraceGenerator zero, one;
+  traceGenInit(zero, 0);
+  traceGenInit(one, 1);
+  TEST_ASSERT_EQUAL_UINT64(one.timeUs, zero.timeUs);
+}
+
+void test_debounce(void) {
+  usec_t lastUs = MILLIS_WRAP_US - 200000;
+  TEST_ASSERT_FALSE(debounceAccept(lastUs, MILLIS_WRAP_US + 299999));
+  TEST_ASSERT_EQUAL_UINT64(MILLIS_WRAP_US - 200000, lastUs);
+  TEST_ASSERT_TRUE(debounceAccept(lastUs, MILLIS_WRAP_US + 300000));
+  TEST_ASSERT_EQUAL_UINT64(MILLIS_WRAP_US + 300000, lastUs);
+}
+
+void test_hold_logs_once(void) {
+  bool holdLogged = false;
+  TEST_ASSERT_EQUAL(PRESS_TAP, classifyPress(false, holdLogged));
+  TEST_ASSERT_EQUAL(PRESS_HOLD, classifyPress(true, holdLogged));
+  TEST_ASSERT_EQUAL(PRESS_SUPPRESS, classifyPress(true, holdLogged));
+  TEST_ASSERT_EQUAL(PRESS_TAP, classifyPress(false, holdLogged));
+  TEST_ASSERT_EQUAL(PRESS_HOLD, classifyPress(true, holdLogged));
+}
+
+void test_track_stacking(void) {
+  TEST_ASSERT_EQUAL_INT(2, stackTrack(1500000, 1000000, 1));
+  TEST_ASSERT_EQUAL_INT(1, stackTrack(2000000, 1000000, 5));
+  TEST_ASSERT_EQUAL_INT(MAX_TRACK_INDEX, stackTrack(1000001, 1000000, MAX_TRACK_INDEX));
+}
+
+// The record logCommand() writes: session-relative, stacked, hold flagged
+void test_press_record(void) {
+  PressState state;
+  pressStateInit(state, 5000000);
+  EventRecord record = pressRecord(state, 2, PRESS_TAP, 7000000);
+  TEST_ASSERT_EQUAL_UINT64(2000000, record.timeUs);
+  TEST_ASSERT_EQUAL(REC_PRESS, record.type);
+  TEST_ASSERT_EQUAL(2, record.key);
+  TEST_ASSERT_EQUAL(1, record.track);
+  TEST_ASSERT_EQUAL(0, record.flags);
+  record = pressRecord(state, 3, PRESS_HOLD, 7600000);
+  TEST_ASSERT_EQUAL(2, record.track);
+  TEST_ASSERT_EQUAL(REC_FLAG_HOLD, record.flags);
+  TEST_ASSERT_EQUAL(3, state.lastKey);
+  TEST_ASSERT_EQUAL_UINT64(7600000, state.lastButton);
+  int keyIndex = 0;
+  TEST_ASSERT_EQUAL(PRESS_SUPPRESS, capturePress(state, 0x1234, false, keyIndex));
+  TEST_ASSERT_EQUAL(-1, keyIndex);
+}
+
+void test_key_lookup(void) {
+  for (int i = 0; i < keyMapSize; i++) {
+    TEST_ASSERT_EQUAL_INT(i, keyIndexForCode(keyMap[i].code));
+  }
+  int unmapped = 0;
+  for (int code = 0; code < 256; code++) {
+    if (keyIndexForCode(code) < 0) unmapped++;
+  }
+  TEST_ASSERT_EQUAL_INT(256 - keyMapSize, unmapped);
+}
+
+void test_trace_arguments(void) {
+  uint32_t seed = 7;
+  int events = 100;
+  TEST_ASSERT_TRUE(parseTraceArguments("", 0, seed, events));
+  TEST_ASSERT_EQUAL_UINT32(7, seed);
+  TEST_ASSERT_TRUE(parseTraceArguments(" 42 ", 4, seed, events));
+  TEST_ASSERT_EQUAL_UINT32(42, seed);
+  TEST_ASSERT_EQUAL_INT(100, events);
+  TEST_ASSERT_TRUE(parseTraceArguments("9 2500", 6, seed, events));
+  TEST_ASSERT_EQUAL_INT(2500, events);
+  TEST_ASSERT_FALSE(parseTraceArguments("9 0", 3, seed, events));
+  TEST_ASSERT_FALSE(parseTraceArguments("9 100001", 8, seed, events));
+  TEST_ASSERT_FALSE(parseTraceArguments("x", 1, seed, events));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_traces_keep_capture_invariants);
+  RUN_TEST(test_traces_are_deterministic);
+  RUN_TEST(test_debounce);
+  RUN_TEST(test_hold_logs_once);
+  RUN_TEST(test_track_stacking);
+  RUN_TEST(test_press_record);
+  RUN_TEST(test_key_lookup);
+  RUN_TEST(test_trace_arguments);
+  return UNITY_END();
+}
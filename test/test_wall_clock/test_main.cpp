@@ -0,0 +1,65 @@
+// Wall-clock mapping of session time from sync records and drift
+#include <SessionTime.h>
+#include <unity.h>
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_sync_record_rounds_to_whole_second(void) {
+  EventRecord record = makeSyncRecordAt(5000000, 1700000000250000LL);
+  TEST_ASSERT_EQUAL(REC_SYNC, record.type);
+  TEST_ASSERT_EQUAL_UINT64(4750000, record.timeUs);
+  TEST_ASSERT_EQUAL_UINT32(1700000000UL, record.value);
+  // Too early in the session to step back: move on to the next second
+  record = makeSyncRecordAt(100000, 1700000000250000LL);
+  TEST_ASSERT_EQUAL_UINT64(850000, record.timeUs);
+  TEST_ASSERT_EQUAL_UINT32(1700000001UL, record.value);
+}
+
+void test_wall_clock_without_sync_points(void) {
+  SessionTiming timing = {};
+  timing.epochAtZeroUs = 1000;
+  TEST_ASSERT_EQUAL_INT64(1000 + 5000000, sessionWallUs(timing, 5000000));
+  timing.driftPpb = 20000;           // 20 ppm fast
+  TEST_ASSERT_EQUAL_INT64(1000 + 1000000000LL + 20000, sessionWallUs(timing, 1000000000LL));
+  TEST_ASSERT_EQUAL_UINT64(12345, correctedClipTime(timing, 12345));
+}
+
+void test_wall_clock_from_sync_records(void) {
+  SessionTiming timing = {};
+  timing.driftPpb = -10000;
+  addTimingRecord(timing, makeSyncRecordAt(2000000, 1700000000000000LL));
+  finishTiming(timing);
+  // One point: offset from it at the stored drift
+  TEST_ASSERT_EQUAL_INT64(1700000000000000LL - 2000000 + 20, timing.epochAtZeroUs);
+  TEST_ASSERT_EQUAL_INT64(1700000000000000LL + 1000000000LL - 10000, sessionWallUs(timing, 1002000000LL));
+
+  // Two points 1000 s apart on the device that the wall clock saw as 1000.1 s
+  timing = {};
+  addTimingRecord(timing, makeSyncRecordAt(1000000, 1700000000000000LL));
+  addSyncPoint(timing, 1001000000LL, 1700000000000000LL + 1000100000LL);
+  finishTiming(timing);
+  TEST_ASSERT_TRUE(timing.synced);
+  TEST_ASSERT_EQUAL_INT64(1700000000000000LL + 500050000LL, sessionWallUs(timing, 501000000LL));
+  // Past the last point the last segment's rate carries on
+  TEST_ASSERT_EQUAL_INT64(1700000000000000LL + 2000200000LL, sessionWallUs(timing, 2001000000LL));
+  TEST_ASSERT_EQUAL_UINT64(1002000000ULL + 100200, correctedClipTime(timing, 1002000000ULL));
+}
+
+void test_sync_points_keep_spanning_when_full(void) {
+  SessionTiming timing = {};
+  for (int i = 0; i < SYNC_POINTS_MAX + 5; i++) {
+    addSyncPoint(timing, (int64_t)i * 1000000, 1700000000000000LL + (int64_t)i * 1000000);
+  }
+  TEST_ASSERT_EQUAL(SYNC_POINTS_MAX, timing.pointCount);
+  TEST_ASSERT_EQUAL_INT64((int64_t)(SYNC_POINTS_MAX + 4) * 1000000, timing.points[SYNC_POINTS_MAX - 1].timeUs);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_sync_record_rounds_to_whole_second);
+  RUN_TEST(test_wall_clock_without_sync_points);
+  RUN_TEST(test_wall_clock_from_sync_records);
+  RUN_TEST(test_sync_points_keep_spanning_when_full);
+  return UNITY_END();
+}